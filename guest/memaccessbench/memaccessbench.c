@@ -0,0 +1,153 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+/**
+ * Measures the throughput of guest data memory accesses.
+ *
+ * Every load and store of the loop below goes through the softmmu helpers
+ * and s2e_trace_memory_access(), so running the program in S2E with
+ * different plugin sets measures the real CorePlugin notification path
+ * and the listeners connected to it. For example, run it once with each
+ * of the following in s2e-config.lua and compare the reported rates:
+ *
+ *   plugins = { }
+ *   plugins = { "ExecutionTracer", "MemoryTracer" }
+ *   plugins = { "ExecutionTracer", "CacheSim" }
+ *   plugins = { "Interceptor", "ModuleExecutionDetector",
+ *               "ExecutionTracer", "MemoryTracer", "MemoryChecker" }
+ *
+ * MemoryTracer must have monitorMemory = true. The program can also run
+ * natively to get the baseline of the guest itself.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <s2e.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ACCESSES    (10 * 1000 * 1000)
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
+#define DEFAULT_RUNS        3
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Performs count accesses, half loads and half stores, striding
+   through words so that consecutive accesses hit different cache lines. */
+static void run_accesses(volatile uint32_t *buf, unsigned words, unsigned count)
+{
+    unsigned i, idx = 0;
+    for (i = 0; i < count / 2; ++i) {
+        uint32_t v = buf[idx];
+        buf[(idx + 1) & (words - 1)] = v + 1;
+        idx = (idx + 17) & (words - 1);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n accesses] [-b buffer_bytes] [-r runs] [-s]\n"
+                    "  -s  also send the results to the S2E log\n"
+                    "  buffer_bytes must be a power of two\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned count = DEFAULT_ACCESSES;
+    unsigned size = DEFAULT_BUFFER_SIZE;
+    unsigned runs = DEFAULT_RUNS;
+    int use_s2e = 0;
+    volatile uint32_t *buf;
+    unsigned words, run;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            size = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            runs = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-s")) {
+            use_s2e = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    words = size / sizeof(uint32_t);
+    if (!count || !runs || words < 2 || (words & (words - 1))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    buf = calloc(words, sizeof(uint32_t));
+    if (!buf) {
+        perror("calloc");
+        return 1;
+    }
+
+    /* Warm up the TLB and the translation cache */
+    run_accesses(buf, words, words);
+
+    for (run = 0; run < runs; ++run) {
+        char msg[128];
+        double start = now();
+        double elapsed;
+
+        run_accesses(buf, words, count);
+        elapsed = now() - start;
+
+        snprintf(msg, sizeof(msg),
+                 "memaccessbench: run %u: %u accesses in %.3f s, %.2f M accesses/s\n",
+                 run, count, elapsed, count / elapsed / 1e6);
+        fputs(msg, stdout);
+        if (use_s2e) {
+            s2e_message(msg);
+        }
+    }
+
+    free((void*) buf);
+    return 0;
+}
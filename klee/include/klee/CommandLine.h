@@ -17,12 +17,18 @@ extern llvm::cl::opt<bool> UseCexCache;
 
 extern llvm::cl::opt<bool> UseCache;
 
+extern llvm::cl::opt<std::string> SharedQueryCache;
+
+extern llvm::cl::opt<unsigned> SharedQueryCacheSize;
+
 extern llvm::cl::opt<bool> UseIndependentSolver; 
 
 extern llvm::cl::opt<bool> DebugValidateSolver;
   
 extern llvm::cl::opt<bool> CoreSolverOptimizeDivides;
 
+extern llvm::cl::opt<unsigned> SolverWorkers;
+
 ///The different query logging solvers that can switched on/off
 enum QueryLoggingSolverType
 {
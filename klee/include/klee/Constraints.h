@@ -11,6 +11,8 @@
 #define KLEE_CONSTRAINTS_H
 
 #include "klee/Expr.h"
+#include "klee/Internal/ADT/ImmutableMap.h"
+#include "klee/util/ExprHashMap.h"
 #include <llvm/Support/raw_ostream.h>
 
 // FIXME: Currently we use ConstraintManager for two things: to pass
@@ -27,14 +29,30 @@ public:
   typedef constraints_ty::iterator iterator;
   typedef constraints_ty::const_iterator const_iterator;
 
+  /// Maps an expression to the value it is known to have under the
+  /// current constraints. Persistent, so that copies share it.
+  typedef ImmutableMap< ref<Expr>, ref<Expr> > equalities_ty;
+
   ConstraintManager() {}
 
   // create from constraints with no optimization
   explicit
   ConstraintManager(const std::vector< ref<Expr> > &_constraints) :
-    constraints(_constraints) {}
+    constraints(_constraints) {
+    rebuildEqualities();
+  }
 
-  ConstraintManager(const ConstraintManager &cs) : constraints(cs.constraints) {}
+  // The simplification cache is not copied, forked states
+  // quickly diverge anyway.
+  ConstraintManager(const ConstraintManager &cs) :
+    constraints(cs.constraints), equalities(cs.equalities) {}
+
+  ConstraintManager &operator=(const ConstraintManager &cs) {
+    constraints = cs.constraints;
+    equalities = cs.equalities;
+    simplificationCache.clear();
+    return *this;
+  }
 
   typedef std::vector< ref<Expr> >::const_iterator constraint_iterator;
 
@@ -76,10 +94,24 @@ public:
 private:
   std::vector< ref<Expr> > constraints;
 
+  // Equalities implied by the constraints, kept in sync with
+  // the constraints vector instead of being recomputed by
+  // each simplifyExpr call.
+  equalities_ty equalities;
+
+  // simplifyExpr results for the current equalities
+  mutable ExprHashMap< ref<Expr> > simplificationCache;
+
   // returns true iff the constraints were modified
   bool rewriteConstraints(ExprVisitor &visitor);
 
   void addConstraintInternal(ref<Expr> e);
+
+  // appends e to the constraints and records the equality it implies
+  void pushConstraint(ref<Expr> e);
+
+  void addEquality(ref<Expr> e);
+  void rebuildEqualities();
 };
 
 }
@@ -122,8 +122,9 @@ namespace klee {
     /// Return an id for the given constant, creating a new one if necessary.
     unsigned getConstantID(llvm::Constant *c, KInstruction* ki);
 
-    /// Update shadow structures for newly added function
-    KFunction* updateModuleWithFunction(llvm::Function *f);
+    /// Update shadow structures for newly added function. Functions
+    /// that already went through the passes may skip the optimization.
+    KFunction* updateModuleWithFunction(llvm::Function *f, bool optimize = true);
 
     /// Remove function from KModule and call removeFromParend on it
     void removeFunction(llvm::Function *f, bool keepDeclaration = false);
@@ -15,6 +15,7 @@
 
 #include "llvm/ADT/StringExtras.h"
 #include "klee/util/BitArray.h"
+#include "klee/util/ObjectAllocator.h"
 
 #include <vector>
 #include <string>
@@ -26,6 +27,7 @@ namespace llvm {
 namespace klee {
 
 class BitArray;
+class ConcreteBuffer;
 class MemoryManager;
 class Solver;
 
@@ -110,6 +112,9 @@ public:
 
   ~MemoryObject();
 
+  static void *operator new(size_t size) { return ObjectAllocator::alloc(size); }
+  static void operator delete(void *p, size_t size) { ObjectAllocator::free(p, size); }
+
   /// Get an identifying string for this allocation.
   void getAllocInfo(std::string &result) const;
 
@@ -169,6 +174,10 @@ private:
   //XXX: made it public for fast access
   uint8_t *concreteStore;
 
+  // Content-uniqued buffer concreteStore points into when the concrete
+  // bytes are shared with other objects, null when the store is private.
+  ConcreteBuffer *sharedStore;
+
   // XXX cleanup name of flushMask (its backwards or something)
   // mutable because may need flushed during read of const
   mutable BitArray *flushMask;
@@ -183,6 +192,15 @@ public:
 
   bool readOnly;
 
+private:
+  // The store is private but registered as the first copy of its contents
+  // for deduplication.
+  bool dedupIndexed;
+
+  // The concrete contents may have changed since the last
+  // takeDirtyObjects() call.
+  bool dedupDirty;
+
 public:
   /// Create a new object state for the given memory object with concrete
   /// contents. The initial contents are undefined, it is the callers
@@ -196,6 +214,9 @@ public:
   ObjectState(const ObjectState &os);
   ~ObjectState();
 
+  static void *operator new(size_t size) { return ObjectAllocator::alloc(size); }
+  static void operator delete(void *p, size_t size) { ObjectAllocator::free(p, size); }
+
   inline const MemoryObject *getObject() const { return object; }
 
   void setReadOnly(bool ro) { readOnly = ro; }
@@ -247,7 +268,32 @@ public:
   const uint8_t *getConcreteStore(bool allowSymbolic = false) const;
   uint8_t *getConcreteStore(bool allowSymolic = false);
 
+  /// Share the concrete bytes with every other object holding the same
+  /// contents. The object gets a private copy again on the next write, so
+  /// callers must not keep pointers obtained from getConcreteStore() across
+  /// this call.
+  void deduplicate();
+
+  bool isDeduplicated() const { return sharedStore != 0; }
+
+  /// Number of concrete bytes currently saved by deduplication.
+  static uint64_t getDeduplicatedBytes();
+
+  /// Start recording the objects whose concrete contents change (or that
+  /// are created), so that deduplication passes only rescan those.
+  static void enableDirtyTracking();
+
+  /// Moves the objects recorded since the last call to dirty.
+  static void takeDirtyObjects(std::vector<ObjectState*> &dirty);
+
+  /// Records the object again, e.g., to retry it in the next pass.
+  void markDirty();
+
 private:
+  void unshareStore();
+
+  void prepareConcreteWrite();
+
   const UpdateList &getUpdates() const;
 
   void makeConcrete();
@@ -56,6 +56,12 @@ namespace klee {
     virtual void activate() {};
     virtual void deactivate() {};
 
+    // how soon the searcher is going to pick the given state, higher
+    // values are picked first. Used to decide which states to hand off
+    // to another instance when load balancing; searchers that have no
+    // notion of order can leave all states at the same priority.
+    virtual double getPriority(ExecutionState *es) { return 0; }
+
     // utility functions
 
     void addState(ExecutionState *es, ExecutionState *current = 0) {
@@ -85,6 +91,7 @@ namespace klee {
                 const std::set<ExecutionState*> &addedStates,
                 const std::set<ExecutionState*> &removedStates);
     bool empty() { return states.empty(); }
+    double getPriority(ExecutionState *es);
     void printName(llvm::raw_ostream &os) {
       os << "DFSSearcher\n";
     }
@@ -132,6 +139,7 @@ namespace klee {
                 const std::set<ExecutionState*> &addedStates,
                 const std::set<ExecutionState*> &removedStates);
     bool empty();
+    double getPriority(ExecutionState *es) { return getWeight(es); }
     void printName(llvm::raw_ostream &os) {
       os << "WeightedRandomSearcher::";
       switch(type) {
@@ -231,6 +239,9 @@ namespace klee {
                 const std::set<ExecutionState*> &addedStates,
                 const std::set<ExecutionState*> &removedStates);
     bool empty() { return baseSearcher->empty(); }
+    double getPriority(ExecutionState *es) {
+      return baseSearcher->getPriority(es);
+    }
     void printName(llvm::raw_ostream &os) {
       os << "<BatchingSearcher> timeBudget: " << timeBudget
          << ", instructionBudget: " << instructionBudget
@@ -174,6 +174,26 @@ namespace klee {
     virtual void setCoreSolverTimeout(double timeout);
   };
 
+  /// ParallelSTPSolver - A complete solver based on STP which runs each
+  /// query in a child process, like the forked STPSolver. The validity of a
+  /// query and of its negation are checked by two children concurrently.
+  class ParallelSTPSolver : public Solver {
+  public:
+    /// ParallelSTPSolver - Construct a new pool of solver workers.
+    ///
+    /// \param numWorkers - The number of child processes that may run at
+    /// the same time.
+    ParallelSTPSolver(unsigned numWorkers);
+
+    /// getConstraintLog - Return the constraint log for the given state in CVC
+    /// format.
+    char *getConstraintLog(const Query&);
+
+    /// setCoreSolverTimeout - Set constraint solver timeout delay to the given value; 0
+    /// is off.
+    virtual void setCoreSolverTimeout(double timeout);
+  };
+
 #ifdef SUPPORT_METASMT
 
   template<typename SolverContext>
@@ -204,6 +224,16 @@ namespace klee {
   /// \param s - The underlying solver to use.
   Solver *createCachingSolver(Solver *s);
 
+  /// createSharedCachingSolver - Create a solver which caches validity
+  /// results and counterexamples in a memory-mapped file. The cache is shared
+  /// with forked processes and persists across runs.
+  ///
+  /// \param s - The underlying solver to use.
+  /// \param path - The cache file, created if it does not exist.
+  /// \param sizeInMB - The size of a newly created cache file.
+  Solver *createSharedCachingSolver(Solver *s, const std::string &path,
+                                    uint64_t sizeInMB);
+
   /// createCexCachingSolver - Create a counterexample caching solver. This is a
   /// more sophisticated cache which records counterexamples for a constraint
   /// set and uses subset/superset relations among constraints to try and
@@ -12,12 +12,31 @@
 
 #include "klee/Statistic.h"
 
+#include <vector>
+#include <stdint.h>
+
 namespace klee {
+
+  /// SolverWorkerStats - Counters of one ParallelSTPSolver worker.
+  struct SolverWorkerStats {
+    uint64_t queries;
+    /// Number of workers running when this one last started or finished.
+    uint64_t queueDepth;
+    uint64_t maxQueueDepth;
+    /// Total time spent in the solver by this worker, in microseconds.
+    uint64_t latency;
+
+    SolverWorkerStats()
+      : queries(0), queueDepth(0), maxQueueDepth(0), latency(0) {}
+  };
+
 namespace stats {
 
   extern Statistic cexCacheTime;
+  extern Statistic incrementalConstraintsReused;
   extern Statistic queries;
   extern Statistic queriesInvalid;
+  extern Statistic queriesParallel;
   extern Statistic queriesValid;
   extern Statistic queryCacheHits;
   extern Statistic queryCacheMisses;
@@ -25,6 +44,12 @@ namespace stats {
   extern Statistic queryConstructs;
   extern Statistic queryCounterexamples;
   extern Statistic queryTime;
+  extern Statistic sharedCacheDroppedInserts;
+  extern Statistic sharedCacheEvictions;
+  extern Statistic sharedCacheHits;
+  extern Statistic sharedCacheMisses;
+
+  extern std::vector<SolverWorkerStats> solverWorkers;
 
 }
 }
@@ -18,6 +18,7 @@
 
 namespace klee {
   class Array;
+  class AssignmentEvaluator;
 
   class Assignment {
   public:
@@ -25,15 +26,44 @@ namespace klee {
 
     bool allowFreeValues;
     bindings_ty bindings;
-    
+
+  private:
+    /// When set, evaluate() reuses one evaluator across calls so that
+    /// subexpressions shared between queries are only evaluated once
+    /// per set of bindings. Only safe if the bindings are exclusively
+    /// modified through add() and clear(), or invalidateCache() is
+    /// called after modifying them directly.
+    bool cacheEvaluations;
+    mutable AssignmentEvaluator *evaluator;
+
   public:
-    Assignment(bool _allowFreeValues=false)
-        : allowFreeValues(_allowFreeValues) {}
+    Assignment(bool _allowFreeValues=false, bool _cacheEvaluations=false)
+        : allowFreeValues(_allowFreeValues),
+          cacheEvaluations(_cacheEvaluations), evaluator(0) {}
+
+    // The evaluation cache refers to the original bindings
+    // and is never copied.
+    Assignment(const Assignment &a)
+        : allowFreeValues(a.allowFreeValues), bindings(a.bindings),
+          cacheEvaluations(a.cacheEvaluations), evaluator(0) {}
+
+    Assignment &operator=(const Assignment &a) {
+      invalidateCache();
+      allowFreeValues = a.allowFreeValues;
+      bindings = a.bindings;
+      cacheEvaluations = a.cacheEvaluations;
+      return *this;
+    }
+
+    ~Assignment() {
+      invalidateCache();
+    }
 
     Assignment(std::vector<const Array*> &objects, 
                std::vector< std::vector<unsigned char> > &values,
                bool _allowFreeValues=false)
-      : allowFreeValues(_allowFreeValues) {
+      : allowFreeValues(_allowFreeValues),
+        cacheEvaluations(false), evaluator(0) {
       std::vector< std::vector<unsigned char> >::iterator valIt = 
         values.begin();
       for (std::vector<const Array*>::iterator it = objects.begin(),
@@ -49,13 +79,17 @@ namespace klee {
     ref<Expr> evaluate(ref<Expr> e) const;
 
     void add(const Array *object, std::vector<unsigned char> value) {
+        invalidateCache();
         bindings.insert(std::make_pair(object, value));
     }
 
     void clear() {
+        invalidateCache();
         bindings.clear();
     }
 
+    inline void invalidateCache();
+
     template<typename InputIterator>
     bool satisfies(InputIterator begin, InputIterator end);
   };
@@ -63,13 +97,32 @@ namespace klee {
   class AssignmentEvaluator : public ExprEvaluator {
     const Assignment &a;
 
+    // Reads of the same array tend to come in sequence
+    // (e.g., the bytes of a concatenation), remember the
+    // last binding instead of going through the map each time.
+    const Array *lastArray;
+    const std::vector<unsigned char> *lastValues;
+
   protected:
     ref<Expr> getInitialValue(const Array &mo, unsigned index) {
+      if (&mo != lastArray) {
+        Assignment::bindings_ty::const_iterator it = a.bindings.find(&mo);
+        lastArray = &mo;
+        lastValues = it != a.bindings.end() ? &it->second : 0;
+      }
+
+      if (lastValues && index < lastValues->size()) {
+        return ConstantExpr::alloc((*lastValues)[index], Expr::Int8);
+      }
       return a.evaluate(&mo, index);
     }
     
   public:
-    AssignmentEvaluator(const Assignment &_a) : a(_a) {}    
+    AssignmentEvaluator(const Assignment &_a)
+        : a(_a), lastArray(0), lastValues(0) {}
+
+    /// Number of expressions whose value is remembered
+    size_t getCacheSize() const { return getNumVisited(); }
   };
 
   /***/
@@ -92,8 +145,26 @@ namespace klee {
   }
 
   inline ref<Expr> Assignment::evaluate(ref<Expr> e) const {
-      AssignmentEvaluator v(*this);
-      return v.visit(e);
+      if (!cacheEvaluations) {
+        AssignmentEvaluator v(*this);
+        return v.visit(e);
+      }
+
+      // Bound the memory kept alive by the cache
+      if (evaluator && evaluator->getCacheSize() > 100000) {
+        delete evaluator;
+        evaluator = 0;
+      }
+
+      if (!evaluator) {
+        evaluator = new AssignmentEvaluator(*this);
+      }
+      return evaluator->visit(e);
+  }
+
+  inline void Assignment::invalidateCache() {
+    delete evaluator;
+    evaluator = 0;
   }
 
   template<typename InputIterator>
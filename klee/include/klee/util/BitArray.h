@@ -10,11 +10,13 @@
 #ifndef KLEE_UTIL_BITARRAY_H
 #define KLEE_UTIL_BITARRAY_H
 
+#include "klee/util/ObjectAllocator.h"
+
 namespace klee {
 
   // XXX would be nice not to have
   // two allocations here for allocated
-  // BitArrays
+  // BitArrays. Both come from the ObjectAllocator.
 class BitArray {
 private:
   // XXX(s2e) for now we keep this first to access from C code
@@ -24,14 +26,27 @@ private:
 protected:
   static uint32_t length(unsigned size) { return (size+31)/32; }
 
+  // The size is not stored, the first word holds it
+  static uint32_t *allocBits(unsigned size) {
+    uint32_t *b = static_cast<uint32_t*>(
+        ObjectAllocator::alloc(sizeof(uint32_t) * (length(size) + 1)));
+    b[0] = size;
+    return b + 1;
+  }
+
 public:
-  BitArray(unsigned size, bool value = false) : bits(new uint32_t[length(size)]) {
+  BitArray(unsigned size, bool value = false) : bits(allocBits(size)) {
     memset(bits, value?0xFF:0, sizeof(*bits)*length(size));
   }
-  BitArray(const BitArray &b, unsigned size) : bits(new uint32_t[length(size)]) {
+  BitArray(const BitArray &b, unsigned size) : bits(allocBits(size)) {
     memcpy(bits, b.bits, sizeof(*bits)*length(size));
   }
-  ~BitArray() { delete[] bits; }
+  ~BitArray() {
+    ObjectAllocator::free(bits - 1, sizeof(uint32_t) * (length(bits[-1]) + 1));
+  }
+
+  static void *operator new(size_t size) { return ObjectAllocator::alloc(size); }
+  static void operator delete(void *p, size_t size) { ObjectAllocator::free(p, size); }
 
   inline bool get(unsigned idx) { return (bool) ((bits[idx/32]>>(idx&0x1F))&1); }
   inline void set(unsigned idx) { bits[idx/32] |= 1<<(idx&0x1F); }
@@ -80,6 +80,8 @@ namespace klee {
     virtual Action visitSgt(const SgtExpr&);
     virtual Action visitSge(const SgeExpr&);
 
+    size_t getNumVisited() const { return visited.size(); }
+
   private:
     typedef ExprHashMap< ref<Expr> > visited_ty;
     visited_ty visited;
@@ -0,0 +1,62 @@
+//===-- ObjectAllocator.h ---------------------------------------*- C++ -*-===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KLEE_UTIL_OBJECTALLOCATOR_H
+#define KLEE_UTIL_OBJECTALLOCATOR_H
+
+#include <new>
+#include <stddef.h>
+
+namespace klee {
+
+/// Source of the small blocks making up memory objects, object states,
+/// their concrete stores and their masks. These are created and destroyed
+/// on every fork and state termination, clients may replace the heap with
+/// a pool better suited to this pattern.
+///
+/// Whether a block comes from the allocator only depends on its size, so
+/// the allocator must be installed before the first allocation and stay
+/// installed until exit.
+class ObjectAllocator {
+  static ObjectAllocator *current;
+
+public:
+  virtual ~ObjectAllocator() {}
+
+  /// True if blocks of this size come from this allocator.
+  virtual bool handles(size_t size) const = 0;
+
+  /// Returns 0 when out of memory.
+  virtual void *allocate(size_t size) = 0;
+  virtual void deallocate(void *p, size_t size) = 0;
+
+  static void set(ObjectAllocator *allocator);
+
+  static void *alloc(size_t size) {
+    if (current && current->handles(size)) {
+      if (void *p = current->allocate(size))
+        return p;
+      throw std::bad_alloc();
+    }
+    return ::operator new(size);
+  }
+
+  static void free(void *p, size_t size) {
+    if (!p)
+      return;
+    if (current && current->handles(size))
+      current->deallocate(p, size);
+    else
+      ::operator delete(p);
+  }
+};
+
+} // End klee namespace
+
+#endif
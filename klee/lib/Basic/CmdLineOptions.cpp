@@ -22,6 +22,16 @@ UseCache("use-cache",
          llvm::cl::init(true),
          llvm::cl::desc("Use validity caching (default=on)"));
 
+llvm::cl::opt<std::string>
+SharedQueryCache("shared-query-cache",
+                 llvm::cl::desc("Memory-mapped query cache file, shared by forked processes and reused across runs (default=off)"),
+                 llvm::cl::init(""));
+
+llvm::cl::opt<unsigned>
+SharedQueryCacheSize("shared-query-cache-size",
+                     llvm::cl::desc("Size in MB of a newly created shared query cache (default=256)"),
+                     llvm::cl::init(256));
+
 llvm::cl::opt<bool>
 UseIndependentSolver("use-independent-solver",
                      llvm::cl::init(true),
@@ -37,6 +47,11 @@ CoreSolverOptimizeDivides("solver-optimize-divides",
                  llvm::cl::desc("Optimize constant divides into add/shift/multiplies before passing to core SMT solver (default=on)"),
                  llvm::cl::init(true));
 
+llvm::cl::opt<unsigned>
+SolverWorkers("solver-workers",
+              llvm::cl::desc("Number of STP worker processes, 0 or 1 runs STP in the calling process (default=0)"),
+              llvm::cl::init(0));
+
 
 /* Using cl::list<> instead of cl::bits<> results in quite a bit of ugliness when it comes to checking
  * if an option is set. Unfortunately with gcc4.7 cl::bits<> is broken with LLVM2.9 and I doubt everyone
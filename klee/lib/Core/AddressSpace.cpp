@@ -410,7 +410,7 @@ bool AddressSpace::copyInConcretes() {
         return false;
     } else {
       ObjectState *wos = getWriteable(mo, os);
-      memcpy(wos->concreteStore, address, mo->size);
+      memcpy(wos->getConcreteStore(true), address, mo->size);
     }
   }
 
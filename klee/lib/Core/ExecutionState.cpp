@@ -74,7 +74,7 @@ ExecutionState::ExecutionState(KFunction *kf)
     coveredNew(false),
     forkDisabled(false),
     ptreeNode(0),
-    concolics(true),
+    concolics(true, true),
     speculative(false){
   pushFrame(0, kf);
   //不能放到上面，因为this本身还未初始化，那么this->constraints就是个未知数，用于构造pair时导致size无穷大出错。
@@ -89,7 +89,7 @@ ExecutionState::ExecutionState(const std::vector<ref<Expr> > &assumptions)
     queryCost(0.),
     addressSpace(this),
     ptreeNode(0),
-    concolics(true),
+    concolics(true, true),
     speculative(false) {
 	//不能放到上面，因为this本身还未初始化，那么this->constraints就是个未知数，用于构造pair时导致size无穷大出错。
 	m_symbolicaddress = std::make_pair(this->constraints,klee::ConstantExpr::create(0, klee::Expr::Int32));
@@ -313,6 +313,10 @@ Solver *constructSolverChain(Solver *stpSolver,
   if (UseCexCache)
     solver = createCexCachingSolver(solver);
 
+  if (!SharedQueryCache.empty())
+    solver = createSharedCachingSolver(solver, SharedQueryCache,
+                                       SharedQueryCacheSize);
+
   if (UseCache)
     solver = createCachingSolver(solver);
 
@@ -361,11 +365,17 @@ void Executor::initializeSolver()
     };
     llvm::errs() << "Starting MetaSMTSolver(" << backend << ") ...\n";
   }
+  else if (SolverWorkers > 1) {
+	  stpSolver = new ParallelSTPSolver(SolverWorkers);
+  }
   else {
 	  stpSolver = new STPSolver(UseForkedSTP);
   }
 #else
-  stpSolver = new STPSolver(UseForkedSTP);
+  if (SolverWorkers > 1)
+    stpSolver = new ParallelSTPSolver(SolverWorkers);
+  else
+    stpSolver = new STPSolver(UseForkedSTP);
 #endif /* SUPPORT_METASMT */
     Solver *solver =
       constructSolverChain(stpSolver,
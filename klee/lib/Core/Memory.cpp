@@ -27,6 +27,8 @@
 #include <iostream>
 #include <cassert>
 #include <sstream>
+#include <tr1/unordered_map>
+#include <tr1/unordered_set>
 
 using namespace llvm;
 using namespace klee;
@@ -35,6 +37,22 @@ namespace {
   cl::opt<bool>
   UseConstantArrays("use-constant-arrays",
                     cl::init(true));
+
+  uint8_t *allocStore(unsigned size) {
+    return static_cast<uint8_t*>(ObjectAllocator::alloc(size));
+  }
+
+  void freeStore(uint8_t *store, unsigned size) {
+    ObjectAllocator::free(store, size);
+  }
+}
+
+/***/
+
+ObjectAllocator *ObjectAllocator::current = 0;
+
+void ObjectAllocator::set(ObjectAllocator *allocator) {
+  current = allocator;
 }
 
 /***/
@@ -60,6 +78,72 @@ ObjectHolder &ObjectHolder::operator=(const ObjectHolder &b) {
 
 /***/
 
+namespace klee {
+  /// Immutable concrete contents shared by all the ObjectStates holding
+  /// the same bytes.
+  class ConcreteBuffer {
+  public:
+    unsigned refCount;
+    unsigned size;
+    uint64_t hash;
+    uint8_t *data;
+  };
+}
+
+namespace {
+  /// Known contents, by hash. An entry starts as the first object seen
+  /// with the contents, its store still private. The shared buffer is
+  /// only created once a second object with the same contents shows up.
+  /// Hash collisions are not chained, they just miss the sharing.
+  struct DedupEntry {
+    ObjectState *owner;
+    ConcreteBuffer *buffer;
+  };
+
+  typedef std::tr1::unordered_map<uint64_t, DedupEntry> DedupIndex;
+
+  DedupIndex dedupIndex;
+  uint64_t deduplicatedBytes = 0;
+
+  bool dirtyTracking = false;
+  std::tr1::unordered_set<ObjectState*> dirtyObjects;
+
+  uint64_t hashConcreteBytes(const uint8_t *data, unsigned size) {
+    // FNV-1a, 64-bit words at a time
+    uint64_t h = 14695981039346656037ULL;
+    unsigned i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+      uint64_t w;
+      memcpy(&w, data + i, sizeof(w));
+      h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; i < size; ++i)
+      h = (h ^ data[i]) * 1099511628211ULL;
+    return h;
+  }
+
+  void eraseDedupEntry(uint64_t hash, const ObjectState *owner,
+                       const ConcreteBuffer *buffer) {
+    DedupIndex::iterator it = dedupIndex.find(hash);
+    if (it != dedupIndex.end() &&
+        it->second.owner == owner && it->second.buffer == buffer)
+      dedupIndex.erase(it);
+  }
+
+  void releaseConcreteBuffer(ConcreteBuffer *b) {
+    if (--b->refCount) {
+      deduplicatedBytes -= b->size;
+      return;
+    }
+
+    eraseDedupEntry(b->hash, 0, b);
+    freeStore(b->data, b->size);
+    delete b;
+  }
+}
+
+/***/
+
 int MemoryObject::counter = 0;
 
 MemoryObject::~MemoryObject() {
@@ -94,12 +178,15 @@ ObjectState::ObjectState(const MemoryObject *mo)
     copyOnWriteOwner(0),
     refCount(0),
     object(mo),
-    concreteStore(new uint8_t[mo->size]),
+    concreteStore(allocStore(mo->size)),
+    sharedStore(0),
     flushMask(0),
     knownSymbolics(0),
     updates(0, 0),
     size(mo->size),
-    readOnly(false)
+    readOnly(false),
+    dedupIndexed(false),
+    dedupDirty(false)
      {
   if (!UseConstantArrays) {
     // FIXME: Leaked.
@@ -107,6 +194,7 @@ ObjectState::ObjectState(const MemoryObject *mo)
     const Array *array = new Array("tmp_arr" + llvm::utostr(++id), size);
     updates = UpdateList(array, 0);
   }
+  markDirty();
 }
 
 
@@ -115,27 +203,34 @@ ObjectState::ObjectState(const MemoryObject *mo, const Array *array)
     copyOnWriteOwner(0),
     refCount(0),
     object(mo),
-    concreteStore(new uint8_t[mo->size]),
+    concreteStore(allocStore(mo->size)),
+    sharedStore(0),
     flushMask(0),
     knownSymbolics(0),
     updates(array, 0),
     size(mo->size),
-    readOnly(false)
+    readOnly(false),
+    dedupIndexed(false),
+    dedupDirty(false)
  {
   makeSymbolic();
 }
 
 ObjectState::ObjectState(const ObjectState &os) 
-  : concreteMask(os.concreteMask ? new BitArray(*os.concreteMask, os.size) : 0),
+  : concreteMask(os.concreteMask && !os.concreteMask->isAllOnes(os.size) ?
+                 new BitArray(*os.concreteMask, os.size) : 0),
     copyOnWriteOwner(0),
     refCount(0),
     object(os.object),
-    concreteStore(new uint8_t[os.size]),
+    concreteStore(os.sharedStore ? os.concreteStore : allocStore(os.size)),
+    sharedStore(os.sharedStore),
     flushMask(os.flushMask ? new BitArray(*os.flushMask, os.size) : 0),
     knownSymbolics(0),
     updates(os.updates),
     size(os.size),
-    readOnly(false)
+    readOnly(false),
+    dedupIndexed(false),
+    dedupDirty(false)
      {
   assert(!os.readOnly && "no need to copy read only object?");
 
@@ -145,14 +240,130 @@ ObjectState::ObjectState(const ObjectState &os)
       knownSymbolics[i] = os.knownSymbolics[i];
   }
 
-  memcpy(concreteStore, os.concreteStore, size*sizeof(*concreteStore));
+  if (sharedStore) {
+    ++sharedStore->refCount;
+    deduplicatedBytes += size;
+  } else {
+    memcpy(concreteStore, os.concreteStore, size*sizeof(*concreteStore));
+    markDirty();
+  }
 }
 
 ObjectState::~ObjectState() {
+  if (dedupDirty) dirtyObjects.erase(this);
   if (concreteMask) delete concreteMask;
   if (flushMask) delete flushMask;
   if (knownSymbolics) delete[] knownSymbolics;
-  delete[] concreteStore;
+  if (sharedStore) {
+    releaseConcreteBuffer(sharedStore);
+  } else {
+    if (dedupIndexed)
+      eraseDedupEntry(hashConcreteBytes(concreteStore, size), this, 0);
+    freeStore(concreteStore, size);
+  }
+}
+
+/***/
+
+void ObjectState::deduplicate() {
+  if (sharedStore || dedupIndexed || object->isSharedConcrete)
+    return;
+
+  // Fully concrete objects do not need a mask
+  if (concreteMask && concreteMask->isAllOnes(size)) {
+    delete concreteMask;
+    concreteMask = 0;
+  }
+
+  uint64_t hash = hashConcreteBytes(concreteStore, size);
+  std::pair<DedupIndex::iterator, bool> res =
+    dedupIndex.insert(std::make_pair(hash, DedupEntry()));
+  DedupEntry &entry = res.first->second;
+
+  if (res.second) {
+    // First object with these contents
+    entry.owner = this;
+    entry.buffer = 0;
+    dedupIndexed = true;
+    return;
+  }
+
+  ConcreteBuffer *b = entry.buffer;
+  if (!b) {
+    ObjectState *owner = entry.owner;
+    if (owner->size != size || memcmp(owner->concreteStore, concreteStore, size))
+      return;
+
+    // Second object with these contents, the store of the first one
+    // becomes the shared copy
+    b = new ConcreteBuffer;
+    b->refCount = 1;
+    b->size = size;
+    b->hash = hash;
+    b->data = owner->concreteStore;
+    owner->sharedStore = b;
+    owner->dedupIndexed = false;
+    entry.owner = 0;
+    entry.buffer = b;
+  } else if (b->size != size || memcmp(b->data, concreteStore, size)) {
+    return;
+  }
+
+  ++b->refCount;
+  deduplicatedBytes += size;
+  freeStore(concreteStore, size);
+  concreteStore = b->data;
+  sharedStore = b;
+}
+
+void ObjectState::unshareStore() {
+  if (dedupIndexed) {
+    // Contents are about to change, forget them
+    eraseDedupEntry(hashConcreteBytes(concreteStore, size), this, 0);
+    dedupIndexed = false;
+    return;
+  }
+
+  ConcreteBuffer *b = sharedStore;
+  sharedStore = 0;
+
+  if (b->refCount == 1) {
+    // Last user, take the buffer over
+    eraseDedupEntry(b->hash, 0, b);
+    delete b;
+    return;
+  }
+
+  concreteStore = allocStore(size);
+  memcpy(concreteStore, b->data, size);
+  releaseConcreteBuffer(b);
+}
+
+uint64_t ObjectState::getDeduplicatedBytes() {
+  return deduplicatedBytes;
+}
+
+void ObjectState::enableDirtyTracking() {
+  dirtyTracking = true;
+}
+
+void ObjectState::takeDirtyObjects(std::vector<ObjectState*> &dirty) {
+  dirty.assign(dirtyObjects.begin(), dirtyObjects.end());
+  dirtyObjects.clear();
+  for (unsigned i = 0; i < dirty.size(); ++i)
+    dirty[i]->dedupDirty = false;
+}
+
+void ObjectState::markDirty() {
+  if (dirtyTracking && !dedupDirty) {
+    dedupDirty = true;
+    dirtyObjects.insert(this);
+  }
+}
+
+inline void ObjectState::prepareConcreteWrite() {
+  if (sharedStore || dedupIndexed) unshareStore();
+  if (!dedupDirty) markDirty();
 }
 
 /***/
@@ -236,11 +447,13 @@ void ObjectState::makeSymbolic() {
 
 void ObjectState::initializeToZero() {
   makeConcrete();
+  prepareConcreteWrite();
   memset(concreteStore, 0, size);
 }
 
 void ObjectState::initializeToRandom() {  
   makeConcrete();
+  prepareConcreteWrite();
   for (unsigned i=0; i<size; i++) {
     // randomly selected by 256 sided die
     concreteStore[i] = 0xAB;
@@ -331,6 +544,7 @@ uint8_t *ObjectState::getConcreteStore(bool allowSymbolic)
     if (!allowSymbolic && !isAllConcrete()) {
         return NULL;
     }
+    prepareConcreteWrite();
     return concreteStore;
 }
 
@@ -403,6 +617,7 @@ ref<Expr> ObjectState::read8(ref<Expr> offset) const {
 void ObjectState::write8(unsigned offset, uint8_t value) {
   //assert(read_only == false && "writing to read-only object!");
   if(!object->isSharedConcrete) {
+    prepareConcreteWrite();
     concreteStore[offset] = value;
     setKnownSymbolic(offset, 0);
 
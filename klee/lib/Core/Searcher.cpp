@@ -64,6 +64,18 @@ ExecutionState &DFSSearcher::selectState() {
     return *currentState;
 }
 
+double DFSSearcher::getPriority(ExecutionState *es) {
+  if (es == currentState)
+    return states.size();
+
+  // States pushed last are explored first
+  for (unsigned i = states.size(); i > 0; --i) {
+    if (states[i - 1] == es)
+      return i - 1;
+  }
+  return -1;
+}
+
 void DFSSearcher::update(ExecutionState *current,
                          const std::set<ExecutionState*> &addedStates,
                          const std::set<ExecutionState*> &removedStates) {
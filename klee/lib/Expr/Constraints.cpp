@@ -13,7 +13,6 @@
 #include "klee/util/ExprVisitor.h"
 
 #include <iostream>
-#include <map>
 
 using namespace klee;
 
@@ -43,17 +42,17 @@ public:
 
 class ExprReplaceVisitor2 : public ExprVisitor {
 private:
-  const std::map< ref<Expr>, ref<Expr> > &replacements;
+  const ConstraintManager::equalities_ty &replacements;
 
 public:
-  ExprReplaceVisitor2(const std::map< ref<Expr>, ref<Expr> > &_replacements) 
+  ExprReplaceVisitor2(const ConstraintManager::equalities_ty &_replacements)
     : ExprVisitor(true),
       replacements(_replacements) {}
 
   Action visitExprPost(const Expr &e) {
-    std::map< ref<Expr>, ref<Expr> >::const_iterator it =
-      replacements.find(ref<Expr>(const_cast<Expr*>(&e)));
-    if (it!=replacements.end()) {
+    const ConstraintManager::equalities_ty::value_type *it =
+      replacements.lookup(ref<Expr>(const_cast<Expr*>(&e)));
+    if (it) {
       return Action::changeTo(it->second);
     } else {
       return Action::doChildren();
@@ -61,6 +60,9 @@ public:
   }
 };
 
+// Bound on the number of memoized simplifications per constraint set
+static const unsigned MaxSimplificationCacheSize = 4096;
+
 bool ConstraintManager::rewriteConstraints(ExprVisitor &visitor) {
   ConstraintManager::constraints_ty old;
   bool changed = false;
@@ -79,36 +81,72 @@ bool ConstraintManager::rewriteConstraints(ExprVisitor &visitor) {
     }
   }
 
+  // The equalities of the rewritten constraints are stale. This only
+  // happens when a new equality actually substituted something, the
+  // common case leaves the index untouched.
+  if (changed)
+    rebuildEqualities();
+
   return changed;
 }
 
+void ConstraintManager::addEquality(ref<Expr> e) {
+  ref<Expr> key, value;
+
+  if (const EqExpr *ee = dyn_cast<EqExpr>(e)) {
+    if (isa<ConstantExpr>(ee->left)) {
+      key = ee->right;
+      value = ee->left;
+    }
+  }
+
+  if (key.isNull()) {
+    key = e;
+    value = ConstantExpr::alloc(1, Expr::Bool);
+  }
+
+  // The first constraint implying a value for key wins
+  if (equalities.lookup(key))
+    return;
+
+  equalities = equalities.insert(std::make_pair(key, value));
+  simplificationCache.clear();
+}
+
+void ConstraintManager::rebuildEqualities() {
+  equalities = equalities_ty();
+  simplificationCache.clear();
+
+  for (ConstraintManager::constraints_ty::const_iterator
+         it = constraints.begin(), ie = constraints.end(); it != ie; ++it) {
+    addEquality(*it);
+  }
+}
+
+void ConstraintManager::pushConstraint(ref<Expr> e) {
+  constraints.push_back(e);
+  addEquality(e);
+}
+
 void ConstraintManager::simplifyForValidConstraint(ref<Expr> e) {
   // XXX 
 }
 
 ref<Expr> ConstraintManager::simplifyExpr(ref<Expr> e) const {
-  if (isa<ConstantExpr>(e))
+  if (isa<ConstantExpr>(e) || equalities.empty())
     return e;
 
-  std::map< ref<Expr>, ref<Expr> > equalities;
-  
-  for (ConstraintManager::constraints_ty::const_iterator 
-         it = constraints.begin(), ie = constraints.end(); it != ie; ++it) {
-    if (const EqExpr *ee = dyn_cast<EqExpr>(*it)) {
-      if (isa<ConstantExpr>(ee->left)) {
-        equalities.insert(std::make_pair(ee->right,
-                                         ee->left));
-      } else {
-        equalities.insert(std::make_pair(*it,
-                                         ConstantExpr::alloc(1, Expr::Bool)));
-      }
-    } else {
-      equalities.insert(std::make_pair(*it,
-                                       ConstantExpr::alloc(1, Expr::Bool)));
-    }
-  }
+  ExprHashMap< ref<Expr> >::iterator it = simplificationCache.find(e);
+  if (it != simplificationCache.end())
+    return it->second;
+
+  ref<Expr> result = ExprReplaceVisitor2(equalities).visit(e);
+
+  if (simplificationCache.size() >= MaxSimplificationCacheSize)
+    simplificationCache.clear();
+  simplificationCache.insert(std::make_pair(e, result));
 
-  return ExprReplaceVisitor2(equalities).visit(e);
+  return result;
 }
 
 void ConstraintManager::addConstraintInternal(ref<Expr> e) {
@@ -140,12 +178,12 @@ void ConstraintManager::addConstraintInternal(ref<Expr> e) {
       ExprReplaceVisitor visitor(be->right, be->left);
       rewriteConstraints(visitor);
     }
-    constraints.push_back(e);
+    pushConstraint(e);
     break;
   }
     
   default:
-    constraints.push_back(e);
+    pushConstraint(e);
     break;
   }
 }
@@ -21,6 +21,7 @@
 #include <iostream>
 #include <sstream>
 #include <stdio.h>
+#include <tr1/unordered_map>
 using namespace klee;
 using namespace llvm;
 
@@ -29,12 +30,89 @@ namespace {
   ConstArrayOpt("const-array-opt",
      cl::init(true),
 	 cl::desc("Enable various optimizations involving all-constant arrays."));
+
+  cl::opt<bool>
+  HashConsExprs("hash-cons-exprs",
+     cl::init(false),
+     cl::desc("Share a single node between structurally equal expressions."));
+
+  /// Weak unique table for hash-consing. Nodes are keyed by their hash
+  /// and compared shallowly, since their kids are interned already.
+  /// Entries are removed by ~Expr, so only raw pointers are stored.
+  typedef std::tr1::unordered_multimap<unsigned, Expr*> ExprInternTable;
+
+  /// Allocated on first use and never freed, so that expressions that
+  /// outlive static destruction can still unregister themselves.
+  ExprInternTable *internTable = 0;
+  uint64_t internHits = 0;
+
+  bool isShallowEqual(const Expr *a, const Expr *b) {
+    if (a->getKind() != b->getKind() || a->getWidth() != b->getWidth())
+      return false;
+
+    unsigned n = a->getNumKids();
+    if (n != b->getNumKids())
+      return false;
+
+    for (unsigned i = 0; i < n; ++i)
+      if (a->getKid(i).get() != b->getKid(i).get())
+        return false;
+
+    return a->compareContents(*b) == 0;
+  }
 }
 
 /***/
 
 unsigned Expr::count = 0;
 
+Expr::~Expr() {
+  Expr::count--;
+
+  if (interned) {
+    // Only the base part of the object is alive at this point, so the
+    // lookup must not go through the virtual accessors.
+    std::pair<ExprInternTable::iterator, ExprInternTable::iterator> range =
+      internTable->equal_range(hashValue);
+    for (ExprInternTable::iterator it = range.first; it != range.second; ++it) {
+      if (it->second == this) {
+        internTable->erase(it);
+        break;
+      }
+    }
+  }
+}
+
+ref<Expr> Expr::intern(const ref<Expr> &e) {
+  if (!HashConsExprs)
+    return e;
+
+  if (!internTable)
+    internTable = new ExprInternTable();
+
+  unsigned h = e->hash();
+  std::pair<ExprInternTable::iterator, ExprInternTable::iterator> range =
+    internTable->equal_range(h);
+  for (ExprInternTable::iterator it = range.first; it != range.second; ++it) {
+    if (isShallowEqual(it->second, e.get())) {
+      ++internHits;
+      return it->second;
+    }
+  }
+
+  internTable->insert(std::make_pair(h, e.get()));
+  e->interned = true;
+  return e;
+}
+
+unsigned Expr::getInternedCount() {
+  return internTable ? internTable->size() : 0;
+}
+
+uint64_t Expr::getInternHits() {
+  return internHits;
+}
+
 ref<Expr> Expr::createTempRead(const Array *array, Expr::Width w) {
   UpdateList ul(array, 0);
 
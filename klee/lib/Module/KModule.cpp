@@ -547,7 +547,7 @@ void KModule::prepare(const Interpreter::ModuleOptions &opts,
   }
 }
 
-KFunction* KModule::updateModuleWithFunction(llvm::Function *f)
+KFunction* KModule::updateModuleWithFunction(llvm::Function *f, bool optimize)
 {
     assert(functionMap.find(f) == functionMap.end());
 
@@ -556,10 +556,12 @@ KFunction* KModule::updateModuleWithFunction(llvm::Function *f)
     //IntrinsicCleanerPass ip(*targetData, false);
     //ip.runOnFunction(*f);
 
-    p->fpmOptimize.run(*f);
+    if (optimize) {
+        p->fpmOptimize.run(*f);
 
-    p->fpm3.run(*f);
-    p->fpm4.run(*f);
+        p->fpm3.run(*f);
+        p->fpm4.run(*f);
+    }
 
     KFunction *kf = new KFunction(f, this);
 
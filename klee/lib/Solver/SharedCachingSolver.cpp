@@ -0,0 +1,582 @@
+//===-- SharedCachingSolver.cpp - Cross-process query cache ---------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A query cache stored in a memory-mapped file. The mapping is shared, so
+// the processes created by fork() (e.g., S2E load balancing) and any later
+// run that opens the same file see each other's results.
+//
+// Queries are identified by a 128-bit structural fingerprint that does not
+// depend on pointer values, so it is stable across processes and runs. The
+// table uses open addressing; slots are claimed with compare-and-swap and
+// published once fully written, so no lock is needed to read or insert.
+// When the probe window of a query is full, one of its entries is evicted.
+// Counterexamples are kept in a ring, entries whose data has since been
+// overwritten are ignored.
+//
+//===----------------------------------------------------------------------===//
+
+#include "klee/Solver.h"
+
+#include "klee/Common.h"
+#include "klee/Constraints.h"
+#include "klee/Expr.h"
+#include "klee/SolverImpl.h"
+#include "klee/SolverStats.h"
+#include "klee/util/ExprHashMap.h"
+
+#include <tr1/unordered_map>
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace klee;
+
+namespace {
+
+struct Fingerprint {
+  uint64_t h1, h2;
+
+  Fingerprint() : h1(0), h2(0) {}
+  Fingerprint(uint64_t a, uint64_t b) : h1(a), h2(b) {}
+
+  void add(uint64_t v) {
+    h1 = mix(h1 ^ v, 0x9e3779b97f4a7c15ULL);
+    h2 = mix(h2 + v, 0xc2b2ae3d27d4eb4fULL);
+  }
+
+  void add(const Fingerprint &f) {
+    add(f.h1);
+    add(f.h2);
+  }
+
+  static uint64_t mix(uint64_t x, uint64_t k) {
+    x *= k;
+    x ^= x >> 31;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 29;
+    return x;
+  }
+};
+
+/// QueryHasher - Computes structural fingerprints of expressions. Arrays are
+/// identified by name, size and contents, never by address.
+///
+/// Expression fingerprints are kept across queries, so the constraints
+/// shared by successive queries are only hashed once. The cache holds
+/// references to the expressions and is looked up with their cached
+/// structural hash. Array fingerprints only live for one query, arrays
+/// are not reference counted.
+class QueryHasher {
+  typedef ExprHashMap<Fingerprint> ExprCache;
+  typedef std::tr1::unordered_map<const Array*, Fingerprint> ArrayCache;
+
+  static const unsigned MaxCachedExprs = 1 << 18;
+
+  ExprCache exprs;
+  ArrayCache arrays;
+
+public:
+  /// startQuery - Must be called before hashing the parts of a new query.
+  void startQuery() {
+    arrays.clear();
+    if (exprs.size() > MaxCachedExprs)
+      exprs.clear();
+  }
+
+  Fingerprint hash(const Array *array);
+  Fingerprint hash(const UpdateList &ul);
+  Fingerprint hash(const ref<Expr> &e);
+
+  Fingerprint hash(const Query &query);
+};
+
+}
+
+Fingerprint QueryHasher::hash(const Array *array) {
+  ArrayCache::iterator it = arrays.find(array);
+  if (it != arrays.end())
+    return it->second;
+
+  Fingerprint f(array->size, array->name.size());
+  for (unsigned i = 0; i < array->name.size(); ++i)
+    f.add((uint64_t) (unsigned char) array->name[i]);
+  for (unsigned i = 0; i < array->constantValues.size(); ++i)
+    f.add(array->constantValues[i]->getZExtValue());
+  // The concrete inputs are part of the answer when concolic values are
+  // propagated into counterexamples.
+  for (unsigned i = 0; i < array->concreteBuffer.size(); ++i)
+    f.add(array->concreteBuffer[i]);
+
+  arrays[array] = f;
+  return f;
+}
+
+Fingerprint QueryHasher::hash(const UpdateList &ul) {
+  Fingerprint f = hash(ul.root);
+  for (const UpdateNode *un = ul.head; un; un = un->next) {
+    f.add(hash(un->index));
+    f.add(hash(un->value));
+  }
+  return f;
+}
+
+Fingerprint QueryHasher::hash(const ref<Expr> &e) {
+  ExprCache::iterator it = exprs.find(e);
+  if (it != exprs.end())
+    return it->second;
+
+  Fingerprint f(e->getKind(), e->getWidth());
+
+  if (ConstantExpr *ce = dyn_cast<ConstantExpr>(e)) {
+    const llvm::APInt &v = ce->getAPValue();
+    for (unsigned i = 0; i < v.getNumWords(); ++i)
+      f.add(v.getRawData()[i]);
+  } else if (ReadExpr *re = dyn_cast<ReadExpr>(e)) {
+    f.add(hash(re->updates));
+    f.add(hash(re->index));
+  } else {
+    if (ExtractExpr *ee = dyn_cast<ExtractExpr>(e))
+      f.add(ee->offset);
+    for (unsigned i = 0; i < e->getNumKids(); ++i)
+      f.add(hash(e->getKid(i)));
+  }
+
+  exprs[e] = f;
+  return f;
+}
+
+Fingerprint QueryHasher::hash(const Query &query) {
+  startQuery();
+
+  // The order of the constraints does not matter. Each fingerprint is
+  // mixed before being summed, so that repeated or related constraints
+  // neither cancel out nor combine linearly.
+  Fingerprint c;
+  uint64_t count = 0;
+  for (ConstraintManager::const_iterator it = query.constraints.begin(),
+         ie = query.constraints.end(); it != ie; ++it, ++count) {
+    Fingerprint ef = hash(*it);
+    c.h1 += Fingerprint::mix(ef.h1 ^ (ef.h2 >> 7), 0xd6e8feb86659fd93ULL);
+    c.h2 += Fingerprint::mix(ef.h2 + (ef.h1 << 9), 0xa0761d6478bd642fULL);
+  }
+  c.add(count);
+
+  Fingerprint f = hash(query.expr);
+  f.add(c);
+  return f;
+}
+
+/***/
+
+namespace {
+
+enum EntryKind {
+  EntryValidity = 1,
+  EntryTruth = 2,
+  EntryInitialValues = 3
+};
+
+enum SlotState {
+  SlotEmpty = 0,
+  SlotWriting = 1,
+  SlotReady = 2,
+  SlotStateMask = 3
+};
+
+// The upper bits of CacheSlot::state count the times the slot was claimed,
+// so that readers notice when the entry they copy is evicted meanwhile.
+const uint32_t SlotVersionUnit = SlotStateMask + 1;
+
+struct CacheSlot {
+  uint64_t h1, h2;
+  volatile uint32_t state;
+  uint32_t kind;
+  int32_t result;
+  uint32_t dataSize;
+  uint64_t dataOffset;
+};
+
+struct CacheHeader {
+  static const uint64_t Magic = 0x53324551434143ULL; // "S2EQCAC"
+  static const uint32_t Version = 2;
+
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slotCount;
+  uint64_t dataSize;
+  /// Bytes ever reserved in the data area. Entry data lives at
+  /// position % dataSize.
+  volatile uint64_t dataHead;
+};
+
+/// claimSlot - Move the slot from the given state to SlotWriting, returns
+/// the new state value in claimed.
+bool claimSlot(CacheSlot &slot, uint32_t from, uint32_t &claimed) {
+  uint32_t state = slot.state;
+  if ((state & SlotStateMask) != from)
+    return false;
+  claimed = ((state & ~SlotStateMask) + SlotVersionUnit) | SlotWriting;
+  return __sync_bool_compare_and_swap(&slot.state, state, claimed);
+}
+
+class SharedCachingSolver : public SolverImpl {
+private:
+  static const unsigned MaxProbes = 16;
+
+  Solver *solver;
+  CacheHeader *header;
+  CacheSlot *slots;
+  uint8_t *data;
+  size_t mappingSize;
+
+  /// Table geometry read when the file was opened. The header is shared
+  /// with other processes, it is not trusted afterwards.
+  uint32_t slotCount;
+  uint64_t dataSize;
+
+  QueryHasher hasher;
+
+  bool open(const std::string &path, uint64_t sizeInMB);
+
+  /// key - Derive the key of an entry from the fingerprint of its query.
+  static Fingerprint key(Fingerprint query, EntryKind kind) {
+    query.add(kind);
+    return query;
+  }
+
+  /// lookup - Copy the ready slot matching the fingerprint to result.
+  bool lookup(const Fingerprint &f, EntryKind kind, CacheSlot &result);
+  /// copyData - Copy the data of a slot returned by lookup(), fails if the
+  /// data has been overwritten.
+  bool copyData(const CacheSlot &slot, std::vector<uint8_t> &bytes);
+
+  void insert(const Fingerprint &f, EntryKind kind, int result,
+              const uint8_t *bytes = 0, uint32_t size = 0);
+  uint64_t reserveData(uint32_t size);
+
+public:
+  SharedCachingSolver(Solver *s, const std::string &path, uint64_t sizeInMB);
+  ~SharedCachingSolver();
+
+  bool computeValidity(const Query&, Solver::Validity &result);
+  bool computeTruth(const Query&, bool &isValid);
+  bool computeValue(const Query& query, ref<Expr> &result) {
+    return solver->impl->computeValue(query, result);
+  }
+  bool computeInitialValues(const Query& query,
+                            const std::vector<const Array*> &objects,
+                            std::vector< std::vector<unsigned char> > &values,
+                            bool &hasSolution);
+  SolverRunStatus getOperationStatusCode() {
+    return solver->impl->getOperationStatusCode();
+  }
+  char *getConstraintLog(const Query& query) {
+    return solver->impl->getConstraintLog(query);
+  }
+  void setCoreSolverTimeout(double timeout) {
+    solver->impl->setCoreSolverTimeout(timeout);
+  }
+};
+
+}
+
+SharedCachingSolver::SharedCachingSolver(Solver *s, const std::string &path,
+                                         uint64_t sizeInMB)
+  : solver(s), header(0), slots(0), data(0), mappingSize(0),
+    slotCount(0), dataSize(0) {
+  if (!open(path, sizeInMB))
+    klee_warning("could not open shared query cache %s, running without it",
+                 path.c_str());
+}
+
+SharedCachingSolver::~SharedCachingSolver() {
+  if (header)
+    munmap(header, mappingSize);
+  delete solver;
+}
+
+bool SharedCachingSolver::open(const std::string &path, uint64_t sizeInMB) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return false;
+
+  // Serialize the initialization with other processes opening the file.
+  flock(fd, LOCK_EX);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+
+  CacheHeader hdr;
+  bool valid = st.st_size >= (off_t) sizeof(hdr) &&
+               pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+               hdr.magic == CacheHeader::Magic &&
+               hdr.version == CacheHeader::Version &&
+               hdr.slotCount > 0 && hdr.dataSize > 0;
+
+  // Accessing the mapping past the end of a truncated file raises SIGBUS.
+  if (valid) {
+    uint64_t slotsSize = (uint64_t) hdr.slotCount * sizeof(CacheSlot);
+    valid = hdr.dataSize <= (uint64_t) st.st_size &&
+            (uint64_t) st.st_size - hdr.dataSize >= sizeof(hdr) + slotsSize;
+  }
+
+  if (!valid) {
+    // One quarter of the file holds the slots, the rest the counterexamples.
+    uint64_t total = sizeInMB * 1024 * 1024;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CacheHeader::Magic;
+    hdr.version = CacheHeader::Version;
+    hdr.slotCount = (total / 4) / sizeof(CacheSlot);
+    hdr.dataSize = total - sizeof(hdr) - hdr.slotCount * sizeof(CacheSlot);
+    hdr.dataHead = 0;
+
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, total) < 0 ||
+        pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+      close(fd);
+      return false;
+    }
+  }
+
+  mappingSize = sizeof(hdr) + hdr.slotCount * sizeof(CacheSlot) + hdr.dataSize;
+  void *mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+    return false;
+
+  header = static_cast<CacheHeader*>(mapping);
+  slotCount = hdr.slotCount;
+  dataSize = hdr.dataSize;
+  slots = reinterpret_cast<CacheSlot*>(header + 1);
+  data = reinterpret_cast<uint8_t*>(slots + slotCount);
+  return true;
+}
+
+bool SharedCachingSolver::lookup(const Fingerprint &f, EntryKind kind,
+                                 CacheSlot &result) {
+  for (unsigned i = 0; i < MaxProbes; ++i) {
+    const CacheSlot &slot = slots[(f.h1 + i) % slotCount];
+    uint32_t state = slot.state;
+    if ((state & SlotStateMask) == SlotEmpty)
+      return false;
+    if ((state & SlotStateMask) != SlotReady)
+      continue;
+    __sync_synchronize();
+    result = slot;
+    __sync_synchronize();
+    // Evicted while we were copying it
+    if (slot.state != state)
+      continue;
+    if (result.h1 != f.h1 || result.h2 != f.h2 ||
+        result.kind != (uint32_t) kind)
+      continue;
+
+    // Slots come from other processes, check them before use.
+    if (result.dataSize > dataSize ||
+        result.dataOffset % dataSize > dataSize - result.dataSize)
+      return false;
+    if (kind == EntryValidity &&
+        (result.result < Solver::False || result.result > Solver::True))
+      return false;
+    return true;
+  }
+  return false;
+}
+
+bool SharedCachingSolver::copyData(const CacheSlot &slot,
+                                   std::vector<uint8_t> &bytes) {
+  // Later reservations wrap around onto the entry once the head is
+  // more than dataSize past it.
+  if (header->dataHead - slot.dataOffset > dataSize)
+    return false;
+  const uint8_t *p = data + slot.dataOffset % dataSize;
+  bytes.assign(p, p + slot.dataSize);
+  __sync_synchronize();
+  return header->dataHead - slot.dataOffset <= dataSize;
+}
+
+uint64_t SharedCachingSolver::reserveData(uint32_t size) {
+  for (;;) {
+    uint64_t position = __sync_fetch_and_add(&header->dataHead, size);
+    // Entries do not wrap around, the end of the area is skipped
+    if (position % dataSize <= dataSize - size)
+      return position;
+  }
+}
+
+void SharedCachingSolver::insert(const Fingerprint &f, EntryKind kind,
+                                 int result, const uint8_t *bytes,
+                                 uint32_t size) {
+  CacheSlot *slot = 0;
+  uint32_t claimed = 0;
+
+  if (size <= dataSize) {
+    for (unsigned i = 0; i < MaxProbes && !slot; ++i) {
+      CacheSlot &s = slots[(f.h1 + i) % slotCount];
+      if (claimSlot(s, SlotEmpty, claimed))
+        slot = &s;
+    }
+
+    // The window is full, evict an entry. The victim depends on the
+    // query so that concurrent inserts do not all go for the same one.
+    for (unsigned i = 0; i < MaxProbes && !slot; ++i) {
+      CacheSlot &s = slots[(f.h1 + (f.h2 + i) % MaxProbes) % slotCount];
+      if (claimSlot(s, SlotReady, claimed)) {
+        slot = &s;
+        ++stats::sharedCacheEvictions;
+      }
+    }
+  }
+
+  if (!slot) {
+    // The entry does not fit in the data area, or every slot of the
+    // window is being written.
+    ++stats::sharedCacheDroppedInserts;
+    klee_warning_once(0, "shared query cache: dropping entries");
+    return;
+  }
+
+  uint64_t offset = 0;
+  if (size) {
+    offset = reserveData(size);
+    memcpy(data + offset % dataSize, bytes, size);
+  }
+
+  slot->h1 = f.h1;
+  slot->h2 = f.h2;
+  slot->kind = kind;
+  slot->result = result;
+  slot->dataSize = size;
+  slot->dataOffset = offset;
+  __sync_synchronize();
+  slot->state = (claimed & ~SlotStateMask) | SlotReady;
+}
+
+bool SharedCachingSolver::computeValidity(const Query &query,
+                                          Solver::Validity &result) {
+  if (!header)
+    return solver->impl->computeValidity(query, result);
+
+  Fingerprint f = key(hasher.hash(query), EntryValidity);
+  CacheSlot slot;
+  if (lookup(f, EntryValidity, slot)) {
+    ++stats::sharedCacheHits;
+    result = (Solver::Validity) slot.result;
+    return true;
+  }
+
+  ++stats::sharedCacheMisses;
+  if (!solver->impl->computeValidity(query, result))
+    return false;
+
+  insert(f, EntryValidity, result);
+  return true;
+}
+
+bool SharedCachingSolver::computeTruth(const Query &query, bool &isValid) {
+  if (!header)
+    return solver->impl->computeTruth(query, isValid);
+
+  // A validity entry answers the truth query as well
+  Fingerprint q = hasher.hash(query);
+  CacheSlot slot;
+  if (lookup(key(q, EntryValidity), EntryValidity, slot)) {
+    ++stats::sharedCacheHits;
+    isValid = slot.result == Solver::True;
+    return true;
+  }
+
+  Fingerprint f = key(q, EntryTruth);
+  if (lookup(f, EntryTruth, slot)) {
+    ++stats::sharedCacheHits;
+    isValid = slot.result;
+    return true;
+  }
+
+  ++stats::sharedCacheMisses;
+  if (!solver->impl->computeTruth(query, isValid))
+    return false;
+
+  insert(f, EntryTruth, isValid);
+  return true;
+}
+
+bool
+SharedCachingSolver::computeInitialValues(const Query &query,
+                                          const std::vector<const Array*>
+                                            &objects,
+                                          std::vector< std::vector<unsigned char> >
+                                            &values,
+                                          bool &hasSolution) {
+  if (!header)
+    return solver->impl->computeInitialValues(query, objects, values,
+                                              hasSolution);
+
+  Fingerprint f = key(hasher.hash(query), EntryInitialValues);
+  for (unsigned i = 0; i < objects.size(); ++i)
+    f.add(hasher.hash(objects[i]));
+  uint64_t expectedSize = 0;
+  for (unsigned i = 0; i < objects.size(); ++i)
+    expectedSize += objects[i]->size;
+
+  CacheSlot slot;
+  std::vector<uint8_t> bytes;
+  if (lookup(f, EntryInitialValues, slot) &&
+      (!slot.result ||
+       (slot.dataSize == expectedSize && copyData(slot, bytes)))) {
+    ++stats::sharedCacheHits;
+    hasSolution = slot.result;
+    if (hasSolution) {
+      std::vector<uint8_t>::const_iterator it = bytes.begin();
+      values.reserve(objects.size());
+      for (unsigned i = 0; i < objects.size(); ++i) {
+        values.push_back(std::vector<unsigned char>(it,
+                                                    it + objects[i]->size));
+        it += objects[i]->size;
+      }
+    }
+    return true;
+  }
+
+  ++stats::sharedCacheMisses;
+  if (!solver->impl->computeInitialValues(query, objects, values,
+                                          hasSolution))
+    return false;
+
+  if (!hasSolution) {
+    insert(f, EntryInitialValues, false);
+    return true;
+  }
+
+  bytes.clear();
+  for (unsigned i = 0; i < values.size(); ++i)
+    bytes.insert(bytes.end(), values[i].begin(), values[i].end());
+  insert(f, EntryInitialValues, true, bytes.empty() ? 0 : &bytes[0],
+         bytes.size());
+
+  return true;
+}
+
+///
+
+Solver *klee::createSharedCachingSolver(Solver *_solver,
+                                        const std::string &path,
+                                        uint64_t sizeInMB) {
+  return new Solver(new SharedCachingSolver(_solver, path, sizeInMB));
+}
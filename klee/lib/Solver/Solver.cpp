@@ -21,6 +21,7 @@
 #include "klee/util/ExprPPrinter.h"
 #include "klee/util/ExprUtil.h"
 #include "klee/Internal/Support/Timer.h"
+#include "klee/Internal/System/Time.h"
 #include "llvm/Support/CommandLine.h"
 #include "klee/CommandLine.h"
 #define vc_bvBoolExtract IAMTHESPAWNOFSATAN
@@ -65,6 +66,11 @@ namespace {
   llvm::cl::opt<bool>
   PropagateConcolics("propagate-concolics",
                       llvm::cl::init(true));
+
+  llvm::cl::opt<bool>
+  IncrementalSTP("incremental-stp",
+                 llvm::cl::desc("Keep the constraints shared by consecutive queries asserted in STP (default=off)"),
+                 llvm::cl::init(false));
 }
 
 /***/
@@ -578,8 +584,17 @@ private:
   bool useForkedSTP;
   SolverRunStatus runStatusCode;
 
+  /// Constraints currently asserted in the VC, each in its own push level,
+  /// when solving incrementally.
+  std::vector< ref<Expr> > assertedConstraints;
+
   void reinstantiate();
 
+  /// syncConstraints - Make the asserted constraints match the given ones,
+  /// popping only the levels past their common prefix.
+  void syncConstraints(const ConstraintManager &constraints);
+  void resetConstraints();
+
 public:
   STPSolverImpl(STPSolver *_solver, bool _useForkedSTP);
   ~STPSolverImpl();
@@ -645,6 +660,7 @@ void STPSolverImpl::reinstantiate()
     //XXX: This seems to cause crashes.
     //Will have to find other ways of preventing slowdown
     if (ReinstantiateSolver) {
+        assertedConstraints.clear();
         delete builder;
         vc_Destroy(vc);
         vc = vc_createValidityChecker();
@@ -658,6 +674,37 @@ void STPSolverImpl::reinstantiate()
     }
 }
 
+void STPSolverImpl::syncConstraints(const ConstraintManager &constraints) {
+  ConstraintManager::const_iterator it = constraints.begin(),
+    ie = constraints.end();
+  unsigned common = 0;
+  while (common < assertedConstraints.size() && it != ie &&
+         assertedConstraints[common] == *it) {
+    ++common;
+    ++it;
+  }
+
+  stats::incrementalConstraintsReused += common;
+
+  while (assertedConstraints.size() > common) {
+    vc_pop(vc);
+    assertedConstraints.pop_back();
+  }
+
+  for (; it != ie; ++it) {
+    vc_push(vc);
+    vc_assertFormula(vc, builder->construct(*it));
+    assertedConstraints.push_back(*it);
+  }
+}
+
+void STPSolverImpl::resetConstraints() {
+  while (!assertedConstraints.empty()) {
+    vc_pop(vc);
+    assertedConstraints.pop_back();
+  }
+}
+
 /***/
 
 STPSolver::STPSolver(bool useForkedSTP)
@@ -676,6 +723,7 @@ void STPSolver::setCoreSolverTimeout(double timeout) {
 /***/
 
 char *STPSolverImpl::getConstraintLog(const Query &query) {
+  resetConstraints();
   vc_push(vc);
   for (std::vector< ref<Expr> >::const_iterator it = query.constraints.begin(),
          ie = query.constraints.end(); it != ie; ++it)
@@ -897,6 +945,22 @@ static  SolverImpl::SolverRunStatus runAndGetCexForked(::VC vc,
   }
 #endif
 }
+/// propagateConcolicValues - Replace the solver-chosen bytes that do not
+/// appear in any read of the query by the concrete input bytes.
+static void propagateConcolicValues(const std::vector<const Array*> &objects,
+                                    std::vector< std::vector<unsigned char> >
+                                      &values,
+                                    std::map<const Array*, std::set<int> >
+                                      &related) {
+  for (unsigned i=0; i<objects.size(); ++i) {
+    std::set<int> &symbpos = related[objects[i]];
+    for (unsigned ai = 0; ai < objects[i]->size; ai++) {
+      if (symbpos.find(ai) == symbpos.end())
+        values[i][ai] = objects[i]->concreteBuffer[ai];
+    }
+  }
+}
+
 static bool __stp_printstate = true;
 extern llvm::raw_ostream *g_solverLog;
 
@@ -912,11 +976,15 @@ STPSolverImpl::computeInitialValues(const Query &query,
 
   reinstantiate();
 
-  vc_push(vc);
-
-  for (ConstraintManager::const_iterator it = query.constraints.begin(),
-         ie = query.constraints.end(); it != ie; ++it)
-    vc_assertFormula(vc, builder->construct(*it));
+  if (IncrementalSTP) {
+    syncConstraints(query.constraints);
+    vc_push(vc);
+  } else {
+    vc_push(vc);
+    for (ConstraintManager::const_iterator it = query.constraints.begin(),
+           ie = query.constraints.end(); it != ie; ++it)
+      vc_assertFormula(vc, builder->construct(*it));
+  }
 
 	std::map<const Array*, std::set<int> > related;
   if(PropagateConcolics){
@@ -972,18 +1040,8 @@ STPSolverImpl::computeInitialValues(const Query &query,
 
   if (success) {
     if (hasSolution){
-    	 if(PropagateConcolics){
-    		 for (unsigned i=0; i<objects.size(); ++i) {
-				std::set<int> symbpos = related[objects[i]];
-				for(unsigned ai = 0 ;ai < objects[i]->size; ai++){
-					if(symbpos.find(ai) == symbpos.end()){
-						values[i][ai] =  objects[i]->concreteBuffer[ai];
-					}else{
-						continue;
-					}
-				}
-        	}
-    	 }
+    	 if(PropagateConcolics)
+    		 propagateConcolicValues(objects, values, related);
       ++stats::queriesInvalid;
     }
     else
@@ -998,6 +1056,391 @@ STPSolverImpl::computeInitialValues(const Query &query,
 SolverImpl::SolverRunStatus STPSolverImpl::getOperationStatusCode() {
    return runStatusCode;
 }
+
+/***/
+
+/// STPWorker - One query being solved by a child process. STP keeps global
+/// state behind its C interface, so several validity checkers cannot be
+/// used concurrently in one process. Each child instead inherits the VC of
+/// the querying process with the formula already asserted, runs vc_query
+/// and writes its counterexample to its own slice of shared memory.
+struct STPWorker {
+  unsigned id;
+  pid_t pid;
+  unsigned char *cex;
+  /// Wall time at which the child was started, in seconds.
+  double startTime;
+
+  STPWorker() : id(0), pid(-1), cex(0), startTime(0) {}
+};
+
+class ParallelSTPSolverImpl : public SolverImpl {
+private:
+  VC vc;
+  STPBuilder *builder;
+  double timeout;
+  std::vector<STPWorker> workers;
+  unsigned running;
+  SolverRunStatus runStatusCode;
+
+  void push(const Query &query,
+            std::map<const Array*, std::set<int> > *related);
+  bool spawn(STPWorker &w, ::VCExpr q,
+             const std::vector<const Array*> &objects);
+  SolverRunStatus collect(STPWorker &w,
+                          const std::vector<const Array*> &objects,
+                          std::vector< std::vector<unsigned char> > &values,
+                          bool &hasSolution);
+
+public:
+  ParallelSTPSolverImpl(unsigned numWorkers);
+  ~ParallelSTPSolverImpl();
+
+  char *getConstraintLog(const Query&);
+  void setCoreSolverTimeout(double _timeout) { timeout = _timeout; }
+
+  bool computeValidity(const Query&, Solver::Validity &result);
+  bool computeTruth(const Query&, bool &isValid);
+  bool computeValue(const Query&, ref<Expr> &result);
+  bool computeInitialValues(const Query&,
+                            const std::vector<const Array*> &objects,
+                            std::vector< std::vector<unsigned char> > &values,
+                            bool &hasSolution);
+  SolverRunStatus getOperationStatusCode();
+};
+
+ParallelSTPSolverImpl::ParallelSTPSolverImpl(unsigned numWorkers)
+  : vc(vc_createValidityChecker()),
+    builder(new STPBuilder(vc)),
+    timeout(0.0),
+    workers(numWorkers),
+    running(0),
+    runStatusCode(SOLVER_RUN_STATUS_FAILURE)
+{
+  assert(numWorkers > 0 && "need at least one solver worker");
+  assert(vc && "unable to create validity checker");
+
+#ifdef HAVE_EXT_STP
+  vc_setInterfaceFlags(vc, EXPRDELETE, 0);
+#endif
+
+  vc_registerErrorHandler(::stp_error_handler);
+
+#ifdef __MINGW32__
+  assert(false && "Cannot use parallel stp solver on Windows");
+#else
+  int id = shmget(IPC_PRIVATE, numWorkers * shared_memory_size,
+                  IPC_CREAT | 0700);
+  assert(id >= 0 && "shmget failed");
+  unsigned char *mem = (unsigned char*) shmat(id, NULL, 0);
+  assert(mem != (void*) -1 && "shmat failed");
+  shmctl(id, IPC_RMID, NULL);
+
+  for (unsigned i = 0; i < numWorkers; ++i) {
+    workers[i].id = i;
+    workers[i].cex = mem + i * shared_memory_size;
+  }
+#endif
+
+  stats::solverWorkers.resize(numWorkers);
+}
+
+ParallelSTPSolverImpl::~ParallelSTPSolverImpl() {
+#ifndef __MINGW32__
+  shmdt(workers[0].cex);
+#endif
+  delete builder;
+  vc_Destroy(vc);
+}
+
+/// push - Assert the constraints of the query in a new context level.
+void ParallelSTPSolverImpl::push(const Query &query,
+                                 std::map<const Array*, std::set<int> >
+                                   *related) {
+  vc_push(vc);
+  for (ConstraintManager::const_iterator it = query.constraints.begin(),
+         ie = query.constraints.end(); it != ie; ++it) {
+    vc_assertFormula(vc, builder->construct(*it));
+    if (related)
+      scanreadexpr(*it, *related);
+  }
+  if (related)
+    scanreadexpr(query.expr, *related);
+}
+
+/// spawn - Start solving q on a child process.
+bool ParallelSTPSolverImpl::spawn(STPWorker &w, ::VCExpr q,
+                                  const std::vector<const Array*> &objects) {
+#ifdef __MINGW32__
+  return false;
+#else
+  unsigned sum = 0;
+  for (std::vector<const Array*>::const_iterator
+         it = objects.begin(), ie = objects.end(); it != ie; ++it)
+    sum += (*it)->size;
+  assert(sum < shared_memory_size &&
+         "not enough shared memory for counterexample");
+
+  fflush(stdout);
+  fflush(stderr);
+
+  sigset_t sig_mask, sig_mask_old;
+  sigfillset(&sig_mask);
+  sigemptyset(&sig_mask_old);
+  sigprocmask(SIG_SETMASK, &sig_mask, &sig_mask_old);
+
+  w.pid = fork();
+  if (w.pid == -1) {
+    sigprocmask(SIG_SETMASK, &sig_mask_old, NULL);
+    fprintf(stderr, "error: fork failed (for STP worker %u)\n", w.id);
+    return false;
+  }
+
+  if (w.pid == 0) {
+    sigprocmask(SIG_SETMASK, &sig_mask_old, NULL);
+    if (timeout) {
+      ::alarm(0);
+      ::signal(SIGALRM, stpTimeoutHandler);
+      ::alarm(std::max(1, (int)timeout));
+    }
+    unsigned res = vc_query(vc, q);
+    if (!res) {
+      unsigned char *pos = w.cex;
+      for (std::vector<const Array*>::const_iterator
+             it = objects.begin(), ie = objects.end(); it != ie; ++it) {
+        const Array *array = *it;
+        for (unsigned offset = 0; offset < array->size; offset++) {
+          ExprHandle counter =
+            vc_getCounterExample(vc, builder->getInitialRead(array, offset));
+          *pos++ = getBVUnsigned(counter);
+        }
+      }
+    }
+    _exit(res);
+  }
+
+  sigprocmask(SIG_SETMASK, &sig_mask_old, NULL);
+
+  w.startTime = util::getWallTime();
+  ++running;
+
+  SolverWorkerStats &ws = stats::solverWorkers[w.id];
+  ws.queueDepth = running;
+  ws.maxQueueDepth = std::max(ws.maxQueueDepth, ws.queueDepth);
+  return true;
+#endif
+}
+
+/// collect - Wait for the child of the worker and read back its answer.
+SolverImpl::SolverRunStatus
+ParallelSTPSolverImpl::collect(STPWorker &w,
+                               const std::vector<const Array*> &objects,
+                               std::vector< std::vector<unsigned char> >
+                                 &values,
+                               bool &hasSolution) {
+#ifdef __MINGW32__
+  return SOLVER_RUN_STATUS_FORK_FAILED;
+#else
+  int status;
+  pid_t res;
+
+  do {
+    res = waitpid(w.pid, &status, 0);
+  } while (res < 0 && errno == EINTR);
+
+  --running;
+  SolverWorkerStats &ws = stats::solverWorkers[w.id];
+  ++ws.queries;
+  ws.latency += (uint64_t) ((util::getWallTime() - w.startTime) * 1000000);
+  ws.queueDepth = running;
+  w.pid = -1;
+
+  if (res < 0) {
+    perror("waitpid()");
+    return SOLVER_RUN_STATUS_WAITPID_FAILED;
+  }
+
+  if (WIFSIGNALED(status) || !WIFEXITED(status)) {
+    fprintf(stderr, "error: STP worker %u did not return successfully\n",
+            w.id);
+    return SOLVER_RUN_STATUS_INTERRUPTED;
+  }
+
+  int exitcode = WEXITSTATUS(status);
+  if (exitcode == 52) {
+    fprintf(stderr, "error: STP timed out\n");
+    return SOLVER_RUN_STATUS_TIMEOUT;
+  } else if (exitcode != 0 && exitcode != 1) {
+    fprintf(stderr, "error: STP did not return a recognized code (%d)\n",
+            exitcode);
+    return SOLVER_RUN_STATUS_UNEXPECTED_EXIT_CODE;
+  }
+
+  hasSolution = exitcode == 0;
+  if (!hasSolution) {
+    ++stats::queriesValid;
+    return SOLVER_RUN_STATUS_SUCCESS_UNSOLVABLE;
+  }
+
+  ++stats::queriesInvalid;
+  const unsigned char *pos = w.cex;
+  values = std::vector< std::vector<unsigned char> >(objects.size());
+  for (unsigned i = 0; i < objects.size(); ++i) {
+    values[i].insert(values[i].begin(), pos, pos + objects[i]->size);
+    pos += objects[i]->size;
+  }
+  return SOLVER_RUN_STATUS_SUCCESS_SOLVABLE;
+#endif
+}
+
+static bool isSuccess(SolverImpl::SolverRunStatus status) {
+  return status == SolverImpl::SOLVER_RUN_STATUS_SUCCESS_SOLVABLE ||
+         status == SolverImpl::SOLVER_RUN_STATUS_SUCCESS_UNSOLVABLE;
+}
+
+char *ParallelSTPSolverImpl::getConstraintLog(const Query &query) {
+  push(query, NULL);
+  assert(query.expr == ConstantExpr::alloc(0, Expr::Bool) &&
+         "Unexpected expression in query!");
+
+  char *buffer;
+  unsigned long length;
+  vc_printQueryStateToBuffer(vc, builder->getFalse(),
+                             &buffer, &length, false);
+  vc_pop(vc);
+
+  return buffer;
+}
+
+/// computeValidity - Check the query and its negation on two workers at
+/// the same time, which is what every symbolic branch needs.
+bool ParallelSTPSolverImpl::computeValidity(const Query &query,
+                                            Solver::Validity &result) {
+  if (workers.size() < 2)
+    return SolverImpl::computeValidity(query, result);
+
+  TimerStatIncrementer t(stats::queryTime);
+  std::vector<const Array*> objects;
+  std::vector< std::vector<unsigned char> > values;
+  bool trueHasSolution = false, falseHasSolution = false;
+
+  ++stats::queries;
+  ++stats::queriesParallel;
+
+  push(query, NULL);
+
+  // The negated query is built while the first one is already solving.
+  runStatusCode = SOLVER_RUN_STATUS_FORK_FAILED;
+  bool trueSpawned = spawn(workers[0], builder->construct(query.expr),
+                           objects);
+  bool falseSpawned = trueSpawned &&
+    spawn(workers[1], builder->construct(Expr::createIsZero(query.expr)),
+          objects);
+
+  SolverRunStatus trueStatus = runStatusCode, falseStatus = runStatusCode;
+  if (trueSpawned)
+    trueStatus = collect(workers[0], objects, values, trueHasSolution);
+  if (falseSpawned)
+    falseStatus = collect(workers[1], objects, values, falseHasSolution);
+
+  vc_pop(vc);
+
+  if (!isSuccess(trueStatus)) {
+    runStatusCode = trueStatus;
+    return false;
+  }
+  runStatusCode = falseStatus;
+  if (!isSuccess(falseStatus))
+    return false;
+
+  if (!trueHasSolution)
+    result = Solver::True;
+  else
+    result = falseHasSolution ? Solver::Unknown : Solver::False;
+  return true;
+}
+
+bool ParallelSTPSolverImpl::computeTruth(const Query &query, bool &isValid) {
+  std::vector<const Array*> objects;
+  std::vector< std::vector<unsigned char> > values;
+  bool hasSolution;
+
+  if (!computeInitialValues(query, objects, values, hasSolution))
+    return false;
+
+  isValid = !hasSolution;
+  return true;
+}
+
+bool ParallelSTPSolverImpl::computeValue(const Query &query,
+                                         ref<Expr> &result) {
+  std::vector<const Array*> objects;
+  std::vector< std::vector<unsigned char> > values;
+  bool hasSolution;
+
+  findSymbolicObjects(query.expr, objects);
+  if (!computeInitialValues(query.withFalse(), objects, values, hasSolution))
+    return false;
+
+  // The constraints of the state are unsatisfiable, there is no value.
+  if (!hasSolution) {
+    klee_warning("STP found no value for a state with invalid constraints");
+    runStatusCode = SOLVER_RUN_STATUS_FAILURE;
+    return false;
+  }
+
+  Assignment a(objects, values);
+  result = a.evaluate(query.expr);
+
+  return true;
+}
+
+bool
+ParallelSTPSolverImpl::computeInitialValues(const Query &query,
+                                            const std::vector<const Array*>
+                                              &objects,
+                                            std::vector< std::vector<unsigned char> >
+                                              &values,
+                                            bool &hasSolution) {
+  TimerStatIncrementer t(stats::queryTime);
+  std::map<const Array*, std::set<int> > related;
+
+  ++stats::queries;
+  if (!objects.empty())
+    ++stats::queryCounterexamples;
+
+  push(query, PropagateConcolics ? &related : NULL);
+
+  runStatusCode = SOLVER_RUN_STATUS_FORK_FAILED;
+  if (spawn(workers[0], builder->construct(query.expr), objects))
+    runStatusCode = collect(workers[0], objects, values, hasSolution);
+
+  vc_pop(vc);
+
+  if (!isSuccess(runStatusCode))
+    return false;
+
+  if (hasSolution && PropagateConcolics)
+    propagateConcolicValues(objects, values, related);
+  return true;
+}
+
+SolverImpl::SolverRunStatus ParallelSTPSolverImpl::getOperationStatusCode() {
+  return runStatusCode;
+}
+
+ParallelSTPSolver::ParallelSTPSolver(unsigned numWorkers)
+  : Solver(new ParallelSTPSolverImpl(numWorkers))
+{
+}
+
+char *ParallelSTPSolver::getConstraintLog(const Query &query) {
+  return impl->getConstraintLog(query);
+}
+
+void ParallelSTPSolver::setCoreSolverTimeout(double timeout) {
+  impl->setCoreSolverTimeout(timeout);
+}
 void SolverImpl::scanreadexpr(const ref<Expr> &e, std::map<const Array*, std::set<int> > &related) {
   if (!isa<klee::ConstantExpr>(e)) {
       Expr *ep = e.get();
@@ -12,12 +12,20 @@
 using namespace klee;
 
 Statistic stats::cexCacheTime("CexCacheTime", "CCtime");
+Statistic stats::incrementalConstraintsReused("IncrementalConstraintsReused", "ICreused");
 Statistic stats::queries("Queries", "Q");
 Statistic stats::queriesInvalid("QueriesInvalid", "Qiv");
 Statistic stats::queriesValid("QueriesValid", "Qv");
+Statistic stats::queriesParallel("QueriesParallel", "Qpar");
 Statistic stats::queryCacheHits("QueryCacheHits", "QChits") ;
 Statistic stats::queryCacheMisses("QueryCacheMisses", "QCmisses");
 Statistic stats::queryConstructTime("QueryConstructTime", "QBtime") ;
 Statistic stats::queryConstructs("QueriesConstructs", "QB");
 Statistic stats::queryCounterexamples("QueriesCEX", "Qcex");
 Statistic stats::queryTime("QueryTime", "Qtime");
+Statistic stats::sharedCacheDroppedInserts("SharedCacheDroppedInserts", "SCdropped");
+Statistic stats::sharedCacheEvictions("SharedCacheEvictions", "SCevict");
+Statistic stats::sharedCacheHits("SharedCacheHits", "SChits");
+Statistic stats::sharedCacheMisses("SharedCacheMisses", "SCmisses");
+
+std::vector<SolverWorkerStats> stats::solverWorkers;
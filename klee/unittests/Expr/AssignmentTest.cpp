@@ -0,0 +1,44 @@
+//===-- AssignmentTest.cpp ------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "gtest/gtest.h"
+
+#include "klee/Expr.h"
+#include "klee/util/Assignment.h"
+
+using namespace klee;
+
+namespace {
+
+TEST(AssignmentTest, CachedEvaluation) {
+  Array *array = new Array("arr", 4);
+  ref<Expr> read = Expr::createTempRead(array, 32);
+  ref<Expr> sum = AddExpr::create(read, read);
+
+  std::vector<unsigned char> values(4, 1);
+  Assignment a(false, true);
+  a.add(array, values);
+
+  EXPECT_EQ(ref<Expr>(ConstantExpr::alloc(0x02020202, 32)), a.evaluate(sum));
+  EXPECT_EQ(ref<Expr>(ConstantExpr::alloc(0x02020202, 32)), a.evaluate(sum));
+
+  // changing the bindings invalidates cached values
+  values[0] = 2;
+  a.clear();
+  a.add(array, values);
+  EXPECT_EQ(ref<Expr>(ConstantExpr::alloc(0x02020204, 32)), a.evaluate(sum));
+
+  // copies evaluate against their own bindings
+  Assignment b(a);
+  b.clear();
+  EXPECT_EQ(ref<Expr>(ConstantExpr::alloc(0, 32)), b.evaluate(sum));
+  EXPECT_EQ(ref<Expr>(ConstantExpr::alloc(0x02020204, 32)), a.evaluate(sum));
+}
+
+}
@@ -0,0 +1,115 @@
+//===-- ConstraintsTest.cpp -----------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <iostream>
+#include <sys/time.h>
+#include "gtest/gtest.h"
+
+#include "klee/Constraints.h"
+#include "klee/Expr.h"
+
+using namespace klee;
+
+namespace {
+
+ref<Expr> readByte(const Array *array, unsigned index) {
+  UpdateList ul(array, 0);
+  return ReadExpr::create(ul, ConstantExpr::alloc(index, Expr::Int32));
+}
+
+TEST(ConstraintsTest, EqualitySubstitution) {
+  Array *array = new Array("arr", 16);
+  ref<Expr> b0 = readByte(array, 0);
+  ref<Expr> b1 = readByte(array, 1);
+  ref<Expr> c10 = ConstantExpr::alloc(10, Expr::Int8);
+
+  ConstraintManager cm;
+  cm.addConstraint(UltExpr::create(b1, b0));
+  cm.addConstraint(EqExpr::create(c10, b0));
+
+  // the first constraint was rewritten with the new equality
+  EXPECT_EQ(2U, cm.size());
+  EXPECT_EQ(UltExpr::create(b1, c10), *cm.begin());
+
+  EXPECT_EQ(c10, cm.simplifyExpr(b0));
+  EXPECT_EQ(ref<Expr>(AddExpr::create(b1, c10)),
+            cm.simplifyExpr(AddExpr::create(b1, b0)));
+  EXPECT_TRUE(cm.simplifyExpr(UltExpr::create(b1, c10))->isTrue());
+}
+
+TEST(ConstraintsTest, CopiesAreIndependent) {
+  Array *array = new Array("arr", 16);
+  ref<Expr> b0 = readByte(array, 0);
+  ref<Expr> b1 = readByte(array, 1);
+  ref<Expr> c1 = ConstantExpr::alloc(1, Expr::Int8);
+  ref<Expr> c2 = ConstantExpr::alloc(2, Expr::Int8);
+
+  ConstraintManager cm;
+  cm.addConstraint(EqExpr::create(c1, b0));
+  EXPECT_EQ(b1, cm.simplifyExpr(b1));
+
+  ConstraintManager copy(cm);
+  copy.addConstraint(EqExpr::create(c2, b1));
+
+  EXPECT_EQ(c1, copy.simplifyExpr(b0));
+  EXPECT_EQ(c2, copy.simplifyExpr(b1));
+  EXPECT_EQ(b1, cm.simplifyExpr(b1));
+  EXPECT_EQ(1U, cm.size());
+
+  cm = copy;
+  EXPECT_EQ(c2, cm.simplifyExpr(b1));
+}
+
+TEST(ConstraintsTest, UnoptimizedConstruction) {
+  Array *array = new Array("arr", 16);
+  ref<Expr> b0 = readByte(array, 0);
+  ref<Expr> c3 = ConstantExpr::alloc(3, Expr::Int8);
+
+  std::vector< ref<Expr> > constraints;
+  constraints.push_back(EqExpr::create(c3, b0));
+
+  ConstraintManager cm(constraints);
+  EXPECT_EQ(c3, cm.simplifyExpr(b0));
+}
+
+// Replays a parser-like path over a 10k byte input: range checks on each
+// byte, with every fourth byte fixed to a constant. Reports the average
+// cost of addConstraint.
+// Run with --gtest_also_run_disabled_tests.
+TEST(ConstraintsTest, DISABLED_AddConstraintBenchmark) {
+  const unsigned count = 10000;
+  Array *array = new Array("input", count);
+
+  std::vector< ref<Expr> > path;
+  for (unsigned i = 0; i < count; ++i) {
+    ref<Expr> b = readByte(array, i);
+    if (i % 4 == 0) {
+      path.push_back(EqExpr::create(ConstantExpr::alloc(i & 0x7f, Expr::Int8), b));
+    } else {
+      path.push_back(UltExpr::create(b, ConstantExpr::alloc(0x80, Expr::Int8)));
+    }
+  }
+
+  ConstraintManager cm;
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  for (unsigned i = 0; i < count; ++i) {
+    cm.addConstraint(path[i]);
+  }
+  gettimeofday(&end, NULL);
+
+  double usec = (end.tv_sec - start.tv_sec) * 1000000.0 +
+                (end.tv_usec - start.tv_usec);
+  std::cout << "addConstraint: " << usec / count << " us per call, "
+            << count << " constraints\n";
+
+  EXPECT_EQ(count, cm.size());
+}
+
+}
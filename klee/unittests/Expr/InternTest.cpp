@@ -0,0 +1,100 @@
+//===-- InternTest.cpp ----------------------------------------------------===//
+//
+//                     The KLEE Symbolic Virtual Machine
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "gtest/gtest.h"
+
+#include "klee/Expr.h"
+
+#include "llvm/Support/CommandLine.h"
+
+using namespace klee;
+
+namespace {
+
+// Hash-consing is off by default. Once enabled it stays on for the rest
+// of the run, which the other tests do not notice.
+void enableHashConsing() {
+  static bool enabled = false;
+  if (!enabled) {
+    const char *argv[] = { "ExprTests", "-hash-cons-exprs" };
+    llvm::cl::ParseCommandLineOptions(2, argv);
+    enabled = true;
+  }
+}
+
+ref<Expr> readByte(const Array *array, unsigned index) {
+  UpdateList ul(array, 0);
+  return ReadExpr::create(ul, ConstantExpr::alloc(index, Expr::Int32));
+}
+
+TEST(InternTest, EqualExpressionsShareNode) {
+  enableHashConsing();
+
+  Array *array = new Array("intern0", 16);
+  ref<Expr> a = AddExpr::create(ZExtExpr::create(readByte(array, 0), Expr::Int32),
+                                ConstantExpr::alloc(10, Expr::Int32));
+  ref<Expr> b = AddExpr::create(ZExtExpr::create(readByte(array, 0), Expr::Int32),
+                                ConstantExpr::alloc(10, Expr::Int32));
+
+  EXPECT_EQ(a.get(), b.get());
+  EXPECT_EQ(a->getKid(0).get(), b->getKid(0).get());
+  EXPECT_EQ(readByte(array, 3).get(), readByte(array, 3).get());
+  EXPECT_NE(readByte(array, 3).get(), readByte(array, 4).get());
+}
+
+TEST(InternTest, DifferentWidthsAndKindsDoNotCollide) {
+  enableHashConsing();
+
+  Array *array = new Array("intern1", 16);
+  ref<Expr> byte = readByte(array, 0);
+
+  EXPECT_NE(ConstantExpr::alloc(1, Expr::Int8).get(),
+            ConstantExpr::alloc(1, Expr::Int32).get());
+  EXPECT_NE(ZExtExpr::alloc(byte, Expr::Int16).get(),
+            ZExtExpr::alloc(byte, Expr::Int32).get());
+
+  // Casts hash their width and source only, so these two share a bucket
+  ref<Expr> zext = ZExtExpr::alloc(byte, Expr::Int32);
+  ref<Expr> sext = SExtExpr::alloc(byte, Expr::Int32);
+  EXPECT_EQ(zext->hash(), sext->hash());
+  EXPECT_NE(zext.get(), sext.get());
+  EXPECT_EQ(Expr::ZExt, zext->getKind());
+  EXPECT_EQ(Expr::SExt, sext->getKind());
+
+  EXPECT_NE(AddExpr::alloc(zext, sext).get(), SubExpr::alloc(zext, sext).get());
+  EXPECT_NE(AddExpr::alloc(zext, sext).get(), AddExpr::alloc(sext, zext).get());
+}
+
+TEST(InternTest, LastReferenceRemovesEntry) {
+  enableHashConsing();
+
+  Array *array = new Array("intern2", 16);
+  ref<Expr> byte = readByte(array, 0);
+  unsigned before = Expr::getInternedCount();
+
+  {
+    ref<Expr> e = ZExtExpr::alloc(byte, Expr::Int64);
+    ref<Expr> copy = ZExtExpr::alloc(byte, Expr::Int64);
+    EXPECT_EQ(e.get(), copy.get());
+    EXPECT_EQ(before + 1, Expr::getInternedCount());
+
+    e = 0;
+    // Still referenced by copy
+    EXPECT_EQ(before + 1, Expr::getInternedCount());
+  }
+
+  EXPECT_EQ(before, Expr::getInternedCount());
+
+  // A new node is interned again afterwards
+  ref<Expr> again = ZExtExpr::alloc(byte, Expr::Int64);
+  EXPECT_EQ(before + 1, Expr::getInternedCount());
+  EXPECT_EQ(again.get(), ZExtExpr::alloc(byte, Expr::Int64).get());
+}
+
+}
@@ -163,4 +163,32 @@ TEST(SolverTest, Evaluation) {
   delete solver;
 }
 
+TEST(SolverTest, ParallelValidity) {
+  Solver *solver = new ParallelSTPSolver(2);
+
+  Array *array = new Array("parallel", 1);
+  ref<Expr> read = Expr::createTempRead(array, Expr::Int8);
+  ref<Expr> small = UltExpr::create(read, getConstant(16, Expr::Int8));
+
+  ConstraintManager constraints;
+  Solver::Validity result;
+
+  ASSERT_TRUE(solver->evaluate(Query(constraints, small), result));
+  EXPECT_EQ(Solver::Unknown, result);
+
+  constraints.addConstraint(UltExpr::create(read, getConstant(4, Expr::Int8)));
+  ASSERT_TRUE(solver->evaluate(Query(constraints, small), result));
+  EXPECT_EQ(Solver::True, result);
+
+  ref<Expr> sixteen = EqExpr::create(read, getConstant(16, Expr::Int8));
+  ASSERT_TRUE(solver->evaluate(Query(constraints, sixteen), result));
+  EXPECT_EQ(Solver::False, result);
+
+  ref<ConstantExpr> value;
+  ASSERT_TRUE(solver->getValue(Query(constraints, read), value));
+  EXPECT_GT(4u, value->getZExtValue());
+
+  delete solver;
+}
+
 }
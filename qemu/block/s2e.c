@@ -226,23 +226,9 @@ static int s2e_read_dirty_klee(BlockDriverState *bs, uint8_t *buffer, uint64_t s
         return 0;
     }
 
-    int found_dirty = false;
-
-    while (nb_sectors) {
-        int read_count = __hook_bdrv_read(bs, sector_num, buffer, nb_sectors);
-        if (read_count > 0) {
-            found_dirty = true;
-            sector_num += read_count;
-            nb_sectors -= read_count;
-            buffer += S2EB_SECTOR_SIZE * read_count;
-        } else {
-            ++sector_num;
-            --nb_sectors;
-            buffer += S2EB_SECTOR_SIZE;
-        }
-    }
-
-    return found_dirty;
+    /* The hook copies all the sectors of the range that the
+       current state wrote and returns how many there were */
+    return __hook_bdrv_read(bs, sector_num, buffer, nb_sectors) > 0;
 }
 
 static int coroutine_fn s2e_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -232,10 +232,23 @@ struct TranslationBlock {
     struct TranslationBlock* s2e_tb_next[2];
     uint64_t pcOfLastInstr; /* XXX: hack for call instructions */
     uint32_t instruction_set;
+
+    /* Cached dispatch decision for the symbolic register mask s2e_smask.
+       When the TB may run natively, the decision also covers the chained
+       TBs and is only valid while s2e_smask_link_gen equals
+       g_s2e_tb_link_generation. A generation of 0 means no summary. */
+    uint64_t s2e_smask;
+    uint64_t s2e_smask_link_gen;
+    int s2e_smask_klee;
 #endif
 
 };
 
+#ifdef CONFIG_S2E
+/* Incremented each time a TB gets chained to another one */
+extern uint64_t g_s2e_tb_link_generation;
+#endif
+
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
     target_ulong tmp;
@@ -342,6 +355,7 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
         tb_next->jmp_first = (TranslationBlock *)((uintptr_t)(tb) | (n));
 #ifdef CONFIG_S2E
         tb->s2e_tb_next[n] = tb_next;
+        ++g_s2e_tb_link_generation;
 #endif
 #ifdef CONFIG_LLVM
         tb->llvm_tb_next[n] = tb_next;
@@ -2044,6 +2044,7 @@ static CPUTLBEntry s_cputlb_empty_entry = {
 
 #ifdef CONFIG_S2E
 int g_s2e_disable_tlb_flush = 0;
+uint64_t g_s2e_tb_link_generation = 1;
 #endif
 
 void tlb_flush(CPUArchState *env, int flush_global)
@@ -0,0 +1,99 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+#ifndef S2E_LOADBALANCING_H
+#define S2E_LOADBALANCING_H
+
+namespace s2e {
+
+/**
+ * Decides whether the instance in slot self should fork and hand off
+ * half of its states to the child.
+ *
+ * stateCounts and processIds have maxProcesses entries, a processIds
+ * entry of -1 marks a free slot. Only the instance with the most states
+ * donates (ties go to the lowest slot), and only when it has at least
+ * two states and either another instance asked for work or it has
+ * reached minStates.
+ */
+static inline bool shouldDonateStates(const unsigned *stateCounts,
+                                      const unsigned *processIds,
+                                      unsigned maxProcesses,
+                                      unsigned processCount,
+                                      unsigned self,
+                                      bool requested,
+                                      unsigned minStates)
+{
+    if (processCount >= maxProcesses) {
+        return false;
+    }
+
+    unsigned count = stateCounts[self];
+    if (count < 2 || (!requested && count < minStates)) {
+        return false;
+    }
+
+    for (unsigned i=0; i<maxProcesses; ++i) {
+        if (i == self || processIds[i] == (unsigned)-1) {
+            continue;
+        }
+
+        unsigned other = stateCounts[i];
+        if (other > count || (other == count && i < self)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * States are ranked by searcher priority before a fork and dealt out
+ * alternately: the parent keeps the even ranks, the child the odd ones.
+ */
+static inline bool keepsStateAfterFork(unsigned rank, bool child)
+{
+    return (rank % 2 != 0) == child;
+}
+
+/** Number of states out of count that the parent or the child keeps */
+static inline unsigned statesKeptAfterFork(unsigned count, bool child)
+{
+    return count / 2 + (child ? 0 : count % 2);
+}
+
+}
+
+#endif
@@ -66,13 +66,15 @@ const std::string& Plugin::getNodeID(){
 	}
 	return m_nodeID;
 }
-PluginState *Plugin::getPluginState(S2EExecutionState *s, PluginStateFactory f) const
+PluginState *Plugin::getPluginState(S2EExecutionState *s, PluginStateFactory f,
+                                    bool writeable) const
 {
-    if (m_CachedPluginS2EState == s) {
+    if (m_CachedPluginS2EState == s && (m_CachedPluginStateWriteable || !writeable)) {
         return m_CachedPluginState;
     }
-    m_CachedPluginState = s->getPluginState(const_cast<Plugin*>(this), f);
+    m_CachedPluginState = s->getPluginState(const_cast<Plugin*>(this), f, writeable);
     m_CachedPluginS2EState = s;
+    m_CachedPluginStateWriteable = writeable;
     return m_CachedPluginState;
 }
 
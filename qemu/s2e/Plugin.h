@@ -56,10 +56,12 @@ private:
 protected:
     mutable PluginState *m_CachedPluginState;
     mutable S2EExecutionState *m_CachedPluginS2EState;
+    /* False if the cached state may still be shared with other states */
+    mutable bool m_CachedPluginStateWriteable;
     std::string m_nodeID;
 public:
     Plugin(S2E* s2e) : m_s2e(s2e),m_CachedPluginState(NULL),
-        m_CachedPluginS2EState(NULL) {}
+        m_CachedPluginS2EState(NULL), m_CachedPluginStateWriteable(false) {}
 
     virtual ~Plugin() {}
 
@@ -77,11 +79,17 @@ public:
     /** Return configuration key for this plugin */
     const std::string& getConfigKey() const;
     const std::string& getNodeID();
-    PluginState *getPluginState(S2EExecutionState *s, PluginState* (*f)(Plugin *, S2EExecutionState *)) const;
+
+    /** Return the state of this plugin in s. Plugin states are shared
+        between forked states until one of them asks for a writeable
+        copy, pass writeable=false to read without copying. */
+    PluginState *getPluginState(S2EExecutionState *s, PluginState* (*f)(Plugin *, S2EExecutionState *),
+                                bool writeable = true) const;
 
     void refresh() {
         m_CachedPluginS2EState = NULL;
         m_CachedPluginState = NULL;
+        m_CachedPluginStateWriteable = false;
     }
 };
 
@@ -95,11 +103,17 @@ public:
     c *name = static_cast<c*>(getPluginState(execstate, &c::factory))
 
 #define DECLARE_PLUGINSTATE_CONST(c, execstate) \
-    const c *plgState = static_cast<c*>(getPluginState(execstate, &c::factory))
+    const c *plgState = static_cast<const c*>(getPluginState(execstate, &c::factory, false))
 
 #define DECLARE_PLUGINSTATE_NCONST(c, name, execstate) \
-    const c *name = static_cast<c*>(getPluginState(execstate, &c::factory))
+    const c *name = static_cast<const c*>(getPluginState(execstate, &c::factory, false))
 
+/**
+ * Per-state data of a plugin. Forking does not copy it: clone() is
+ * called on the first writeable access by one of the states sharing it.
+ * Pointers obtained before a fork must therefore not be written to
+ * after the fork, get the state again instead.
+ */
 class PluginState
 {
 public:
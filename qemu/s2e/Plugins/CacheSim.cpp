@@ -280,9 +280,11 @@ CacheSimState::CacheSimState(S2EExecutionState *s, Plugin *p)
 
     }else {
         if(m_d1) {
-            s2e->getDebugStream()  << "CacheSim: connecting to onDataMemoryAccess" << '\n';
-            s2e->getCorePlugin()->onDataMemoryAccess.connect(
-                sigc::mem_fun(*csp, &CacheSim::onDataMemoryAccess));
+            s2e->getDebugStream()  << "CacheSim: connecting to onConcreteDataMemoryAccessBatch" << '\n';
+            s2e->getCorePlugin()->onConcreteDataMemoryAccessBatch.connect(
+                sigc::mem_fun(*csp, &CacheSim::onDataMemoryAccessBatch));
+            s2e->getCorePlugin()->onSymbolicDataMemoryAccess.connect(
+                sigc::mem_fun(*csp, &CacheSim::onSymbolicDataMemoryAccess));
         }
 
         if(m_i1) {
@@ -395,8 +397,8 @@ void CacheSim::initialize()
 
     ////////////////////
     //XXX: trick to force the initialization of the cache upon first memory access.
-    m_d1_connection = s2e()->getCorePlugin()->onDataMemoryAccess.connect(
-         sigc::mem_fun(*this, &CacheSim::onDataMemoryAccess));
+    m_d1_connection = s2e()->getCorePlugin()->onConcreteDataMemoryAccess.connect(
+         sigc::mem_fun(*this, &CacheSim::onFirstDataMemoryAccess));
 
     m_i1_connection = s2e()->getCorePlugin()->onTranslateBlockStart.connect(
          sigc::mem_fun(*this, &CacheSim::onTranslateBlockStart));
@@ -464,9 +466,12 @@ void CacheSim::onModuleTranslateBlockStart(
     s2e()->getDebugStream() << "Module translation CacheSim " << desc.Name << "  " <<
         pc <<'\n';
 
-    if(plgState->m_d1)
-        s2e()->getCorePlugin()->onDataMemoryAccess.connect(
-            sigc::mem_fun(*this, &CacheSim::onDataMemoryAccess));
+    if(plgState->m_d1) {
+        s2e()->getCorePlugin()->onConcreteDataMemoryAccessBatch.connect(
+            sigc::mem_fun(*this, &CacheSim::onDataMemoryAccessBatch));
+        s2e()->getCorePlugin()->onSymbolicDataMemoryAccess.connect(
+            sigc::mem_fun(*this, &CacheSim::onSymbolicDataMemoryAccess));
+    }
 
     if(plgState->m_i1)
         s2e()->getCorePlugin()->onTranslateBlockStart.connect(
@@ -507,7 +512,7 @@ bool CacheSim::reportAccess(S2EExecutionState *state) const
     return doLog;
 }
 
-void CacheSim::onMemoryAccess(S2EExecutionState *state,
+void CacheSim::onMemoryAccess(S2EExecutionState *state, uint64_t pc,
                               uint64_t address, unsigned size,
                               bool isWrite, bool isIO, bool isCode)
 {
@@ -544,7 +549,7 @@ void CacheSim::onMemoryAccess(S2EExecutionState *state,
                 ExecutionTraceCacheSimEntry e;
                 e.type = CACHE_ENTRY;
                 e.cacheId = c->getId();
-                e.pc = state->getPc();
+                e.pc = pc;
                 e.address = address;
                 e.size = size;
                 e.isWrite = isWrite;
@@ -558,37 +563,67 @@ void CacheSim::onMemoryAccess(S2EExecutionState *state,
     }
 }
 
-void CacheSim::onDataMemoryAccess(S2EExecutionState *state,
+//Only used to initialize the caches upon the first access,
+//the plugin state constructor disconnects this handler.
+void CacheSim::onFirstDataMemoryAccess(S2EExecutionState *state,
+                              uint64_t address, uint64_t hostAddress,
+                              uint64_t value, unsigned size, unsigned flags)
+{
+    onMemoryAccess(state, state->getPc(), m_physAddress ? hostAddress : address,
+                   size, flags & MEMORY_ACCESS_WRITE, flags & MEMORY_ACCESS_IO,
+                   false);
+}
+
+void CacheSim::onDataMemoryAccessBatch(S2EExecutionState *state,
+                              const ConcreteMemoryAccess *accesses,
+                              unsigned count)
+{
+    for (unsigned i = 0; i < count; ++i) {
+        const ConcreteMemoryAccess &a = accesses[i];
+        onMemoryAccess(state, a.pc,
+                       m_physAddress ? a.hostAddress : a.virtualAddress,
+                       a.size, a.flags & MEMORY_ACCESS_WRITE,
+                       a.flags & MEMORY_ACCESS_IO, false);
+    }
+}
+
+void CacheSim::onSymbolicDataMemoryAccess(S2EExecutionState *state,
                               klee::ref<klee::Expr> address,
                               klee::ref<klee::Expr> hostAddress,
                               klee::ref<klee::Expr> value,
                               bool isWrite, bool isIO)
 {
-    if(!isa<ConstantExpr>(hostAddress)) {
+    if(!isa<ConstantExpr>(hostAddress) || !isa<ConstantExpr>(address)) {
         s2e()->getWarningsStream()
                 << "Warning: CacheSim do not support symbolic addresses"
                 << '\n';
         return;
     }
 
+    //Keep the simulated order of accesses
+    s2e()->getCorePlugin()->flushConcreteDataMemoryAccesses();
+
     uint64_t constAddress;
     unsigned size = Expr::getMinBytesForWidth(value->getWidth());
 
     if (m_physAddress) {
         constAddress = cast<ConstantExpr>(hostAddress)->getZExtValue(64);
-  //      s2e()->getDebugStream() << "acc pc=" << std::hex << state->getPc() << " ha=" << constAddress << '\n';
     }else {
         constAddress = cast<ConstantExpr>(address)->getZExtValue(64);
     }
 
-    onMemoryAccess(state, constAddress, size, isWrite, isIO, false);
+    onMemoryAccess(state, state->getPc(), constAddress, size, isWrite, isIO, false);
 }
 
 void CacheSim::onExecuteBlockStart(S2EExecutionState *state, uint64_t pc,
                                    TranslationBlock *tb, uint64_t hostAddress)
 {
 //    s2e()->getDebugStream() << "exec pc=" << std::hex << pc << " ha=" << hostAddress << '\n';
-    onMemoryAccess(state, m_physAddress ? hostAddress : pc, tb->size, false, false, true);
+    //Data accesses of the previous block must hit the caches before
+    //the instruction fetch of this one, chained blocks do not go
+    //through the executor.
+    s2e()->getCorePlugin()->flushConcreteDataMemoryAccesses();
+    onMemoryAccess(state, state->getPc(), m_physAddress ? hostAddress : pc, tb->size, false, false, true);
 }
 
 void CacheSim::onTranslateBlockStart(ExecutionSignal *signal,
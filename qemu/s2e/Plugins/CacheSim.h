@@ -100,11 +100,19 @@ protected:
         TranslationBlock *tb, uint64_t pc);
 
 
-    void onMemoryAccess(S2EExecutionState* state,
+    void onMemoryAccess(S2EExecutionState* state, uint64_t pc,
                         uint64_t address, unsigned size,
                         bool isWrite, bool isIO, bool isCode);
 
-    void onDataMemoryAccess(S2EExecutionState* state,
+    void onFirstDataMemoryAccess(S2EExecutionState* state,
+                        uint64_t address, uint64_t hostAddress,
+                        uint64_t value, unsigned size, unsigned flags);
+
+    void onDataMemoryAccessBatch(S2EExecutionState* state,
+                        const ConcreteMemoryAccess *accesses,
+                        unsigned count);
+
+    void onSymbolicDataMemoryAccess(S2EExecutionState* state,
                         klee::ref<klee::Expr> address,
                         klee::ref<klee::Expr> hostAddress,
                         klee::ref<klee::Expr> value,
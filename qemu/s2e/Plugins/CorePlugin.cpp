@@ -90,6 +90,46 @@ void CorePlugin::initialize()
 
 }
 
+void CorePlugin::notifyConcreteDataMemoryAccess(S2EExecutionState *state,
+                                                uint64_t virtualAddress,
+                                                uint64_t hostAddress,
+                                                uint64_t value, unsigned size,
+                                                unsigned flags)
+{
+    if (!onConcreteDataMemoryAccess.empty()) {
+        onConcreteDataMemoryAccess.emit(state, virtualAddress, hostAddress,
+                                        value, size, flags);
+    }
+
+    if (onConcreteDataMemoryAccessBatch.empty()) {
+        return;
+    }
+
+    if (m_accessBatchState != state ||
+        m_accessBatchCount == CORE_PLUGIN_ACCESS_BATCH_SIZE) {
+        flushConcreteDataMemoryAccesses();
+        m_accessBatchState = state;
+    }
+
+    ConcreteMemoryAccess &a = m_accessBatch[m_accessBatchCount++];
+    a.pc = state->getPc();
+    a.virtualAddress = virtualAddress;
+    a.hostAddress = hostAddress;
+    a.value = value;
+    a.size = size;
+    a.flags = flags;
+}
+
+void CorePlugin::emitConcreteDataMemoryAccessBatch()
+{
+    //Listeners may access memory or kill the state, which would
+    //reenter this function.
+    unsigned count = m_accessBatchCount;
+    m_accessBatchCount = 0;
+    onConcreteDataMemoryAccessBatch.emit(m_accessBatchState,
+                                         m_accessBatch, count);
+}
+
 /******************************/
 /* Functions called from QEMU */
 
@@ -411,16 +451,27 @@ static void s2e_trace_memory_access_slow(
         uint64_t vaddr, uint64_t haddr, uint8_t* buf, unsigned size,
         int isWrite, int isIO)
 {
+    CorePlugin *core = g_s2e->getCorePlugin();
+
     uint64_t value = 0;
     unsigned copy_size = (size > sizeof value) ? sizeof (value) : size;
     memcpy(&value, buf, copy_size);
 
     try {
-        g_s2e->getCorePlugin()->onDataMemoryAccess.emit(g_s2e_state,
-            klee::ConstantExpr::create(vaddr, 64),
-            klee::ConstantExpr::create(haddr, 64),
-            klee::ConstantExpr::create(value, copy_size << 3),
-            isWrite, isIO);
+        if (core->hasConcreteDataMemoryAccessListeners()) {
+            core->notifyConcreteDataMemoryAccess(g_s2e_state, vaddr, haddr,
+                value, copy_size,
+                (isWrite ? MEMORY_ACCESS_WRITE : 0) |
+                (isIO ? MEMORY_ACCESS_IO : 0));
+        }
+
+        if (!core->onDataMemoryAccess.empty()) {
+            core->onDataMemoryAccess.emit(g_s2e_state,
+                klee::ConstantExpr::create(vaddr, 64),
+                klee::ConstantExpr::create(haddr, 64),
+                klee::ConstantExpr::create(value, copy_size << 3),
+                isWrite, isIO);
+        }
     } catch(s2e::CpuExitException&) {
         s2e_longjmp(env->jmp_env, 1);
     }
@@ -434,7 +485,9 @@ void s2e_trace_memory_access(
         uint64_t vaddr, uint64_t haddr, uint8_t* buf, unsigned size,
         int isWrite, int isIO)
 {
-    if(unlikely(!g_s2e->getCorePlugin()->onDataMemoryAccess.empty())) {
+    CorePlugin *core = g_s2e->getCorePlugin();
+    if(unlikely(!core->onDataMemoryAccess.empty() ||
+                core->hasConcreteDataMemoryAccessListeners())) {
         s2e_trace_memory_access_slow(vaddr, haddr, buf, size, isWrite, isIO);
     }
 }
@@ -67,6 +67,24 @@ typedef sigc::signal<void, S2EExecutionState*, uint64_t /* pc */> ExecutionSigna
 typedef bool (*SYMB_PORT_CHECK)(uint16_t port, void *opaque);
 typedef bool (*SYMB_MMIO_CHECK)(uint64_t physaddress, uint64_t size, void *opaque);
 
+/** Flags of a ConcreteMemoryAccess */
+enum MemoryAccessFlags {
+    MEMORY_ACCESS_WRITE = 1,
+    MEMORY_ACCESS_IO = 2
+};
+
+/** A memory access whose address and value are both concrete */
+struct ConcreteMemoryAccess {
+    uint64_t pc;
+    uint64_t virtualAddress;
+    uint64_t hostAddress;
+    uint64_t value;
+    uint32_t size;
+    uint32_t flags;
+};
+
+#define CORE_PLUGIN_ACCESS_BATCH_SIZE 1024
+
 class CorePlugin : public Plugin {
     S2E_PLUGIN
 
@@ -77,6 +95,14 @@ private:
     void *m_isPortSymbolicOpaque;
     void *m_isMmioSymbolicOpaque;
 
+    /* Accesses waiting to be delivered by onConcreteDataMemoryAccessBatch.
+       All of them belong to m_accessBatchState. */
+    ConcreteMemoryAccess m_accessBatch[CORE_PLUGIN_ACCESS_BATCH_SIZE];
+    unsigned m_accessBatchCount;
+    S2EExecutionState *m_accessBatchState;
+
+    void emitConcreteDataMemoryAccessBatch();
+
 public:
     CorePlugin(S2E* s2e): Plugin(s2e) {
         m_Timer = NULL;
@@ -84,6 +110,8 @@ public:
         m_isMmioSymbolicCb = NULL;
         m_isPortSymbolicOpaque = NULL;
         m_isMmioSymbolicOpaque = NULL;
+        m_accessBatchCount = 0;
+        m_accessBatchState = NULL;
     }
 
     void initialize();
@@ -117,6 +145,28 @@ public:
         return false;
     }
 
+    /** Returns true if some plugin listens to concrete memory accesses */
+    inline bool hasConcreteDataMemoryAccessListeners() const {
+        return !onConcreteDataMemoryAccess.empty() ||
+               !onConcreteDataMemoryAccessBatch.empty();
+    }
+
+    /** Reports a concrete memory access to onConcreteDataMemoryAccess
+        and queues it for onConcreteDataMemoryAccessBatch */
+    void notifyConcreteDataMemoryAccess(S2EExecutionState *state,
+                                        uint64_t virtualAddress,
+                                        uint64_t hostAddress,
+                                        uint64_t value, unsigned size,
+                                        unsigned flags);
+
+    /** Delivers the queued accesses. Called at the end of each
+        translation block, before forks, state switches and state kills. */
+    inline void flushConcreteDataMemoryAccesses() {
+        if (m_accessBatchCount) {
+            emitConcreteDataMemoryAccessBatch();
+        }
+    }
+
     struct QEMUTimer *getTimer() {
         return m_Timer;
     }
@@ -197,6 +247,35 @@ public:
                  bool /* isWrite */, bool /* isIO */>
             onDataMemoryAccess;
 
+    /** Signal that is emitted on each memory access whose address and
+        value are concrete. Unlike onDataMemoryAccess, it does not
+        allocate expressions. */
+    sigc::signal<void, S2EExecutionState*,
+                 uint64_t /* virtualAddress */,
+                 uint64_t /* hostAddress */,
+                 uint64_t /* value */,
+                 unsigned /* size */,
+                 unsigned /* flags (MemoryAccessFlags) */>
+            onConcreteDataMemoryAccess;
+
+    /** Same accesses as onConcreteDataMemoryAccess, delivered in batches.
+        Listeners that must see accesses in order with other events can
+        call flushConcreteDataMemoryAccesses() first. */
+    sigc::signal<void, S2EExecutionState*,
+                 const ConcreteMemoryAccess* /* accesses */,
+                 unsigned /* count */>
+            onConcreteDataMemoryAccessBatch;
+
+    /** Signal that is emitted on each memory access with a symbolic
+        address or value, i.e., the accesses that are not reported
+        by onConcreteDataMemoryAccess */
+    sigc::signal<void, S2EExecutionState*,
+                 klee::ref<klee::Expr> /* virtualAddress */,
+                 klee::ref<klee::Expr> /* hostAddress */,
+                 klee::ref<klee::Expr> /* value */,
+                 bool /* isWrite */, bool /* isIO */>
+            onSymbolicDataMemoryAccess;
+
     /** Signal that is emitted on each port access */
     sigc::signal<void, S2EExecutionState*,
                  klee::ref<klee::Expr> /* port */,
@@ -50,7 +50,51 @@ S2E_DEFINE_PLUGIN(ExecutionTracer, "ExecutionTracer plugin", "",);
 
 void ExecutionTracer::initialize()
 {
-    createNewTraceFile(false);
+    ConfigFile *cfg = s2e()->getConfig();
+
+    //Version 1 writes one uncompressed header per item
+    m_format = cfg->getInt(getConfigKey() + ".format", TRACE_FILE_VERSION);
+    m_blockSize = cfg->getInt(getConfigKey() + ".blockSize", 64 * 1024);
+    m_compress = cfg->getBool(getConfigKey() + ".compress", true);
+
+    if (m_format != 1 && m_format != TRACE_FILE_VERSION) {
+        s2e()->getWarningsStream() << "ExecutionTracer: unsupported trace format "
+                                   << m_format << '\n';
+        exit(-1);
+    }
+
+    m_blockStateId = 0;
+    m_blockPid = 0;
+
+    //Compress and write the blocks in a separate thread,
+    //the emulation thread only copies them to a ring buffer
+    m_async = cfg->getBool(getConfigKey() + ".asyncWriter", false);
+    m_dropOnFull = cfg->getBool(getConfigKey() + ".dropOnFull", false);
+    m_droppedBlocks = 0;
+    m_droppedItems = 0;
+    m_writerWaits = 0;
+    m_stopWriter = false;
+    m_pauseWriter = false;
+    m_writerPaused = false;
+
+    if (m_async && m_format != TRACE_FILE_VERSION) {
+        s2e()->getWarningsStream() << "ExecutionTracer: asyncWriter requires format "
+                                   << TRACE_FILE_VERSION << '\n';
+        m_async = false;
+    }
+
+    if (m_async) {
+        uint64_t ringSize = cfg->getInt(getConfigKey() + ".ringBufferSize", 16 * 1024 * 1024);
+        //Make sure that any block fits, even if it exceeds
+        //the block size by one large item
+        if (ringSize < 4 * (uint64_t) m_blockSize) {
+            ringSize = 4 * (uint64_t) m_blockSize;
+        }
+        m_ring = new TraceRingBuffer(ringSize);
+    }
+
+    createNewTraceFile();
+    startWriter();
 
     s2e()->getCorePlugin()->onStateFork.connect(
             sigc::mem_fun(*this, &ExecutionTracer::onFork));
@@ -67,32 +111,286 @@ void ExecutionTracer::initialize()
 ExecutionTracer::~ExecutionTracer()
 {
     if (m_LogFile) {
+        flushBlock();
+        stopWriter();
+        writeIndex();
         fclose(m_LogFile);
     }
+
+    delete m_ring;
 }
 
-void ExecutionTracer::createNewTraceFile(bool append)
+void *ExecutionTracer::writerThread(void *opaque)
 {
+    static_cast<ExecutionTracer*>(opaque)->writerLoop();
+    return NULL;
+}
+
+void ExecutionTracer::startWriter()
+{
+    if (!m_async || m_writerRunning) {
+        return;
+    }
+
+    pthread_mutex_init(&m_writerLock, NULL);
+    pthread_cond_init(&m_writerWake, NULL);
+    pthread_cond_init(&m_writerIdle, NULL);
+
+    m_stopWriter = false;
+    if (pthread_create(&m_writerThread, NULL, writerThread, this)) {
+        s2e()->getWarningsStream() << "ExecutionTracer: could not start the writer thread" << '\n';
+        exit(-1);
+    }
+    m_writerRunning = true;
+}
+
+//Waits until all the queued blocks are written
+void ExecutionTracer::stopWriter()
+{
+    if (!m_writerRunning) {
+        return;
+    }
+
+    pthread_mutex_lock(&m_writerLock);
+    m_stopWriter = true;
+    pthread_cond_signal(&m_writerWake);
+    pthread_mutex_unlock(&m_writerLock);
+
+    pthread_join(m_writerThread, NULL);
+    m_writerRunning = false;
+
+    pthread_cond_destroy(&m_writerIdle);
+    pthread_cond_destroy(&m_writerWake);
+    pthread_mutex_destroy(&m_writerLock);
+
+    if (m_droppedBlocks || m_writerWaits) {
+        s2e()->getWarningsStream() << "ExecutionTracer: dropped " << m_droppedBlocks
+                                   << " blocks (" << m_droppedItems << " items), waited "
+                                   << m_writerWaits << " times for the writer" << '\n';
+    }
+}
+
+//Makes the writer thread flush the file and wait in resumeWriter().
+//The records already queued stay in the ring buffer.
+void ExecutionTracer::pauseWriter()
+{
+    if (!m_writerRunning) {
+        return;
+    }
+
+    pthread_mutex_lock(&m_writerLock);
+    m_pauseWriter = true;
+    pthread_cond_signal(&m_writerWake);
+    while (!m_writerPaused) {
+        pthread_cond_wait(&m_writerIdle, &m_writerLock);
+    }
+    pthread_mutex_unlock(&m_writerLock);
+}
+
+void ExecutionTracer::resumeWriter()
+{
+    if (!m_writerRunning) {
+        return;
+    }
+
+    pthread_mutex_lock(&m_writerLock);
+    m_pauseWriter = false;
+    pthread_cond_signal(&m_writerWake);
+    while (m_writerPaused) {
+        pthread_cond_wait(&m_writerIdle, &m_writerLock);
+    }
+    pthread_mutex_unlock(&m_writerLock);
+}
+
+//Called after pushing a block. The writer checks the ring with the lock
+//held before going to sleep, so it cannot miss the block.
+void ExecutionTracer::wakeWriter()
+{
+    pthread_mutex_lock(&m_writerLock);
+    pthread_cond_signal(&m_writerWake);
+    pthread_mutex_unlock(&m_writerLock);
+}
+
+void ExecutionTracer::writerLoop()
+{
+    std::vector<uint8_t> record;
+    bool dirty = false;
+
+    pthread_mutex_lock(&m_writerLock);
+
+    while (true) {
+        if (m_pauseWriter) {
+            //Leave nothing buffered in the stream and stay out of
+            //stdio, the process may be about to fork
+            if (dirty) {
+                pthread_mutex_unlock(&m_writerLock);
+                fflush(m_LogFile);
+                dirty = false;
+                pthread_mutex_lock(&m_writerLock);
+                continue;
+            }
+
+            m_writerPaused = true;
+            pthread_cond_signal(&m_writerIdle);
+            while (m_pauseWriter) {
+                pthread_cond_wait(&m_writerWake, &m_writerLock);
+            }
+            m_writerPaused = false;
+            pthread_cond_signal(&m_writerIdle);
+            continue;
+        }
+
+        if (m_ring->pop(record)) {
+            pthread_mutex_unlock(&m_writerLock);
+
+            ExecutionTraceBlockHeader hdr;
+            assert(record.size() >= sizeof(hdr));
+            memcpy(&hdr, &record[0], sizeof(hdr));
+            writeBlock(hdr, &record[sizeof(hdr)]);
+            dirty = true;
+
+            //The emulation thread may be waiting for room in the ring
+            pthread_mutex_lock(&m_writerLock);
+            pthread_cond_signal(&m_writerIdle);
+            continue;
+        }
+
+        if (dirty) {
+            pthread_mutex_unlock(&m_writerLock);
+            fflush(m_LogFile);
+            dirty = false;
+            pthread_mutex_lock(&m_writerLock);
+            continue;
+        }
 
-    if (append) {
-        assert(m_fileName.size() > 0);
-        m_LogFile = fopen(m_fileName.c_str(), "a");
-    }else {
-        m_fileName = s2e()->getOutputFilename("ExecutionTracer.dat");
-        m_LogFile = fopen(m_fileName.c_str(), "wb");
+        //Only exit once everything has been written
+        if (m_stopWriter) {
+            break;
+        }
+
+        pthread_cond_wait(&m_writerWake, &m_writerLock);
     }
 
+    pthread_mutex_unlock(&m_writerLock);
+}
+
+void ExecutionTracer::createNewTraceFile()
+{
+    m_fileName = s2e()->getOutputFilename("ExecutionTracer.dat");
+    m_LogFile = fopen(m_fileName.c_str(), "wb");
+
     if (!m_LogFile) {
         s2e()->getWarningsStream() << "Could not create ExecutionTracer.dat" << '\n';
         exit(-1);
     }
     m_CurrentIndex = 0;
+
+    if (m_format == TRACE_FILE_VERSION) {
+        ExecutionTraceFileHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        strncpy(hdr.magic, TRACE_FILE_MAGIC, sizeof(hdr.magic));
+        hdr.version = TRACE_FILE_VERSION;
+        if (fwrite(&hdr, sizeof(hdr), 1, m_LogFile) != 1) {
+            s2e()->getWarningsStream() << "Could not write ExecutionTracer.dat" << '\n';
+            exit(-1);
+        }
+        m_index.clear();
+    }
+}
+
+void ExecutionTracer::flushBlock()
+{
+    if (m_block.empty()) {
+        return;
+    }
+
+    const std::vector<uint8_t> &raw = m_block.getData();
+
+    ExecutionTraceBlockHeader hdr;
+    hdr.magic = TRACE_BLOCK_MAGIC;
+    hdr.stateId = m_blockStateId;
+    hdr.pid = m_blockPid;
+    hdr.timeStamp = m_block.getTimeStamp();
+    hdr.itemCount = m_block.getItemCount();
+    hdr.rawSize = raw.size();
+    hdr.compressedSize = raw.size();
+
+    if (!m_writerRunning) {
+        writeBlock(hdr, &raw[0]);
+    } else if (!m_ring->fits(sizeof(hdr) + raw.size())) {
+        ++m_droppedBlocks;
+        m_droppedItems += hdr.itemCount;
+    } else if (m_ring->push(&hdr, sizeof(hdr), &raw[0], raw.size())) {
+        wakeWriter();
+    } else if (m_dropOnFull) {
+        ++m_droppedBlocks;
+        m_droppedItems += hdr.itemCount;
+    } else {
+        ++m_writerWaits;
+        pthread_mutex_lock(&m_writerLock);
+        while (!m_ring->push(&hdr, sizeof(hdr), &raw[0], raw.size())) {
+            pthread_cond_wait(&m_writerIdle, &m_writerLock);
+        }
+        pthread_cond_signal(&m_writerWake);
+        pthread_mutex_unlock(&m_writerLock);
+    }
+
+    m_block.reset();
+}
+
+//Compresses the block and appends it to the file
+void ExecutionTracer::writeBlock(ExecutionTraceBlockHeader &hdr, const uint8_t *raw)
+{
+    const uint8_t *data = raw;
+    if (m_compress) {
+        m_compressed.resize(traceCompressBound(hdr.rawSize));
+        unsigned size = traceCompress(raw, hdr.rawSize, &m_compressed[0]);
+        //Keep incompressible blocks as they are
+        if (size < hdr.rawSize) {
+            hdr.compressedSize = size;
+            data = &m_compressed[0];
+        }
+    }
+
+    ExecutionTraceIndexEntry entry;
+    entry.offset = ftello(m_LogFile);
+    entry.stateId = hdr.stateId;
+    entry.itemCount = hdr.itemCount;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, m_LogFile) != 1 ||
+        fwrite(data, hdr.compressedSize, 1, m_LogFile) != 1) {
+        //at this point the log is corrupted.
+        assert(false);
+    }
+
+    m_index.push_back(entry);
+}
+
+void ExecutionTracer::writeIndex()
+{
+    if (m_format != TRACE_FILE_VERSION) {
+        return;
+    }
+
+    ExecutionTraceFileFooter footer;
+    footer.indexOffset = ftello(m_LogFile);
+    footer.blockCount = m_index.size();
+    footer.magic = TRACE_INDEX_MAGIC;
+
+    if (!m_index.empty()) {
+        fwrite(&m_index[0], sizeof(m_index[0]), m_index.size(), m_LogFile);
+    }
+    fwrite(&footer, sizeof(footer), 1, m_LogFile);
 }
 
 void ExecutionTracer::onTimer()
 {
     if (m_LogFile) {
-        fflush(m_LogFile);
+        flushBlock();
+        //The writer thread flushes the file when it becomes idle
+        if (!m_writerRunning) {
+            fflush(m_LogFile);
+        }
     }
 }
 
@@ -100,10 +398,30 @@ uint32_t ExecutionTracer::writeData(
         const S2EExecutionState *state,
         void *data, unsigned size, ExecTraceEntryType type)
 {
-    ExecutionTraceItemHeader item;
-
     assert(m_LogFile);
 
+    if (m_format == TRACE_FILE_VERSION) {
+        uint32_t stateId = state->getID();
+        uint64_t pid = state->getPid();
+
+        //Blocks hold the items of a single state
+        if (!m_block.empty() && (stateId != m_blockStateId || pid != m_blockPid)) {
+            flushBlock();
+        }
+
+        m_blockStateId = stateId;
+        m_blockPid = pid;
+        m_block.append(llvm::sys::TimeValue::now().usec(), type, data, size);
+
+        if (m_block.getData().size() >= m_blockSize) {
+            flushBlock();
+        }
+
+        return ++m_CurrentIndex;
+    }
+
+    ExecutionTraceItemHeader item;
+
     item.timeStamp = llvm::sys::TimeValue::now().usec();
     item.size = size;
     item.type = type;
@@ -127,22 +445,48 @@ uint32_t ExecutionTracer::writeData(
 void ExecutionTracer::flush()
 {
     if (m_LogFile) {
+        flushBlock();
+        stopWriter();
         fflush(m_LogFile);
+        startWriter();
     }
 }
 
 void ExecutionTracer::onProcessFork(bool preFork, bool isChild, unsigned parentProcId)
 {
     if (preFork) {
-        fclose(m_LogFile);
-        m_LogFile = NULL;
-    }else {
-        if (isChild) {
-            createNewTraceFile(false);
-        }else {
-            createNewTraceFile(true);
+        //Items of the parent must not end up in the trace of the child
+        flushBlock();
+        if (m_writerRunning) {
+            pauseWriter();
+        } else {
+            fflush(m_LogFile);
         }
+        return;
+    }
+
+    if (!isChild) {
+        //The parent keeps its file, its queued blocks and its writer
+        resumeWriter();
+        return;
     }
+
+    //The stream of the parent has nothing buffered, closing it
+    //does not write to the parent's file.
+    //The writer thread did not survive the fork, the blocks it had
+    //not written yet belong to the parent. Its lock and condition
+    //variables are left as they were, startWriter() sets up new ones.
+    fclose(m_LogFile);
+    m_LogFile = NULL;
+    if (m_ring) {
+        m_ring->clear();
+    }
+    m_writerRunning = false;
+    m_pauseWriter = false;
+    m_writerPaused = false;
+
+    createNewTraceFile();
+    startWriter();
 }
 
 void ExecutionTracer::onFork(S2EExecutionState *state,
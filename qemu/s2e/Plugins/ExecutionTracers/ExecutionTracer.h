@@ -42,8 +42,11 @@
 #include <s2e/S2EExecutionState.h>
 
 #include <stdio.h>
+#include <pthread.h>
 
 #include "TraceEntries.h"
+#include "TraceCompression.h"
+#include "TraceRingBuffer.h"
 
 namespace s2e {
 namespace plugins {
@@ -67,12 +70,58 @@ class ExecutionTracer : public Plugin
     OSMonitor *m_Monitor;
     ExecTracerModules m_Modules;
 
+    /* Version 2 format state */
+    unsigned m_format;
+    unsigned m_blockSize;
+    bool m_compress;
+    TraceBlockEncoder m_block;
+    uint32_t m_blockStateId;
+    uint64_t m_blockPid;
+    std::vector<uint8_t> m_compressed;
+    std::vector<ExecutionTraceIndexEntry> m_index;
+
+    /* Asynchronous writer state (version 2 only).
+       While the writer thread runs, it owns the file, the index,
+       and the compression buffer. The flags below are protected
+       by m_writerLock. The writer sleeps on m_writerWake until there
+       is a block to write or a flag changes, the emulation thread
+       sleeps on m_writerIdle until the ring has room or the writer
+       acknowledged a pause. */
+    bool m_async;
+    bool m_dropOnFull;
+    TraceRingBuffer *m_ring;
+    pthread_t m_writerThread;
+    bool m_writerRunning;
+    pthread_mutex_t m_writerLock;
+    pthread_cond_t m_writerWake;
+    pthread_cond_t m_writerIdle;
+    bool m_stopWriter;
+    bool m_pauseWriter;
+    bool m_writerPaused;
+
+    uint64_t m_droppedBlocks;
+    uint64_t m_droppedItems;
+    uint64_t m_writerWaits;
+
     uint16_t getCompressedId(const ModuleDescriptor *desc);
 
     void onTimer();
-    void createNewTraceFile(bool append);
+    void createNewTraceFile();
+
+    void flushBlock();
+    void writeBlock(ExecutionTraceBlockHeader &hdr, const uint8_t *raw);
+    void writeIndex();
+
+    void startWriter();
+    void stopWriter();
+    void pauseWriter();
+    void resumeWriter();
+    void wakeWriter();
+    void writerLoop();
+    static void *writerThread(void *opaque);
 public:
-    ExecutionTracer(S2E* s2e): Plugin(s2e) {}
+    ExecutionTracer(S2E* s2e): Plugin(s2e), m_LogFile(NULL), m_ring(NULL),
+        m_writerRunning(false) {}
     ~ExecutionTracer();
     void initialize();
 
@@ -33,6 +33,13 @@
  * All contributors are listed in the S2E-AUTHORS file.
  */
 
+extern "C" {
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+extern CPUArchState *env;
+}
+
 #include <iomanip>
 #include <inttypes.h>
 
@@ -97,6 +104,10 @@ void MemoryTracer::initialize()
     m_monitorPageFaults = s2e()->getConfig()->getBool(getConfigKey() + ".monitorPageFaults");
     m_monitorTlbMisses  = s2e()->getConfig()->getBool(getConfigKey() + ".monitorTlbMisses");
 
+    //Sampling and code ranges, see TraceFilter.
+    //With pcRanges, only the blocks in the ranges turn on memory tracing.
+    m_filter = new TraceFilter(s2e(), getConfigKey());
+
     s2e()->getDebugStream() << "MonitorMemory: " << m_monitorMemory << 
     " PageFaults: " << m_monitorPageFaults << " TlbMisses: " << m_monitorTlbMisses << '\n';
 
@@ -111,20 +122,48 @@ void MemoryTracer::initialize()
     }
 }
 
-void MemoryTracer::traceDataMemoryAccess(S2EExecutionState *state,
-                               klee::ref<klee::Expr> &address,
-                               klee::ref<klee::Expr> &hostAddress,
-                               klee::ref<klee::Expr> &value,
-                               bool isWrite, bool isIO)
+bool MemoryTracer::isFiltered(S2EExecutionState *state) const
 {
     if (m_catchAbove || m_catchBelow) {
         if (m_catchAbove && (m_catchAbove >= state->getPc())) {
-            return;
+            return true;
         }
         if (m_catchBelow && (m_catchBelow < state->getPc())) {
-            return;
+            return true;
         }
     }
+    return false;
+}
+
+void MemoryTracer::writeMemoryEntry(S2EExecutionState *state,
+                                    ExecutionTraceMemory &e)
+{
+    if (m_traceHostAddresses) {
+        e.flags |= EXECTRACE_MEM_HASHOSTADDR;
+        e.flags |= EXECTRACE_MEM_OBJECTSTATE;
+
+        klee::ObjectPair op = state->addressSpace.findObject(e.hostAddress & S2E_RAM_OBJECT_MASK);
+        e.concreteBuffer = 0;
+        if (op.first && op.second) {
+            e.concreteBuffer = (uint64_t) op.second->getConcreteStore();
+            if ((e.flags & EXECTRACE_MEM_WRITE) && m_debugObjectStates) {
+                assert(state->addressSpace.isOwnedByUs(op.second));
+            }
+        }
+    }
+
+    m_tracer->writeData(state, &e, sizeof(e), TRACE_MEMORY);
+}
+
+void MemoryTracer::traceDataMemoryAccess(S2EExecutionState *state,
+                               klee::ref<klee::Expr> &address,
+                               klee::ref<klee::Expr> &hostAddress,
+                               klee::ref<klee::Expr> &value,
+                               bool isWrite, bool isIO)
+{
+    if (isFiltered(state)) {
+        return;
+    }
 
     bool isAddrCste = isa<klee::ConstantExpr>(address);
     bool isValCste = isa<klee::ConstantExpr>(value);
@@ -153,20 +192,6 @@ void MemoryTracer::traceDataMemoryAccess(S2EExecutionState *state,
 
     e.hostAddress = isHostAddrCste ? cast<klee::ConstantExpr>(hostAddress)->getZExtValue(64) : 0xDEADBEEF;
 
-    if (m_traceHostAddresses) {
-        e.flags |= EXECTRACE_MEM_HASHOSTADDR;
-        e.flags |= EXECTRACE_MEM_OBJECTSTATE;
-
-        klee::ObjectPair op = state->addressSpace.findObject(e.hostAddress & S2E_RAM_OBJECT_MASK);
-        e.concreteBuffer = 0;
-        if (op.first && op.second) {
-            e.concreteBuffer = (uint64_t) op.second->getConcreteStore();
-            if (isWrite && m_debugObjectStates) {
-                assert(state->addressSpace.isOwnedByUs(op.second));
-            }
-        }
-    }
-
     if (!isAddrCste) {
        e.flags |= EXECTRACE_MEM_SYMBADDR;
     }
@@ -179,12 +204,26 @@ void MemoryTracer::traceDataMemoryAccess(S2EExecutionState *state,
        e.flags |= EXECTRACE_MEM_SYMBHOSTADDR;
     }
 
-    unsigned strucSize = sizeof(e);
-    if (!(e.flags & EXECTRACE_MEM_HASHOSTADDR) && !(e.flags & EXECTRACE_MEM_OBJECTSTATE)) {
-        strucSize -= (sizeof(e.hostAddress) + sizeof(e.concreteBuffer));
+    writeMemoryEntry(state, e);
+}
+
+//Returns false and stops monitoring memory when leaving the traced code.
+//Monitoring resumes at the start of the next traced block.
+bool MemoryTracer::isTracedCode(S2EExecutionState *state)
+{
+    //XXX: This is a hack.
+    //Sometimes the onModuleTransition is not fired properly...
+    if (m_execDetector && m_monitorModules && !m_execDetector->getCurrentDescriptor(state)) {
+        disconnectMemoryMonitor();
+        return false;
     }
 
-    m_tracer->writeData(state, &e, sizeof(e), TRACE_MEMORY);
+    if (m_filter->hasAddressFilter() && !m_filter->isTracedPc(state->getPc())) {
+        disconnectMemoryMonitor();
+        return false;
+    }
+
+    return true;
 }
 
 void MemoryTracer::onDataMemoryAccess(S2EExecutionState *state,
@@ -193,30 +232,106 @@ void MemoryTracer::onDataMemoryAccess(S2EExecutionState *state,
                                klee::ref<klee::Expr> value,
                                bool isWrite, bool isIO)
 {
-    //XXX: This is a hack.
-    //Sometimes the onModuleTransition is not fired properly...
-    if (m_execDetector && m_monitorModules && !m_execDetector->getCurrentDescriptor(state)) {
-        m_memoryMonitor.disconnect();
+    if (!isTracedCode(state) || !m_filter->sample(state)) {
         return;
     }
 
     traceDataMemoryAccess(state, address, hostAddress, value, isWrite, isIO);
 }
 
+void MemoryTracer::onConcreteDataMemoryAccess(S2EExecutionState *state,
+                                              uint64_t address,
+                                              uint64_t hostAddress,
+                                              uint64_t value, unsigned size,
+                                              unsigned flags)
+{
+    if (!isTracedCode(state) || !m_filter->sample(state)) {
+        return;
+    }
+
+    traceConcreteDataMemoryAccess(state, address, hostAddress, value, size, flags);
+}
+
+void MemoryTracer::traceConcreteDataMemoryAccess(S2EExecutionState *state,
+                                                 uint64_t address,
+                                                 uint64_t hostAddress,
+                                                 uint64_t value, unsigned size,
+                                                 unsigned flags)
+{
+    if (isFiltered(state)) {
+        return;
+    }
+
+    ExecutionTraceMemory e;
+    e.pc = state->getPc();
+    e.address = address;
+    e.value = value;
+    e.size = size;
+    e.flags = ((flags & MEMORY_ACCESS_WRITE) ? EXECTRACE_MEM_WRITE : 0) |
+              ((flags & MEMORY_ACCESS_IO) ? EXECTRACE_MEM_IO : 0);
+    e.hostAddress = hostAddress;
+
+    writeMemoryEntry(state, e);
+}
+
+void MemoryTracer::connectMemoryMonitor()
+{
+    disconnectMemoryMonitor();
+
+    m_memoryMonitor =
+        s2e()->getCorePlugin()->onConcreteDataMemoryAccess.connect(
+            sigc::mem_fun(*this, &MemoryTracer::onConcreteDataMemoryAccess)
+        );
+
+    m_symbolicMemoryMonitor =
+        s2e()->getCorePlugin()->onSymbolicDataMemoryAccess.connect(
+            sigc::mem_fun(*this, &MemoryTracer::onDataMemoryAccess)
+        );
+}
+
+void MemoryTracer::disconnectMemoryMonitor()
+{
+    m_memoryMonitor.disconnect();
+    m_symbolicMemoryMonitor.disconnect();
+}
+
 void MemoryTracer::onModuleTransition(S2EExecutionState *state,
                                        const ModuleDescriptor *prevModule,
                                        const ModuleDescriptor *nextModule)
 {
     if (nextModule && !m_memoryMonitor.connected()) {
-        m_memoryMonitor =
-            s2e()->getCorePlugin()->onDataMemoryAccess.connect(
-                sigc::mem_fun(*this, &MemoryTracer::onDataMemoryAccess)
-            );
+        connectMemoryMonitor();
     } else {
-        m_memoryMonitor.disconnect();
+        disconnectMemoryMonitor();
+    }
+}
+
+
+void MemoryTracer::onTranslateBlockStart(ExecutionSignal *signal,
+                                         S2EExecutionState *state,
+                                         TranslationBlock *tb,
+                                         uint64_t pc)
+{
+    if (m_filter->isTracedPc(pc)) {
+        signal->connect(sigc::mem_fun(*this, &MemoryTracer::onTracedBlockStart));
     }
 }
 
+void MemoryTracer::onModuleTranslateBlockStart(ExecutionSignal *signal,
+                                               S2EExecutionState *state,
+                                               const ModuleDescriptor &module,
+                                               TranslationBlock *tb,
+                                               uint64_t pc)
+{
+    onTranslateBlockStart(signal, state, tb, pc);
+}
+
+void MemoryTracer::onTracedBlockStart(S2EExecutionState *state, uint64_t pc)
+{
+    if (!m_memoryMonitor.connected()) {
+        connectMemoryMonitor();
+    }
+}
 
 void MemoryTracer::onTlbMiss(S2EExecutionState *state, uint64_t addr, bool is_write)
 {
@@ -242,16 +357,27 @@ void MemoryTracer::enableTracing()
 {
     if (m_monitorMemory) {
         s2e()->getMessagesStream() << "MemoryTracer Plugin: Enabling memory tracing" << '\n';
-        m_memoryMonitor.disconnect();
-
-        if (m_monitorModules) {
+        disconnectMemoryMonitor();
+        m_translateBlockMonitor.disconnect();
+
+        if (m_filter->hasAddressFilter()) {
+            //Untraced blocks get no instrumentation at all.
+            //Retranslate the blocks that were translated before.
+            tb_flush(env);
+            if (m_monitorModules) {
+                m_translateBlockMonitor = m_execDetector->onModuleTranslateBlockStart.connect(
+                        sigc::mem_fun(*this, &MemoryTracer::onModuleTranslateBlockStart));
+            } else {
+                m_translateBlockMonitor = s2e()->getCorePlugin()->onTranslateBlockStart.connect(
+                        sigc::mem_fun(*this, &MemoryTracer::onTranslateBlockStart));
+            }
+        } else if (m_monitorModules) {
             m_execDetector->onModuleTransition.connect(
                     sigc::mem_fun(*this,
                             &MemoryTracer::onModuleTransition)
                     );
         } else {
-            m_memoryMonitor = s2e()->getCorePlugin()->onDataMemoryAccess.connect(
-                    sigc::mem_fun(*this, &MemoryTracer::onDataMemoryAccess));
+            connectMemoryMonitor();
         }
     }
 
@@ -272,7 +398,8 @@ void MemoryTracer::enableTracing()
 
 void MemoryTracer::disableTracing()
 {
-    m_memoryMonitor.disconnect();
+    m_translateBlockMonitor.disconnect();
+    disconnectMemoryMonitor();
     m_pageFaultsMonitor.disconnect();
     m_tlbMissesMonitor.disconnect();
 }
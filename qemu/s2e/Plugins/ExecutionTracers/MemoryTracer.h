@@ -40,6 +40,7 @@
 #include <s2e/Plugins/Opcodes.h>
 #include <string>
 #include "ExecutionTracer.h"
+#include "TraceFilter.h"
 #include <s2e/Plugins/ModuleExecutionDetector.h>
 
 namespace s2e{
@@ -80,11 +81,14 @@ private:
     sigc::connection m_timerConnection;
 
     sigc::connection m_memoryMonitor;
+    sigc::connection m_symbolicMemoryMonitor;
     sigc::connection m_pageFaultsMonitor;
     sigc::connection m_tlbMissesMonitor;
+    sigc::connection m_translateBlockMonitor;
 
     ExecutionTracer *m_tracer;
     ModuleExecutionDetector *m_execDetector;
+    TraceFilter *m_filter;
 
     void onTlbMiss(S2EExecutionState *state, uint64_t addr, bool is_write);
     void onPageFault(S2EExecutionState *state, uint64_t addr, bool is_write);
@@ -101,9 +105,35 @@ private:
                                    klee::ref<klee::Expr> value,
                                    bool isWrite, bool isIO);
 
+    void onConcreteDataMemoryAccess(S2EExecutionState *state,
+                                    uint64_t address, uint64_t hostAddress,
+                                    uint64_t value, unsigned size,
+                                    unsigned flags);
+
+    void connectMemoryMonitor();
+    void disconnectMemoryMonitor();
+
+    bool isFiltered(S2EExecutionState *state) const;
+    void writeMemoryEntry(S2EExecutionState *state, ExecutionTraceMemory &e);
+
     void onModuleTransition(S2EExecutionState *state,
                             const ModuleDescriptor *prevModule,
                             const ModuleDescriptor *nextModule);
+
+    bool isTracedCode(S2EExecutionState *state);
+
+    void onTranslateBlockStart(ExecutionSignal *signal,
+                               S2EExecutionState *state,
+                               TranslationBlock *tb,
+                               uint64_t pc);
+
+    void onModuleTranslateBlockStart(ExecutionSignal *signal,
+                                     S2EExecutionState *state,
+                                     const ModuleDescriptor &module,
+                                     TranslationBlock *tb,
+                                     uint64_t pc);
+
+    void onTracedBlockStart(S2EExecutionState *state, uint64_t pc);
 public:
     //May be called directly by other plugins
     void traceDataMemoryAccess(S2EExecutionState *state,
@@ -111,6 +141,11 @@ public:
                                    klee::ref<klee::Expr> &hostAddress,
                                    klee::ref<klee::Expr> &value,
                                    bool isWrite, bool isIO);
+
+    void traceConcreteDataMemoryAccess(S2EExecutionState *state,
+                                       uint64_t address, uint64_t hostAddress,
+                                       uint64_t value, unsigned size,
+                                       unsigned flags);
 };
 
 
@@ -0,0 +1,396 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+#ifndef S2E_PLUGINS_TRACECOMPRESSION_H
+#define S2E_PLUGINS_TRACECOMPRESSION_H
+
+#include <inttypes.h>
+#include <string.h>
+#include <vector>
+
+#include "TraceEntries.h"
+
+namespace s2e {
+namespace plugins {
+
+/**
+ * Encoding of the items of a version 2 trace block.
+ *
+ * Each item is stored as
+ *   varint  zigzag(timeStamp - previous timeStamp)
+ *   uint8   type
+ *   varint  payload size
+ *   payload
+ * For item types whose payload starts with a program counter, these
+ * first 8 bytes are replaced by varint zigzag(pc - previous pc).
+ * The previous values are reset at the start of each block, so that
+ * blocks can be decoded independently.
+ */
+
+static inline bool traceItemHasPc(uint8_t type)
+{
+    switch (type) {
+        case TRACE_CALL:
+        case TRACE_RET:
+        case TRACE_TB_START:
+        case TRACE_TB_END:
+        case TRACE_FORK:
+        case TRACE_BRANCHCOV:
+        case TRACE_MEMORY:
+        case TRACE_PAGEFAULT:
+        case TRACE_TLBMISS:
+        case TRACE_EXCEPTION:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline void traceWriteVarint(std::vector<uint8_t> &out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back((uint8_t) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t) value);
+}
+
+static inline bool traceReadVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (p >= end) {
+            return false;
+        }
+        uint8_t b = *p++;
+        value |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint64_t traceZigZag(uint64_t delta)
+{
+    return (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63);
+}
+
+static inline uint64_t traceUnZigZag(uint64_t value)
+{
+    return (value >> 1) ^ (uint64_t) -(int64_t) (value & 1);
+}
+
+class TraceBlockEncoder
+{
+    std::vector<uint8_t> m_data;
+    uint64_t m_firstTimeStamp;
+    uint64_t m_lastTimeStamp;
+    uint64_t m_lastPc;
+    uint32_t m_itemCount;
+
+public:
+    TraceBlockEncoder() {
+        reset();
+    }
+
+    void reset() {
+        m_data.clear();
+        m_firstTimeStamp = 0;
+        m_lastTimeStamp = 0;
+        m_lastPc = 0;
+        m_itemCount = 0;
+    }
+
+    void append(uint64_t timeStamp, uint8_t type, const void *payload, uint32_t size) {
+        if (!m_itemCount) {
+            m_firstTimeStamp = m_lastTimeStamp = timeStamp;
+        }
+
+        traceWriteVarint(m_data, traceZigZag(timeStamp - m_lastTimeStamp));
+        m_data.push_back(type);
+        traceWriteVarint(m_data, size);
+
+        const uint8_t *bytes = (const uint8_t*) payload;
+        if (size >= sizeof(uint64_t) && traceItemHasPc(type)) {
+            uint64_t pc;
+            memcpy(&pc, bytes, sizeof(pc));
+            traceWriteVarint(m_data, traceZigZag(pc - m_lastPc));
+            m_lastPc = pc;
+            bytes += sizeof(pc);
+            size -= sizeof(pc);
+        }
+
+        m_data.insert(m_data.end(), bytes, bytes + size);
+
+        m_lastTimeStamp = timeStamp;
+        ++m_itemCount;
+    }
+
+    bool empty() const { return m_itemCount == 0; }
+    uint32_t getItemCount() const { return m_itemCount; }
+    uint64_t getTimeStamp() const { return m_firstTimeStamp; }
+    const std::vector<uint8_t> &getData() const { return m_data; }
+};
+
+/**
+ * Expands the raw (uncompressed) payload of a block into a sequence of
+ * version 1 items (ExecutionTraceItemHeader followed by the payload).
+ */
+static inline bool traceDecodeBlock(const ExecutionTraceBlockHeader &block,
+                                    const uint8_t *raw, std::vector<uint8_t> &out)
+{
+    const uint8_t *p = raw;
+    const uint8_t *end = raw + block.rawSize;
+    uint64_t timeStamp = block.timeStamp;
+    uint64_t lastPc = 0;
+
+    for (uint32_t i = 0; i < block.itemCount; ++i) {
+        uint64_t delta, size;
+        if (!traceReadVarint(p, end, delta) || p >= end) {
+            return false;
+        }
+        timeStamp += traceUnZigZag(delta);
+        uint8_t type = *p++;
+        if (!traceReadVarint(p, end, size)) {
+            return false;
+        }
+
+        ExecutionTraceItemHeader hdr;
+        hdr.timeStamp = timeStamp;
+        hdr.size = size;
+        hdr.type = type;
+        hdr.stateId = block.stateId;
+        hdr.pid = block.pid;
+
+        const uint8_t *h = (const uint8_t*) &hdr;
+        out.insert(out.end(), h, h + sizeof(hdr));
+
+        if (size >= sizeof(uint64_t) && traceItemHasPc(type)) {
+            uint64_t pcDelta;
+            if (!traceReadVarint(p, end, pcDelta)) {
+                return false;
+            }
+            lastPc += traceUnZigZag(pcDelta);
+            const uint8_t *pc = (const uint8_t*) &lastPc;
+            out.insert(out.end(), pc, pc + sizeof(lastPc));
+            size -= sizeof(lastPc);
+        }
+
+        if ((uint64_t) (end - p) < size) {
+            return false;
+        }
+        out.insert(out.end(), p, p + size);
+        p += size;
+    }
+
+    return p == end;
+}
+
+/**
+ * Minimal LZ4 block format codec. Blocks are small (tens of KB) and
+ * compressed once, so the compressor favors simplicity over ratio.
+ */
+
+static inline unsigned traceCompressBound(unsigned size)
+{
+    return size + size / 255 + 16;
+}
+
+static inline uint8_t *traceWriteLength(uint8_t *op, unsigned length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+static inline uint8_t *traceWriteSequence(uint8_t *op,
+                                          const uint8_t *literals, unsigned literalLength,
+                                          unsigned offset, unsigned matchLength, bool last)
+{
+    uint8_t *token = op++;
+    *token = (literalLength >= 15 ? 15 : literalLength) << 4;
+    if (literalLength >= 15) {
+        op = traceWriteLength(op, literalLength - 15);
+    }
+
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if (last) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    *token |= matchLength >= 15 ? 15 : matchLength;
+    if (matchLength >= 15) {
+        op = traceWriteLength(op, matchLength - 15);
+    }
+    return op;
+}
+
+/** Returns the compressed size, dst must hold traceCompressBound(size) bytes */
+static inline unsigned traceCompress(const uint8_t *src, unsigned size, uint8_t *dst)
+{
+    static const unsigned HashBits = 12;
+    static const unsigned MinMatch = 4;
+
+    uint32_t table[1 << HashBits];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + size;
+    uint8_t *op = dst;
+
+    //The format requires the last 5 bytes to be literals and
+    //the last match to start at least 12 bytes before the end.
+    if (size > 12) {
+        const uint8_t *matchLimit = end - 5;
+        const uint8_t *startLimit = end - 12;
+
+        while (ip < startLimit) {
+            uint32_t sequence;
+            memcpy(&sequence, ip, sizeof(sequence));
+            uint32_t h = (sequence * 2654435761U) >> (32 - HashBits);
+
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+
+            uint32_t refSequence;
+            memcpy(&refSequence, ref, sizeof(refSequence));
+            if (ref >= ip || ip - ref > 0xffff || refSequence != sequence) {
+                ++ip;
+                continue;
+            }
+
+            const uint8_t *mp = ip + MinMatch;
+            const uint8_t *rp = ref + MinMatch;
+            while (mp < matchLimit && *mp == *rp) {
+                ++mp;
+                ++rp;
+            }
+
+            op = traceWriteSequence(op, anchor, ip - anchor, ip - ref,
+                                    mp - ip - MinMatch, false);
+            ip = anchor = mp;
+        }
+    }
+
+    op = traceWriteSequence(op, anchor, end - anchor, 0, 0, true);
+    return op - dst;
+}
+
+/** Returns false if the input is corrupted or does not expand to exactly size bytes */
+static inline bool traceDecompress(const uint8_t *src, unsigned srcSize,
+                                   uint8_t *dst, unsigned size)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + srcSize;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + size;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        unsigned length = token >> 4;
+        if (length == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return false;
+                }
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+
+        if ((unsigned) (iend - ip) < length || (unsigned) (oend - op) < length) {
+            return false;
+        }
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        unsigned offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (unsigned) (op - dst)) {
+            return false;
+        }
+
+        length = token & 15;
+        if (length == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return false;
+                }
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+        length += 4;
+
+        if ((unsigned) (oend - op) < length) {
+            return false;
+        }
+
+        //Matches may overlap the output, copy byte by byte
+        const uint8_t *match = op - offset;
+        for (unsigned i = 0; i < length; ++i) {
+            op[i] = match[i];
+        }
+        op += length;
+    }
+
+    return op == oend;
+}
+
+}
+}
+
+#endif
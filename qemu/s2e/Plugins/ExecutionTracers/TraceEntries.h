@@ -86,6 +86,48 @@ struct ExecutionTraceItemHeader{
     //uint8_t  payload[];
 }__attribute__((packed));
 
+/**
+ * Version 2 trace files start with an ExecutionTraceFileHeader followed
+ * by blocks of items. All the items of a block belong to the same state.
+ * The payload of a block is a sequence of encoded items (see
+ * TraceCompression.h), optionally LZ4-compressed. When the trace was
+ * closed properly, an index of all the blocks and an
+ * ExecutionTraceFileFooter terminate the file.
+ */
+#define TRACE_FILE_MAGIC "S2ETRv2"
+#define TRACE_FILE_VERSION 2
+#define TRACE_BLOCK_MAGIC 0x4b4c4254 /* TBLK */
+#define TRACE_INDEX_MAGIC 0x58444e49 /* INDX */
+
+struct ExecutionTraceFileHeader {
+    char magic[8];
+    uint32_t version;
+}__attribute__((packed));
+
+struct ExecutionTraceBlockHeader {
+    uint32_t magic;
+    uint32_t stateId;
+    uint64_t pid;
+    //Time stamp of the first item, the others are delta-encoded
+    uint64_t timeStamp;
+    uint32_t itemCount;
+    uint32_t rawSize;
+    //Equals rawSize when the block is stored uncompressed
+    uint32_t compressedSize;
+}__attribute__((packed));
+
+struct ExecutionTraceIndexEntry {
+    uint64_t offset;
+    uint32_t stateId;
+    uint32_t itemCount;
+}__attribute__((packed));
+
+struct ExecutionTraceFileFooter {
+    uint64_t indexOffset;
+    uint32_t blockCount;
+    uint32_t magic;
+}__attribute__((packed));
+
 struct ExecutionTraceModuleLoad {
     char name[32];
     uint64_t loadBase;
@@ -0,0 +1,161 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+#include "TraceFilter.h"
+
+#include <s2e/S2E.h>
+#include <s2e/ConfigFile.h>
+#include <s2e/Utils.h>
+#include <s2e/S2EExecutionState.h>
+#include <s2e/Plugins/CorePlugin.h>
+
+#include <algorithm>
+#include <sstream>
+
+namespace s2e {
+namespace plugins {
+
+TraceFilter::TraceFilter(S2E *s2e, const std::string &key)
+{
+    ConfigFile *cfg = s2e->getConfig();
+    bool ok;
+
+    int count = cfg->getListSize(key + ".pcRanges", &ok);
+    for (int i = 0; ok && i < count; ++i) {
+        std::stringstream ss;
+        ss << key << ".pcRanges[" << (i + 1) << "]";
+        ConfigFile::integer_list range = cfg->getIntegerList(ss.str());
+        if (range.size() != 2 || range[0] >= range[1]) {
+            s2e->getWarningsStream() << ss.str() << " must be of {start, end} format" << '\n';
+            exit(-1);
+        }
+        m_ranges.push_back(Range(range[0], range[1]));
+    }
+
+    //Merge the ranges so that lookups are a single binary search
+    std::sort(m_ranges.begin(), m_ranges.end());
+    std::vector<Range> merged;
+    foreach2(it, m_ranges.begin(), m_ranges.end()) {
+        if (!merged.empty() && it->first <= merged.back().second) {
+            merged.back().second = std::max(merged.back().second, it->second);
+        } else {
+            merged.push_back(*it);
+        }
+    }
+    m_ranges.swap(merged);
+
+    m_pids = cfg->getIntegerList(key + ".pids");
+    std::sort(m_pids.begin(), m_pids.end());
+
+    m_sampleEvery = cfg->getInt(key + ".sampleEvery", 1);
+    m_sampleCounter = 0;
+
+    m_burstLength = cfg->getInt(key + ".burstLength", 0);
+    m_burstPeriod = cfg->getInt(key + ".burstPeriod", 0);
+    m_ticks = 0;
+    m_inBurst = true;
+
+    m_stateBudget = cfg->getInt(key + ".stateBudget", 0);
+
+    m_sampling = !m_pids.empty() || m_sampleEvery > 1 || m_stateBudget ||
+                 (m_burstLength && m_burstPeriod > m_burstLength);
+
+    if (m_burstLength && m_burstPeriod > m_burstLength) {
+        s2e->getCorePlugin()->onTimer.connect(
+                sigc::mem_fun(*this, &TraceFilter::onTimer));
+    }
+
+    if (m_stateBudget) {
+        s2e->getCorePlugin()->onStateKill.connect(
+                sigc::mem_fun(*this, &TraceFilter::onStateKill));
+    }
+}
+
+bool TraceFilter::isTracedPc(uint64_t pc) const
+{
+    if (m_ranges.empty()) {
+        return true;
+    }
+
+    //First range that starts after pc
+    std::vector<Range>::const_iterator it =
+            std::upper_bound(m_ranges.begin(), m_ranges.end(), Range(pc, (uint64_t) -1));
+    if (it == m_ranges.begin()) {
+        return false;
+    }
+    --it;
+    return pc < it->second;
+}
+
+bool TraceFilter::sampleSlow(S2EExecutionState *state)
+{
+    if (!m_inBurst) {
+        return false;
+    }
+
+    if (!m_pids.empty() &&
+        !std::binary_search(m_pids.begin(), m_pids.end(), state->getPid())) {
+        return false;
+    }
+
+    if (m_sampleEvery > 1 && (m_sampleCounter++ % m_sampleEvery)) {
+        return false;
+    }
+
+    if (m_stateBudget) {
+        uint64_t &events = m_stateEvents[state->getID()];
+        if (events >= m_stateBudget) {
+            return false;
+        }
+        ++events;
+    }
+
+    return true;
+}
+
+//Called every second
+void TraceFilter::onTimer()
+{
+    m_ticks = (m_ticks + 1) % m_burstPeriod;
+    m_inBurst = m_ticks < m_burstLength;
+}
+
+void TraceFilter::onStateKill(S2EExecutionState *state)
+{
+    m_stateEvents.erase(state->getID());
+}
+
+} // namespace plugins
+} // namespace s2e
@@ -0,0 +1,122 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+#ifndef S2E_PLUGINS_TRACEFILTER_H
+#define S2E_PLUGINS_TRACEFILTER_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+
+#include <s2e/Signals/Signals.h>
+
+namespace s2e {
+
+class S2E;
+class S2EExecutionState;
+
+namespace plugins {
+
+/**
+ * Sampling and filtering of trace events, shared by the tracers.
+ *
+ * Configuration (under the key of the plugin that owns the filter):
+ *   pcRanges    = { {start, end}, ... }  only trace code in [start, end)
+ *   pids        = { pid, ... }           only trace these address spaces
+ *   sampleEvery = N                      trace one event out of N
+ *   burstLength = S, burstPeriod = P     trace during the first S seconds
+ *                                        of every P seconds
+ *   stateBudget = N                      maximum number of events per state
+ *
+ * The address ranges are meant to be checked at translation time,
+ * so that blocks outside of them are not instrumented at all.
+ * The other criteria depend on the execution and are checked by sample().
+ */
+class TraceFilter : public sigc::trackable
+{
+public:
+    typedef std::pair<uint64_t, uint64_t> Range;
+
+private:
+    //Sorted, non-overlapping ranges
+    std::vector<Range> m_ranges;
+    std::vector<uint64_t> m_pids;
+
+    uint64_t m_sampleEvery;
+    uint64_t m_sampleCounter;
+
+    unsigned m_burstLength;
+    unsigned m_burstPeriod;
+    unsigned m_ticks;
+    bool m_inBurst;
+
+    uint64_t m_stateBudget;
+    std::tr1::unordered_map<int, uint64_t> m_stateEvents;
+
+    bool m_sampling;
+
+    void onTimer();
+    void onStateKill(S2EExecutionState *state);
+
+public:
+    TraceFilter(S2E *s2e, const std::string &key);
+
+    bool hasAddressFilter() const {
+        return !m_ranges.empty();
+    }
+
+    //Translation-time check
+    bool isTracedPc(uint64_t pc) const;
+
+    /**
+     * Execution-time check, called once per candidate event.
+     * Returns false if the event must not be traced.
+     */
+    bool sample(S2EExecutionState *state) {
+        if (!m_sampling) {
+            return true;
+        }
+        return sampleSlow(state);
+    }
+
+private:
+    bool sampleSlow(S2EExecutionState *state);
+};
+
+} // namespace plugins
+} // namespace s2e
+
+#endif
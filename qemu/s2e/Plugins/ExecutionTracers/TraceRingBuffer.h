@@ -0,0 +1,169 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+#ifndef S2E_PLUGINS_TRACERINGBUFFER_H
+#define S2E_PLUGINS_TRACERINGBUFFER_H
+
+#include <inttypes.h>
+#include <string.h>
+#include <vector>
+
+namespace s2e {
+namespace plugins {
+
+/**
+ * Single-producer single-consumer queue of variable-size records.
+ *
+ * The emulation thread pushes records, the trace writer thread pops
+ * them. Neither side takes a lock: the producer only advances m_head,
+ * the consumer only advances m_tail. Each record is stored as a 32-bit
+ * size followed by the payload and may wrap around the end of the buffer.
+ */
+class TraceRingBuffer
+{
+    uint8_t *m_buffer;
+    uint64_t m_mask;
+
+    //Total number of bytes ever pushed and popped
+    volatile uint64_t m_head;
+    volatile uint64_t m_tail;
+
+    void copyIn(uint64_t pos, const void *data, unsigned size) {
+        uint64_t offset = pos & m_mask;
+        uint64_t first = m_mask + 1 - offset;
+        if (first >= size) {
+            memcpy(m_buffer + offset, data, size);
+        } else {
+            memcpy(m_buffer + offset, data, first);
+            memcpy(m_buffer, (const uint8_t*) data + first, size - first);
+        }
+    }
+
+    void copyOut(uint64_t pos, void *data, unsigned size) const {
+        uint64_t offset = pos & m_mask;
+        uint64_t first = m_mask + 1 - offset;
+        if (first >= size) {
+            memcpy(data, m_buffer + offset, size);
+        } else {
+            memcpy(data, m_buffer + offset, first);
+            memcpy((uint8_t*) data + first, m_buffer, size - first);
+        }
+    }
+
+public:
+    //The capacity is rounded up to a power of two
+    TraceRingBuffer(uint64_t capacity) : m_head(0), m_tail(0) {
+        uint64_t size = 4096;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        m_buffer = new uint8_t[size];
+        m_mask = size - 1;
+    }
+
+    ~TraceRingBuffer() {
+        delete [] m_buffer;
+    }
+
+    uint64_t getCapacity() const {
+        return m_mask + 1;
+    }
+
+    bool empty() const {
+        return m_head == m_tail;
+    }
+
+    //Drops all the records. Neither side may be running.
+    void clear() {
+        m_head = m_tail = 0;
+    }
+
+    //Whether a record with the given payload size can ever fit
+    bool fits(unsigned size) const {
+        return size + sizeof(uint32_t) <= getCapacity();
+    }
+
+    /**
+     * Appends a record made of the concatenation of the two buffers.
+     * Returns false without blocking if there is not enough room.
+     */
+    bool push(const void *header, unsigned headerSize,
+              const void *data, unsigned dataSize) {
+        uint32_t size = headerSize + dataSize;
+        uint64_t head = m_head;
+        uint64_t tail = m_tail;
+
+        if (head + sizeof(size) + size - tail > getCapacity()) {
+            return false;
+        }
+
+        copyIn(head, &size, sizeof(size));
+        copyIn(head + sizeof(size), header, headerSize);
+        copyIn(head + sizeof(size) + headerSize, data, dataSize);
+
+        //The record must be visible before the new head
+        __sync_synchronize();
+        m_head = head + sizeof(size) + size;
+        return true;
+    }
+
+    /** Pops the oldest record into out. Returns false if the buffer is empty. */
+    bool pop(std::vector<uint8_t> &out) {
+        uint64_t tail = m_tail;
+        if (m_head == tail) {
+            return false;
+        }
+
+        //Do not read the record before having seen the head
+        __sync_synchronize();
+
+        uint32_t size;
+        copyOut(tail, &size, sizeof(size));
+        out.resize(size);
+        if (size) {
+            copyOut(tail + sizeof(size), &out[0], size);
+        }
+
+        //The record must be consumed before the space is released
+        __sync_synchronize();
+        m_tail = tail + sizeof(size) + size;
+        return true;
+    }
+};
+
+} // namespace plugins
+} // namespace s2e
+
+#endif
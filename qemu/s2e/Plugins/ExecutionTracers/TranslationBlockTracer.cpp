@@ -69,6 +69,10 @@ void TranslationBlockTracer::initialize()
     //The default behavior is ON, because otherwise it may produce confising results.
     m_flushTbOnChange = s2e()->getConfig()->getBool(getConfigKey() + ".flushTbCache", true);
 
+    //Blocks outside of the configured ranges are not instrumented
+    m_filter = new TraceFilter(s2e(), getConfigKey());
+    m_blockSampled = false;
+
     if (manualTrigger) {
         s2e()->getCorePlugin()->onCustomInstruction.connect(
                 sigc::mem_fun(*this, &TranslationBlockTracer::onCustomInstruction));
@@ -110,6 +114,10 @@ void TranslationBlockTracer::onModuleTranslateBlockStart(
         TranslationBlock *tb,
         uint64_t pc)
 {
+    if (!m_filter->isTracedPc(pc)) {
+        return;
+    }
+
     signal->connect(
         sigc::mem_fun(*this, &TranslationBlockTracer::onExecuteBlockStart)
     );
@@ -124,6 +132,10 @@ void TranslationBlockTracer::onModuleTranslateBlockEnd(
         bool staticTarget,
         uint64_t targetPc)
 {
+    if (!m_filter->isTracedPc(tb->pc)) {
+        return;
+    }
+
     signal->connect(
         sigc::mem_fun(*this, &TranslationBlockTracer::onExecuteBlockEnd)
     );
@@ -169,12 +181,17 @@ void TranslationBlockTracer::trace(S2EExecutionState *state, uint64_t pc, ExecTr
 
 void TranslationBlockTracer::onExecuteBlockStart(S2EExecutionState *state, uint64_t pc)
 {
-    trace(state, pc, TRACE_TB_START);
+    m_blockSampled = m_filter->sample(state);
+    if (m_blockSampled) {
+        trace(state, pc, TRACE_TB_START);
+    }
 }
 
 void TranslationBlockTracer::onExecuteBlockEnd(S2EExecutionState *state, uint64_t pc)
 {
-    trace(state, pc, TRACE_TB_END);
+    if (m_blockSampled) {
+        trace(state, pc, TRACE_TB_END);
+    }
 }
 
 void TranslationBlockTracer::onCustomInstruction(S2EExecutionState* state, uint64_t opcode)
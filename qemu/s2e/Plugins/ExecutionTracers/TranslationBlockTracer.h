@@ -42,6 +42,7 @@
 
 #include "ExecutionTracer.h"
 #include "TraceEntries.h"
+#include "TraceFilter.h"
 #include <s2e/Plugins/ModuleExecutionDetector.h>
 
 namespace s2e {
@@ -65,6 +66,11 @@ public:
 private:
     ExecutionTracer *m_tracer;
     ModuleExecutionDetector *m_detector;
+    TraceFilter *m_filter;
+
+    //Whether the start of the current block was sampled,
+    //so that the end is traced consistently
+    bool m_blockSampled;
 
     sigc::connection m_tbStartConnection;
     sigc::connection m_tbEndConnection;
@@ -196,17 +196,34 @@ void MemoryChecker::initialize()
 }
 
 
+void MemoryChecker::connectDataMemoryAccess()
+{
+    m_dataMemoryAccessConnection =
+        s2e()->getCorePlugin()->onConcreteDataMemoryAccess.connect(
+            sigc::mem_fun(*this, &MemoryChecker::onConcreteDataMemoryAccess)
+        );
+
+    m_symbolicDataMemoryAccessConnection =
+        s2e()->getCorePlugin()->onSymbolicDataMemoryAccess.connect(
+            sigc::mem_fun(*this, &MemoryChecker::onDataMemoryAccess)
+        );
+}
+
+void MemoryChecker::disconnectDataMemoryAccess()
+{
+    m_dataMemoryAccessConnection.disconnect();
+    m_symbolicDataMemoryAccessConnection.disconnect();
+}
+
 void MemoryChecker::onModuleTransition(S2EExecutionState *state,
                                        const ModuleDescriptor *prevModule,
                                        const ModuleDescriptor *nextModule)
 {
     if(nextModule) {
-        m_dataMemoryAccessConnection =
-            s2e()->getCorePlugin()->onDataMemoryAccess.connect(
-                sigc::mem_fun(*this, &MemoryChecker::onDataMemoryAccess)
-            );
+        disconnectDataMemoryAccess();
+        connectDataMemoryAccess();
     } else {
-        m_dataMemoryAccessConnection.disconnect();
+        disconnectDataMemoryAccess();
     }
 }
 
@@ -217,13 +234,10 @@ void MemoryChecker::onStateSwitch(S2EExecutionState *currentState,
     const ModuleDescriptor *nextModule =
             m_moduleDetector->getModule(nextState, nextState->getPc());
 
-    m_dataMemoryAccessConnection.disconnect();
+    disconnectDataMemoryAccess();
 
     if(nextModule) {
-        m_dataMemoryAccessConnection =
-            s2e()->getCorePlugin()->onDataMemoryAccess.connect(
-                sigc::mem_fun(*this, &MemoryChecker::onDataMemoryAccess)
-            );
+        connectDataMemoryAccess();
     }
 }
 
@@ -231,7 +245,7 @@ void MemoryChecker::onException(S2EExecutionState *state, unsigned intNb, uint64
 {
     //Reconnection will be done automatically upon next
     //module transition signal.
-    m_dataMemoryAccessConnection.disconnect();
+    disconnectDataMemoryAccess();
 }
 
 void MemoryChecker::onDataMemoryAccess(S2EExecutionState *state,
@@ -255,7 +269,7 @@ void MemoryChecker::onDataMemoryAccess(S2EExecutionState *state,
     //XXX: This is a hack.
     //Sometimes the onModuleTransition is not fired properly...
     if (!m_moduleDetector->getCurrentDescriptor(state)) {
-        m_dataMemoryAccessConnection.disconnect();
+        disconnectDataMemoryAccess();
         return;
     }
 
@@ -266,6 +280,38 @@ void MemoryChecker::onDataMemoryAccess(S2EExecutionState *state,
     uint64_t start = cast<klee::ConstantExpr>(virtualAddress)->getZExtValue();
     unsigned accessSize = klee::Expr::getMinBytesForWidth(value->getWidth());
 
+    checkDataMemoryAccess(state, start, accessSize, isWrite);
+}
+
+void MemoryChecker::onConcreteDataMemoryAccess(S2EExecutionState *state,
+                                               uint64_t virtualAddress,
+                                               uint64_t hostAddress,
+                                               uint64_t value, unsigned size,
+                                               unsigned flags)
+{
+    if (state->isRunningExceptionEmulationCode()) {
+        return;
+    }
+
+    if (!m_moduleDetector->getCurrentDescriptor(state)) {
+        disconnectDataMemoryAccess();
+        return;
+    }
+
+    if (m_traceMemoryAccesses) {
+        m_memoryTracer->traceConcreteDataMemoryAccess(state, virtualAddress,
+                                                      hostAddress, value,
+                                                      size, flags);
+    }
+
+    checkDataMemoryAccess(state, virtualAddress, size,
+                          flags & MEMORY_ACCESS_WRITE);
+}
+
+void MemoryChecker::checkDataMemoryAccess(S2EExecutionState *state,
+                                          uint64_t start, unsigned accessSize,
+                                          bool isWrite)
+{
     onPreCheck.emit(state, start, accessSize, isWrite);
 
     std::string errstr;
@@ -73,6 +73,10 @@ class MemoryChecker : public Plugin
     bool m_traceMemoryAccesses;
 
     sigc::connection m_dataMemoryAccessConnection;
+    sigc::connection m_symbolicDataMemoryAccessConnection;
+
+    void connectDataMemoryAccess();
+    void disconnectDataMemoryAccess();
 
     void onException(S2EExecutionState *state, unsigned intNb, uint64_t pc);
 
@@ -86,6 +90,13 @@ class MemoryChecker : public Plugin
                  klee::ref<klee::Expr> value,
                  bool isWrite, bool isIO);
 
+    void onConcreteDataMemoryAccess(S2EExecutionState *state,
+                 uint64_t virtualAddress, uint64_t hostAddress,
+                 uint64_t value, unsigned size, unsigned flags);
+
+    void checkDataMemoryAccess(S2EExecutionState *state, uint64_t start,
+                               unsigned accessSize, bool isWrite);
+
     void onStateSwitch(S2EExecutionState *currentState,
                                       S2EExecutionState *nextState);
 
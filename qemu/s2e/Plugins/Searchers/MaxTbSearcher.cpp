@@ -309,7 +309,7 @@ klee::ExecutionState& MaxTbSearcher::selectState()
 
     if (m_states.size() > 0) {
         S2EExecutionState *es = dynamic_cast<S2EExecutionState*>(*m_states.begin());
-        DECLARE_PLUGINSTATE(MaxTbSearcherState, es);
+        DECLARE_PLUGINSTATE_CONST(MaxTbSearcherState, es);
         if (plgState->m_metric < 2) {
             return *es;
         }
@@ -336,6 +336,7 @@ bool MaxTbSearcher::updatePc(S2EExecutionState *es)
         return false;
     }
 
+    m_states.erase(es);
     DECLARE_PLUGINSTATE(MaxTbSearcherState, es);
 
     //If not covered, add the forked state to the wait list
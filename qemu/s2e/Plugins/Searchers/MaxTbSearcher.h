@@ -72,6 +72,9 @@ class MaxTbSearcher : public Plugin, public klee::Searcher
 {
     S2E_PLUGIN
 public:
+    /** Orders the states by metric. A state must be removed from the
+        set before its plugin state is accessed for writing: this may
+        replace a shared plugin state or change the metric. */
     struct MaxTbSorter{
         Plugin *p;
 
@@ -80,11 +83,13 @@ public:
         }
 
         bool operator()(const S2EExecutionState *s1, const S2EExecutionState *s2) const{
-            const MaxTbSearcherState *p1 = static_cast<MaxTbSearcherState*>(p->getPluginState(const_cast<S2EExecutionState*>(s1), &MaxTbSearcherState::factory));
-            const MaxTbSearcherState *p2 = static_cast<MaxTbSearcherState*>(p->getPluginState(const_cast<S2EExecutionState*>(s2), &MaxTbSearcherState::factory));
+            const MaxTbSearcherState *p1 = static_cast<MaxTbSearcherState*>(p->getPluginState(const_cast<S2EExecutionState*>(s1), &MaxTbSearcherState::factory, false));
+            const MaxTbSearcherState *p2 = static_cast<MaxTbSearcherState*>(p->getPluginState(const_cast<S2EExecutionState*>(s2), &MaxTbSearcherState::factory, false));
 
+            //Forked states may share the same plugin state until one
+            //of them writes to it, break ties with the state itself
             if (p1->m_metric == p2->m_metric) {
-                return p1 < p2;
+                return s1->getID() < s2->getID();
             }
             return p1->m_metric < p2->m_metric;
         }
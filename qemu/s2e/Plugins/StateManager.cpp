@@ -47,10 +47,6 @@ extern "C" {
 #include "StateManager.h"
 #include <klee/Searcher.h>
 
-#ifdef CONFIG_WIN32
-#include <windows.h>
-#endif
-
 namespace s2e {
 namespace plugins {
 
@@ -106,34 +102,42 @@ void StateManager::suspendCurrentProcess()
 {
     s2e()->getDebugStream() << "Suspending process" << '\n';
     unsigned currentProcessId = s2e()->getCurrentProcessId();
+    S2EProcessEvent &wakeup = s2e()->getProcessEvent();
 
     StateManagerShared *shared = m_shared.acquire();
     shared->suspendedProcesses[currentProcessId] = true;
     m_shared.release();
 
     while(true) {
-        shared = m_shared.tryAcquire();
-        if (shared) {
-            //Somebody woke us up
-            if (!shared->suspendedProcesses[currentProcessId]) {
-                m_shared.release();
-                return;
-            }
+        //Read before checking, signals sent after this point are not lost
+        uint32_t sequence = wakeup.getSequence();
 
-            //There are no more active processes in the system,
-            if (getSuspendedProcessCount() == s2e()->getCurrentProcessCount()) {
-                resumeAllProcesses();
-                killAllButOneSuccessful();
-                m_shared.release();
-                return;
-            }
+        shared = m_shared.acquire();
+
+        //Somebody woke us up
+        if (!shared->suspendedProcesses[currentProcessId]) {
             m_shared.release();
+            return;
         }
-        #ifdef CONFIG_WIN32
-        Sleep(1000);
-        #else
-        sleep(1);
-        #endif
+
+        //A command is pending, the caller processes it
+        if (shared->commands[currentProcessId].read().command != StateManagerShared::EMPTY) {
+            shared->suspendedProcesses[currentProcessId] = false;
+            m_shared.release();
+            return;
+        }
+
+        //There are no more active processes in the system,
+        if (getSuspendedProcessCount() == s2e()->getCurrentProcessCount()) {
+            resumeAllProcesses();
+            killAllButOneSuccessful();
+            m_shared.release();
+            return;
+        }
+        m_shared.release();
+
+        //Resumes, commands and exiting processes signal the event
+        wakeup.wait(sequence);
     }
 }
 
@@ -146,6 +150,9 @@ void StateManager::resumeAllProcesses()
     for (unsigned i=0; i<maxProcessCount; ++i) {
         shared->suspendedProcesses[i] = false;
     }
+
+    //Suspended processes check again whether they must resume
+    s2e()->signalOtherProcesses();
 }
 
 
@@ -197,6 +204,7 @@ void StateManager::sendKillToAllInstances(bool keepOneSuccessful, unsigned procI
         if (i != s2e()->getCurrentProcessId()) {
             cmd.nodeId = keepOneSuccessful ? procId : (uint8_t)-1;
             s->commands[i].write(cmd);
+            s2e()->signalProcess(i);
         }
     }
 }
@@ -52,6 +52,8 @@ extern CPUArchState *env;
 #include <s2e/Utils.h>
 #include <s2e/S2EExecutor.h>
 #include <s2e/S2EExecutionState.h>
+#include <s2e/Slab.h>
+#include <s2e/LoadBalancing.h>
 
 #include <s2e/s2e_qemu.h>
 #include <llvm/Support/FileSystem.h>
@@ -307,6 +309,8 @@ void s2e_unload_all_bundle(){
 }
 #endif //CONFIG_WIN32
 
+extern llvm::cl::opt<bool> UseSlabAllocator;
+
 namespace s2e {
 
 using namespace std;
@@ -408,6 +412,9 @@ S2E::S2E(int argc, char** argv, TCGLLVMContext *tcgLLVMContext,
     /* Initialize KLEE command line options */
     initKleeOptions();
 
+    /* Must precede the creation of any KLEE memory object */
+    initObjectAllocator();
+
     /* Initialize S2EExecutor */
     initExecutor();
 
@@ -431,8 +438,31 @@ void S2E::writeBitCodeToFile()
     llvm::WriteBitcodeToFile(module, o);
 }
 
+void S2E::writePluginStateStats()
+{
+    const PluginStateStatsMap &stats = S2EExecutionState::getPluginStateStats();
+    if (stats.empty()) {
+        return;
+    }
+
+    llvm::raw_ostream *out = openOutputFile("pluginstates.stats");
+    *out << "Plugin,Shares,Clones,CloneTime,CloneBytes\n";
+    foreach2(it, stats.begin(), stats.end()) {
+        const S2EPluginStateStats &s = (*it).second;
+        *out << (*it).first->getPluginInfo()->name
+             << "," << s.shares
+             << "," << s.clones
+             << "," << s.cloneTime / 1000000.
+             << "," << s.cloneBytes << '\n';
+    }
+    delete out;
+}
+
 S2E::~S2E()
 {
+    //Must run while the plugins still exist
+    writePluginStateStats();
+
     //Delete all the stuff used by the instance
     foreach(Plugin* p, m_activePluginsList)
         delete p;
@@ -443,10 +473,14 @@ S2E::~S2E()
     assert(shared->processIds[m_currentProcessId] == m_currentProcessIndex);
     shared->processIds[m_currentProcessId] = (unsigned) -1;
     shared->processPids[m_currentProcessId] = (unsigned) -1;
+    shared->stateCounts[m_currentProcessId] = 0;
     --shared->currentProcessCount;
 
     m_sync.release();
 
+    //The remaining instances may all be waiting for each other now
+    signalOtherProcesses();
+
     delete m_pluginsFactory;
     writeBitCodeToFile();
 
@@ -771,6 +805,15 @@ void S2E::initPlugins()
     m_plugininied = true;
 }
 
+void S2E::initObjectAllocator()
+{
+    m_objectAllocator = NULL;
+    if (UseSlabAllocator) {
+        m_objectAllocator = new SlabObjectAllocator();
+        klee::ObjectAllocator::set(m_objectAllocator);
+    }
+}
+
 void S2E::initExecutor()
 {
     m_s2eHandler = new S2EHandler(this);
@@ -856,6 +899,7 @@ int S2E::fork()
             if (shared->processIds[i] == (unsigned)-1) {
                 shared->processIds[i] = newProcessIndex;
                 shared->processPids[i] = getpid();
+                shared->stateCounts[i] = 0;
                 m_currentProcessId = i;
                 break;
             }
@@ -923,6 +967,38 @@ unsigned S2E::getCurrentProcessCount()
     return ret;
 }
 
+void S2E::setCurrentStateCount(unsigned count)
+{
+    S2EShared *shared = m_sync.acquire();
+    shared->stateCounts[m_currentProcessId] = count;
+    m_sync.release();
+}
+
+void S2E::requestWork()
+{
+    S2EShared *shared = m_sync.acquire();
+    shared->stateCounts[m_currentProcessId] = 0;
+    ++shared->pendingWorkRequests;
+    m_sync.release();
+}
+
+bool S2E::shouldDonateStates(unsigned minStates)
+{
+    S2EShared *shared = m_sync.acquire();
+
+    bool requested = shared->pendingWorkRequests > 0;
+    bool ret = s2e::shouldDonateStates(shared->stateCounts, shared->processIds,
+                                       m_maxProcesses, shared->currentProcessCount,
+                                       m_currentProcessId, requested, minStates);
+
+    if (ret && requested) {
+        --shared->pendingWorkRequests;
+    }
+
+    m_sync.release();
+    return ret;
+}
+
 unsigned S2E::getProcessIndexForId(unsigned id)
 {
     assert(id < m_maxProcesses);
@@ -944,20 +1020,35 @@ bool S2E::checkDeadProcesses()
         //Check if pid is alive
         char buffer[64];
         snprintf(buffer, sizeof(buffer), "kill -0 %d", shared->processPids[i]);
-        int ret = system(buffer);
-        if (ret != 0) {
+        int status = system(buffer);
+        if (status != 0) {
             //Process is dead, we have to decrement everything
             shared->processIds[i] = (unsigned) -1;
             shared->processPids[i] = (unsigned) -1;
+            shared->stateCounts[i] = 0;
             --shared->currentProcessCount;
             ret = true;
         }
     }
 
     m_sync.release();
+
+    if (ret) {
+        signalOtherProcesses();
+    }
     return ret;
 }
 
+void S2E::signalOtherProcesses()
+{
+    S2EShared *shared = m_sync.get();
+    for (unsigned i=0; i<m_maxProcesses; ++i) {
+        if (i != m_currentProcessId) {
+            shared->processEvents[i].signal();
+        }
+    }
+}
+
 } // namespace s2e
 
 /******************************/
@@ -68,6 +68,7 @@ class PluginsFactory;
 class S2EHandler;
 class S2EExecutor;
 class S2EExecutionState;
+class SlabObjectAllocator;
 
 class Database;
 
@@ -85,11 +86,26 @@ struct S2EShared {
     //the instance index.
     unsigned processIds[S2E_MAX_PROCESSES];
     unsigned processPids[S2E_MAX_PROCESSES];
+
+    //Number of states held by each running instance, indexed like
+    //processIds. Used to pick the instance that hands off work.
+    unsigned stateCounts[S2E_MAX_PROCESSES];
+
+    //Number of instances that ran out of states since the last
+    //hand-off.
+    unsigned pendingWorkRequests;
+
+    //Signaled to make a waiting instance check its condition again,
+    //indexed like processIds
+    S2EProcessEvent processEvents[S2E_MAX_PROCESSES];
+
     S2EShared() {
         for (unsigned i=0; i<S2E_MAX_PROCESSES; ++i)    {
             processIds[i] = (unsigned)-1;
             processPids[i] = (unsigned)-1;
+            stateCounts[i] = 0;
         }
+        pendingWorkRequests = 0;
     }
 };
 
@@ -146,6 +162,10 @@ protected:
     S2EHandler* m_s2eHandler;
     S2EExecutor* m_s2eExecutor;
 
+    /* Serves KLEE's memory objects and object states. Never deleted,
+       KLEE objects may be freed after this instance is gone. */
+    SlabObjectAllocator* m_objectAllocator;
+
     /* Indicates that forking is in progress.
        Queried by QEMU in order to avoid unnecessary resource initializations.
        Such resources are inherited from the parent process. */
@@ -155,6 +175,7 @@ protected:
     void initOutputDirectory(const std::string& outputDirectory, int verbose, bool forked);
 
     void initKleeOptions();
+    void initObjectAllocator();
     void initExecutor();
     void initPlugins();
 
@@ -224,12 +245,18 @@ public:
     /* Runtime information */
     S2EExecutor* getExecutor() { return m_s2eExecutor; }
 
+    /** NULL when KLEE objects come from the heap */
+    const SlabObjectAllocator* getObjectAllocator() const { return m_objectAllocator; }
+
     //XXX: A plugin can hold cached state information. When a state is deleted,
     //remove all the cached info from all plugins.
     void refreshPlugins();
 
     void writeBitCodeToFile();
 
+    //Per-plugin cost of copying the plugin states on forks
+    void writePluginStateStats();
+
     int fork();
     bool isForking() const {
         return m_forking;
@@ -252,6 +279,34 @@ public:
 
     unsigned getCurrentProcessCount();
 
+    /** Publishes the number of states held by this instance */
+    void setCurrentStateCount(unsigned count);
+
+    /** Tells the other instances that this one ran out of states */
+    void requestWork();
+
+    /** Returns the event that other instances signal to wake up this one.
+        All instances are woken up when the instance count decreases. */
+    S2EProcessEvent &getProcessEvent() {
+        return m_sync.get()->processEvents[m_currentProcessId];
+    }
+
+    /** Wakes up the instance with the given id */
+    void signalProcess(unsigned id) {
+        m_sync.get()->processEvents[id].signal();
+    }
+
+    /** Wakes up all the other instances */
+    void signalOtherProcesses();
+
+    /**
+     * Returns true if this instance should fork and hand off some of its
+     * states, i.e., there is a free process slot and this instance is the
+     * busiest one. Instances with fewer than minStates states only give
+     * away work if another instance requested it.
+     */
+    bool shouldDonateStates(unsigned minStates);
+
     bool checkDeadProcesses();
 
     inline uint64_t getStartTime() const {
@@ -44,6 +44,7 @@ void vm_start(void);
 
 #include "s2e_block.h"
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <s2e/Utils.h>
@@ -52,6 +53,7 @@ void vm_start(void);
 #include "llvm/Support/CommandLine.h"
 #include "S2EDeviceState.h"
 #include "S2EExecutionState.h"
+#include "S2EStatsTracker.h"
 
 namespace {
     //Force writes to disk to be persistent (and disable copy on write)
@@ -74,12 +76,22 @@ std::vector<void *> S2EDeviceState::s_devices;
 llvm::SmallVector<struct BlockDriverState*, 5> S2EDeviceState::s_blockDevices;
 
 QEMUFile *S2EDeviceState::s_memFile = NULL;
-uint8_t *S2EDeviceState::s_tempStateBuffer = NULL;
-unsigned S2EDeviceState::s_tempStateSize = 0;
-unsigned S2EDeviceState::s_finalStateSize = 0;
+std::vector<uint8_t> S2EDeviceState::s_saveBuffer;
+unsigned S2EDeviceState::s_saveSize = 0;
+const S2EDeviceSnapshot *S2EDeviceState::s_restoreSnapshot = NULL;
+
+/* All live snapshots by hash. Defined before s_loadedSnapshots,
+   whose snapshots unregister themselves when destroyed at exit. */
+typedef std::multimap<uint64_t, S2EDeviceSnapshot*> SnapshotIndex;
+static SnapshotIndex s_snapshotIndex;
+
+S2EDeviceState::DeviceSnapshots S2EDeviceState::s_loadedSnapshots;
+bool S2EDeviceState::s_loadedSnapshotsValid = false;
 
 bool S2EDeviceState::s_devicesInited=false;
 
+uint64_t S2EDeviceState::s_lastCowKey = 0;
+
 extern "C" {
 
 static int s2e_qemu_get_buffer(uint8_t *buf, int64_t pos, int size)
@@ -92,6 +104,16 @@ static int s2e_qemu_put_buffer(const uint8_t *buf, int64_t pos, int size)
     return g_s2e_state->getDeviceState()->putBuffer(buf, pos, size);
 }
 
+/* FNV-1a */
+static uint64_t s2e_hash_buffer(const uint8_t *buf, unsigned size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned i = 0; i < size; ++i) {
+        hash = (hash ^ buf[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
 void s2e_init_device_state(S2EExecutionState *s)
 {
     s->getDeviceState()->initDeviceState();
@@ -100,39 +122,50 @@ void s2e_init_device_state(S2EExecutionState *s)
 }
 
 
+S2EDeviceSnapshot::S2EDeviceSnapshot(const uint8_t *buf, unsigned size, uint64_t h):
+        refCount(0), hash(h), data(buf, buf + size)
+{
+    s_snapshotIndex.insert(std::make_pair(hash, this));
+}
+
+S2EDeviceSnapshot::~S2EDeviceSnapshot()
+{
+    std::pair<SnapshotIndex::iterator, SnapshotIndex::iterator> range =
+            s_snapshotIndex.equal_range(hash);
+    for (SnapshotIndex::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == this) {
+            s_snapshotIndex.erase(it);
+            break;
+        }
+    }
+}
+
+/*****************************************************************************/
+
 S2EDeviceState::S2EDeviceState(const S2EDeviceState &state):
-        m_deviceState(state.m_deviceState)
+        m_snapshots(state.m_snapshots),
+        m_diskBlocks(state.m_diskBlocks)
 {
-	if (state.m_stateBuffer) {
-    assert( state.m_stateBuffer && s_finalStateSize > 0);
-    m_stateBuffer = (uint8_t*) malloc(s_finalStateSize);
-    memcpy(m_stateBuffer, state.m_stateBuffer, s_finalStateSize);
-    s_memFile = state.s_memFile;
-	}
+    //Neither copy may write the shared blocks in place anymore
+    state.m_cowKey = ++s_lastCowKey;
+    m_cowKey = ++s_lastCowKey;
 }
 
-S2EDeviceState::S2EDeviceState(klee::ExecutionState *state):m_deviceState(state)
+S2EDeviceState::S2EDeviceState()
 {
-    m_stateBuffer = NULL;
+    m_cowKey = ++s_lastCowKey;
     s_memFile = NULL;
 }
 
 S2EDeviceState::~S2EDeviceState()
 {
-    if (m_stateBuffer) {
-    	try {
-			 free(m_stateBuffer);
-			 m_stateBuffer = NULL;
-		} catch (...) {
-			 m_stateBuffer = NULL;
-		}
-    }
 }
 
 void S2EDeviceState::initDeviceState()
 {
-    m_stateBuffer = NULL;
-    
+    m_snapshots.clear();
+    invalidateLoadedSnapshots();
+
     s_devicesInited = false;
 
     s_memFile = qemu_memfile_open(s2e_qemu_get_buffer, s2e_qemu_put_buffer);
@@ -187,104 +220,112 @@ void S2EDeviceState::initDeviceState()
     }
 }
 
-void S2EDeviceState::saveDeviceState()
+/**
+ * Return the snapshot of the device serialized in s_saveBuffer.
+ * Devices that did not change keep their current snapshot and
+ * identical contents share a single copy, only new contents are copied.
+ */
+klee::ref<S2EDeviceSnapshot> S2EDeviceState::getSnapshot(
+        const klee::ref<S2EDeviceSnapshot> &current)
 {
-    qemu_make_readable(s_memFile);
+    const uint8_t *data = s_saveSize ? &s_saveBuffer[0] : NULL;
+    uint64_t hash = s2e_hash_buffer(data, s_saveSize);
 
-    //DPRINTF("Saving device state %p\n", this);
-    /* Iterate through all device descritors and call
-    * their snapshot function */
-    for (vector<void*>::iterator it = s_devices.begin(); it != s_devices.end(); it++) {
-        void *se = *it;
-        //DPRINTF("%s ", s2e_qemu_get_se_idstr(se));
-        s2e_qemu_save_state(s_memFile, se);
+    if (!current.isNull() && current->equals(data, s_saveSize, hash)) {
+        return current;
     }
-    //DPRINTF("\n");
-    qemu_fflush(s_memFile);
-    initFirstSnapshot();
+
+    std::pair<SnapshotIndex::iterator, SnapshotIndex::iterator> range =
+            s_snapshotIndex.equal_range(hash);
+    for (SnapshotIndex::iterator it = range.first; it != range.second; ++it) {
+        if (it->second->equals(data, s_saveSize, hash)) {
+            return klee::ref<S2EDeviceSnapshot>(it->second);
+        }
+    }
+
+    klee::stats::deviceStateBytesCopied += s_saveSize;
+    return klee::ref<S2EDeviceSnapshot>(new S2EDeviceSnapshot(data, s_saveSize, hash));
 }
 
-void S2EDeviceState::initFirstSnapshot()
+void S2EDeviceState::saveDeviceState()
 {
-    if (s_finalStateSize) {
-        return;
-    }
+    m_snapshots.resize(s_devices.size());
+
+    /* Iterate through all device descritors and call
+    * their snapshot function. Each device is serialized from
+    * offset 0 so that it can be compared and restored on its own. */
+    for (unsigned i = 0; i < s_devices.size(); ++i) {
+        qemu_make_readable(s_memFile);
+        s_saveSize = 0;
+
+        s2e_qemu_save_state(s_memFile, s_devices[i]);
+        qemu_fflush(s_memFile);
 
-    assert(!m_stateBuffer && s_tempStateBuffer && s_tempStateSize);
-    m_stateBuffer = (uint8_t*) malloc(s_tempStateSize);
-    if (!m_stateBuffer) {
-        llvm::errs() << "S2EDeviceState: could not allocate memory\n";
-        exit(-1);
+        m_snapshots[i] = getSnapshot(m_snapshots[i]);
     }
 
-    memcpy(m_stateBuffer, s_tempStateBuffer, s_tempStateSize);
-    s_finalStateSize = s_tempStateSize;
-    free(s_tempStateBuffer);
-    s_tempStateBuffer = NULL;
-    s_tempStateSize = 0;
+    s_loadedSnapshots = m_snapshots;
+    s_loadedSnapshotsValid = true;
 }
 
 void S2EDeviceState::restoreDeviceState()
 {
-	if (!(s_finalStateSize && m_stateBuffer)) {
-			qemu_make_readable(s_memFile);
-	} else {
-    qemu_make_readable(s_memFile);
-    //DPRINTF("Restoring device state %p\n", this);
-    for (vector<void*>::iterator it = s_devices.begin(); it != s_devices.end(); it++) {
-        void *se = *it;
-        //DPRINTF("%s ", s2e_qemu_get_se_idstr(se));  
-        s2e_qemu_load_state(s_memFile, se);
+    ++klee::stats::deviceStateSwitches;
+
+    if (!s_loadedSnapshotsValid) {
+        s_loadedSnapshots.clear();
     }
-    //DPRINTF("\n");
-	}
-}
+    s_loadedSnapshots.resize(std::max(s_loadedSnapshots.size(), m_snapshots.size()));
 
+    for (unsigned i = 0; i < m_snapshots.size(); ++i) {
+        //The device already holds the contents of this state
+        if (m_snapshots[i].get() == s_loadedSnapshots[i].get()) {
+            continue;
+        }
 
-/*****************************************************************************/
-/*****************************************************************************/
-/*****************************************************************************/
+        qemu_make_readable(s_memFile);
+        s_restoreSnapshot = m_snapshots[i].get();
+        s2e_qemu_load_state(s_memFile, s_devices[i]);
+        s_loadedSnapshots[i] = m_snapshots[i];
 
-void S2EDeviceState::allocateBuffer(unsigned int Sz)
-{
-    if (Sz < s_tempStateSize) {
-        return;
+        klee::stats::deviceStateBytesCopied += s_restoreSnapshot->data.size();
     }
 
-    /* Need to expand the buffer */
-    s_tempStateSize = Sz;
-    s_tempStateBuffer = (uint8_t*) realloc(s_tempStateBuffer, s_tempStateSize);
-    if (!s_tempStateBuffer) {
-        cerr << "Cannot reallocate memory for device state snapshot" << endl;
-        exit(-1);
-    }
+    s_restoreSnapshot = NULL;
+    qemu_make_readable(s_memFile);
+
+    //The devices will run from here on
+    s_loadedSnapshotsValid = false;
 }
 
-int S2EDeviceState::putBuffer(const uint8_t *buf, int64_t pos, int size)
+void S2EDeviceState::invalidateLoadedSnapshots()
 {
-    uint8_t *dest;
+    s_loadedSnapshotsValid = false;
+    s_loadedSnapshots.clear();
+}
 
-    if (!m_stateBuffer) {
-        allocateBuffer(pos + size);
-        dest = &s_tempStateBuffer[pos];
-    } else {
-        dest = &m_stateBuffer[pos];
+int S2EDeviceState::putBuffer(const uint8_t *buf, int64_t pos, int size)
+{
+    if (pos + size > (int64_t) s_saveBuffer.size()) {
+        s_saveBuffer.resize((pos + size) * 2);
     }
 
-    memcpy(dest, buf, size);
+    memcpy(&s_saveBuffer[pos], buf, size);
+    s_saveSize = std::max(s_saveSize, (unsigned) (pos + size));
     return size;
 }
 
 int S2EDeviceState::getBuffer(uint8_t *buf, int64_t pos, int size)
 {
-    assert(m_stateBuffer);
-    int toCopy = pos + size <= s_finalStateSize ? size : s_finalStateSize - pos;
-    memcpy(buf, &m_stateBuffer[pos], toCopy);
-    return size;
-
+    assert(s_restoreSnapshot);
+    int64_t available = (int64_t) s_restoreSnapshot->data.size() - pos;
+    int toCopy = size <= available ? size : (available > 0 ? available : 0);
+    if (toCopy) {
+        memcpy(buf, &s_restoreSnapshot->data[pos], toCopy);
+    }
 
-    //memcpy(buf, &m_state[pos], toCopy);
-    //return toCopy;
+    //QEMU reads ahead of what the device consumes, the tail is never used
+    return size;
 }
 
 
@@ -305,57 +346,93 @@ unsigned S2EDeviceState::getBlockDeviceId(struct BlockDriverState* dev)
     return i;
 }
 
-uint64_t S2EDeviceState::getBlockDeviceStart(struct BlockDriverState* dev)
+S2EDiskBlock *S2EDeviceState::getWriteableBlock(uint64_t key, bool overwrite)
 {
-    unsigned id = getBlockDeviceId(dev);
-    return id * BLOCK_DEV_AS;
+    const DiskBlocks::value_type *entry = m_diskBlocks.lookup(key);
+    if (entry && entry->second->cowKey == m_cowKey) {
+        return entry->second.get();
+    }
+
+    klee::ref<S2EDiskBlock> block(new S2EDiskBlock(m_cowKey));
+
+    //No need to copy a block that is about to be overwritten
+    if (entry && !overwrite) {
+        memcpy(block->data, entry->second->data, sizeof(block->data));
+        block->dirtyMask = entry->second->dirtyMask;
+    }
+
+    m_diskBlocks = m_diskBlocks.replace(std::make_pair(key, block));
+    return block.get();
 }
 
 /* Return 0 upon success */
 int S2EDeviceState::writeSector(struct BlockDriverState *bs, int64_t sector, const uint8_t *buf, int nb_sectors)
 {
-    uint64_t bstart = getBlockDeviceStart(bs);
+    uint64_t device = (uint64_t) getBlockDeviceId(bs) << DEVICE_KEY_SHIFT;
 
     while (nb_sectors > 0) {
-        uintptr_t address = (uintptr_t) bstart + sector * SECTOR_SIZE;
-        ObjectPair op = m_deviceState.findObject(address);
-        if (op.first == NULL) {
-            MemoryObject *mo = new MemoryObject(address, SECTOR_SIZE, false, false, false, NULL);
-            ObjectState *os = new ObjectState(mo);
-            m_deviceState.bindObject(mo, os);
-            op.first = mo;
-            op.second = os;
+        unsigned first = sector % BLOCK_SECTORS;
+        unsigned count = BLOCK_SECTORS - first;
+        if (count > (unsigned) nb_sectors) {
+            count = nb_sectors;
         }
 
-        ObjectState *os = m_deviceState.getWriteable(op.first, op.second);
-        memcpy(os->getConcreteStore(false), buf, SECTOR_SIZE);
-        buf += SECTOR_SIZE;
-        --nb_sectors;
-        ++sector;
+        S2EDiskBlock *block = getWriteableBlock(device | (sector / BLOCK_SECTORS),
+                                                count == BLOCK_SECTORS);
+
+        memcpy(&block->data[first * SECTOR_SIZE], buf, count * SECTOR_SIZE);
+        block->dirtyMask |= ((1 << count) - 1) << first;
+
+        buf += count * SECTOR_SIZE;
+        nb_sectors -= count;
+        sector += count;
     }
 
     return 0;
 }
 
-/* Return the number of sectors that could be read from the local store */
+/**
+ * Copy the sectors written by this state into buf, leaving the
+ * other ones untouched. Return the number of sectors copied.
+ */
 int S2EDeviceState::readSector(struct BlockDriverState *bs, int64_t sector, uint8_t *buf, int nb_sectors)
 {
     int readCount = 0;
 
-    uint64_t bstart = getBlockDeviceStart(bs);
+    if (m_diskBlocks.empty()) {
+        return 0;
+    }
+
+    uint64_t device = (uint64_t) getBlockDeviceId(bs) << DEVICE_KEY_SHIFT;
 
     while (nb_sectors > 0) {
-        uintptr_t address = (uintptr_t) bstart + sector * SECTOR_SIZE;
-        ObjectPair op = m_deviceState.findObject(address);
-        if (!op.first) {
-            return readCount;
+        unsigned first = sector % BLOCK_SECTORS;
+        unsigned count = BLOCK_SECTORS - first;
+        if (count > (unsigned) nb_sectors) {
+            count = nb_sectors;
+        }
+
+        const DiskBlocks::value_type *entry = m_diskBlocks.lookup(device | (sector / BLOCK_SECTORS));
+        if (entry) {
+            const S2EDiskBlock *block = entry->second.get();
+            uint32_t mask = ((1 << count) - 1) << first;
+
+            if ((block->dirtyMask & mask) == mask) {
+                memcpy(buf, &block->data[first * SECTOR_SIZE], count * SECTOR_SIZE);
+                readCount += count;
+            } else {
+                for (unsigned i = 0; i < count; ++i) {
+                    if (block->dirtyMask & (1 << (first + i))) {
+                        memcpy(&buf[i * SECTOR_SIZE], &block->data[(first + i) * SECTOR_SIZE], SECTOR_SIZE);
+                        ++readCount;
+                    }
+                }
+            }
         }
 
-        memcpy(buf, op.second->getConcreteStore(false), SECTOR_SIZE);
-        buf += SECTOR_SIZE;
-        ++readCount;
-        --nb_sectors;
-        ++sector;
+        buf += count * SECTOR_SIZE;
+        nb_sectors -= count;
+        sector += count;
     }
 
     return readCount;
@@ -45,9 +45,11 @@ extern "C" {
 #include <map>
 #include <set>
 #include <stdint.h>
+#include <string.h>
 #include <llvm/ADT/SmallVector.h>
 
-#include <klee/AddressSpace.h>
+#include <klee/Internal/ADT/ImmutableMap.h>
+#include <klee/util/Ref.h>
 
 #include "s2e_block.h"
 
@@ -55,12 +57,57 @@ namespace s2e {
 
 class S2EExecutionState;
 
+/**
+ * A group of consecutive sectors written by the guest.
+ * Blocks are shared between the states that forked after the write,
+ * and copied when one of them writes to the block again.
+ */
+struct S2EDiskBlock {
+    static const unsigned SECTOR_SIZE = 512;
+    static const unsigned SECTORS = 8;
+
+    unsigned refCount;
+
+    /* The state that may write to the block in place */
+    uint64_t cowKey;
+
+    /* One bit per sector that holds data */
+    uint32_t dirtyMask;
+
+    uint8_t data[SECTORS * SECTOR_SIZE];
+
+    S2EDiskBlock(uint64_t key) : refCount(0), cowKey(key), dirtyMask(0) {}
+};
+
+/**
+ * The serialized state of one device. Snapshots are immutable, a device
+ * that changes gets a new snapshot. Identical snapshots are shared by all
+ * the states, whether they forked or reached the same contents separately.
+ */
+struct S2EDeviceSnapshot {
+    unsigned refCount;
+    uint64_t hash;
+    std::vector<uint8_t> data;
+
+    S2EDeviceSnapshot(const uint8_t *buf, unsigned size, uint64_t h);
+    ~S2EDeviceSnapshot();
+
+    bool equals(const uint8_t *buf, unsigned size, uint64_t h) const {
+        return hash == h && data.size() == size &&
+               (size == 0 || !memcmp(&data[0], buf, size));
+    }
+};
+
 class S2EDeviceState {
 private:
-    static const unsigned SECTOR_SIZE = 512;
+    static const unsigned SECTOR_SIZE = S2EDiskBlock::SECTOR_SIZE;
+    static const unsigned BLOCK_SECTORS = S2EDiskBlock::SECTORS;
+
+    /* Block keys are made of the device id and the block index */
+    static const unsigned DEVICE_KEY_SHIFT = 48;
 
-    /* Give 64GB of KLEE address space for each block device */
-    static const uint64_t BLOCK_DEV_AS = (1024 * 1024 * 1024) * 64;
+    typedef klee::ImmutableMap<uint64_t, klee::ref<S2EDiskBlock> > DiskBlocks;
+    typedef std::vector<klee::ref<S2EDeviceSnapshot> > DeviceSnapshots;
 
     static std::vector<void *> s_devices;
     static std::set<std::string> s_customDevices;
@@ -68,35 +115,45 @@ private:
 
     static QEMUFile *s_memFile;
 
-    /* Scratch buffer for the first snapshot */
-    static uint8_t *s_tempStateBuffer;
+    /* Serialized state of the device being saved */
+    static std::vector<uint8_t> s_saveBuffer;
+    static unsigned s_saveSize;
 
-    /* Once determined, the size of the device state is constant */
-    static unsigned s_tempStateSize;
-    static unsigned s_finalStateSize;
+    /* Snapshot read by the device being restored */
+    static const S2EDeviceSnapshot *s_restoreSnapshot;
 
-    uint8_t *m_stateBuffer;
+    /* Snapshots currently loaded in QEMU's devices, indexed like s_devices.
+       Only meaningful until the devices run again. */
+    static DeviceSnapshots s_loadedSnapshots;
+    static bool s_loadedSnapshotsValid;
 
+    /* One snapshot per entry of s_devices, empty until the first save */
+    DeviceSnapshots m_snapshots;
 
     static llvm::SmallVector<struct BlockDriverState*, 5> s_blockDevices;
-    klee::AddressSpace m_deviceState;
 
-    void allocateBuffer(unsigned int Sz);
+    /* Sectors written by this state, persistent so that
+       copying the device state does not copy the disk */
+    DiskBlocks m_diskBlocks;
+
+    /* Blocks whose cowKey matches are owned by this state.
+       Copying the device state changes the key of both copies. */
+    mutable uint64_t m_cowKey;
+    static uint64_t s_lastCowKey;
+
 
     static unsigned getBlockDeviceId(struct BlockDriverState* dev);
-    static uint64_t getBlockDeviceStart(struct BlockDriverState* dev);
 
-    void initFirstSnapshot();
+    S2EDiskBlock *getWriteableBlock(uint64_t key, bool overwrite);
+
+    static klee::ref<S2EDeviceSnapshot> getSnapshot(
+            const klee::ref<S2EDeviceSnapshot> &current);
 
 public:
-    S2EDeviceState(klee::ExecutionState *state);
+    S2EDeviceState();
     S2EDeviceState(const S2EDeviceState &state);
     ~S2EDeviceState();
 
-    void setExecutionState(klee::ExecutionState *state) {
-        m_deviceState.state = state;
-    }
-
     void initDeviceState();
 
     //From QEMU to KLEE
@@ -105,6 +162,9 @@ public:
     //From KLEE to QEMU
     void restoreDeviceState();
 
+    //The devices ran since the last save, restoring must load all of them
+    static void invalidateLoadedSnapshots();
+
     int putBuffer(const uint8_t *buf, int64_t pos, int size);
     int getBuffer(uint8_t *buf, int64_t pos, int size);
 
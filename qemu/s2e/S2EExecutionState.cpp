@@ -67,12 +67,18 @@ extern CPUArchState *env;
 #include <s2e/S2E.h>
 #include <s2e/Utils.h>
 #include <s2e/s2e_qemu.h>
+#include <s2e/S2EStatsTracker.h>
+#include <klee/Internal/Support/Timer.h>
 
 #include <llvm/Support/CommandLine.h>
 
 #include <iomanip>
 #include <sstream>
 
+#ifdef __linux__
+#include <malloc.h>
+#endif
+
 //XXX: The idea is to avoid function calls
 //#define small_memcpy(dest, source, count) asm volatile ("cld; rep movsb"::"S"(source), "D"(dest), "c" (count):"flags", "memory")
 #define small_memcpy __builtin_memcpy
@@ -83,6 +89,37 @@ extern llvm::cl::opt<bool> DebugLogStateMerge;
 
 namespace {
 CPUTLBEntry s_cputlb_empty_entry = { -1, -1, -1, -1 };
+
+//Pages that are shared with other states are mapped without the
+//owned-by-us bit. The first store then goes through writeRamConcrete(),
+//which makes the page writable and upgrades the TLB entry in
+//addressSpaceChange().
+llvm::cl::opt<bool>
+ReadOnlyTlbMappings("s2e-tlb-read-only-mappings",
+        llvm::cl::desc("Do not copy shared pages when mapping them in the S2E TLB, only on the first write"),
+        llvm::cl::init(false));
+
+llvm::cl::opt<bool>
+LazyPluginStateCopy("s2e-lazy-plugin-state-copy",
+        llvm::cl::desc("Share plugin states between forked states until one of them writes to its copy"),
+        llvm::cl::init(true));
+
+llvm::cl::opt<bool>
+PluginStateHeapStats("s2e-plugin-state-heap-stats",
+        llvm::cl::desc("Measure the heap allocated by plugin state copies made on writes (slow)"),
+        llvm::cl::init(false));
+
+//mallinfo() is deprecated and its counters wrap at 2GB
+int64_t getHeapUsage()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#elif defined(__linux__)
+    return (unsigned) mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
 }
 
 extern llvm::cl::opt<bool> PrintModeSwitch;
@@ -97,16 +134,56 @@ using namespace klee;
 
 MemoryObject *S2EExecutionState::m_cpuRegistersState = NULL;
 MemoryObject *S2EExecutionState::m_cpuSystemState = NULL;
-MemoryObject *S2EExecutionState::m_dirtyMask = NULL;
+std::vector<MemoryObject*> S2EExecutionState::m_dirtyMaskLeaves;
+uint64_t S2EExecutionState::m_dirtyMaskAddress = 0;
+uint64_t S2EExecutionState::m_dirtyMaskSize = 0;
+std::vector<bool> S2EExecutionState::m_dirtyMaskWritten;
 
 unsigned S2EExecutionState::s_lastSymbolicId = 0;
+PluginStateStatsMap S2EExecutionState::s_pluginStateStats;
+
+S2EPluginStateRef::~S2EPluginStateRef()
+{
+    delete state;
+}
+
+S2EForkDecision::S2EForkDecision(const ref<S2EForkDecision> &_parent,
+                                 bool _taken, uint64_t _pc, uint64_t _address) :
+        refCount(0), parent(_parent),
+        depth(_parent.isNull() ? 1 : _parent->depth + 1),
+        taken(_taken), pc(_pc), address(_address)
+{
+}
+
+S2EForkDecision::~S2EForkDecision()
+{
+    //Release the unshared part of the path iteratively,
+    //deep paths would otherwise overflow the stack
+    ref<S2EForkDecision> p = parent;
+    parent = ref<S2EForkDecision>();
+    while (!p.isNull() && p->refCount == 1) {
+        ref<S2EForkDecision> next = p->parent;
+        p->parent = ref<S2EForkDecision>();
+        p = next;
+    }
+}
+
+S2EForkReplay::S2EForkReplay(const ref<S2EForkDecision> &path) :
+        refCount(0), leaf(path)
+{
+    decisions.resize(path.isNull() ? 0 : path->depth);
+    unsigned i = decisions.size();
+    for (const S2EForkDecision *d = path.get(); d; d = d->parent.get()) {
+        decisions[--i] = d;
+    }
+}
 
 S2EExecutionState::S2EExecutionState(klee::KFunction *kf) :
         klee::ExecutionState(kf), m_stateID(g_s2e->fetchAndIncrementStateId()),
         m_symbexEnabled(true), m_startSymbexAtPC((uint64_t) -1),
         m_active(true), m_zombie(false), m_yielded(false), m_runningConcrete(true),
+        m_symbolicRegistersMask(0), m_symbolicRegistersMaskValid(false),
         m_cpuRegistersObject(NULL), m_cpuSystemObject(NULL),
-        m_deviceState(this),
         m_qemuIcount(0),
         m_lastS2ETb(NULL),
         m_lastMergeICount((uint64_t)-1),
@@ -117,32 +194,27 @@ S2EExecutionState::S2EExecutionState(klee::KFunction *kf) :
 {
     //XXX: make this a struct, not a pointer...
     m_timersState = new TimersState;
-    m_dirtyMaskObject = NULL;
     m_replaying=false;
     m_isskip = false;
     m_replay2normal = false;
     m_allowserialize = true;
     m_forcetoadd = false;
     m_preparingstate = false;
-
+    m_replayCursor = 0;
 }
 
 S2EExecutionState::~S2EExecutionState()
 {
     assert(m_lastS2ETb == NULL);
 
-    PluginStateMap::iterator it;
-
     if (VerboseStateDeletion) {
         g_s2e->getDebugStream() << "Deleting state " << m_stateID << " " << this << '\n';
     }
 
     //print_stacktrace();
 
-    for(it = m_PluginState.begin(); it != m_PluginState.end(); ++it) {
-        delete it->second;
-    }
-
+    //The plugin states are released with the map,
+    //the ones still shared survive in the other states
     g_s2e->refreshPlugins();
 
     //XXX: This cannot be done, as device states may refer to each other
@@ -323,13 +395,11 @@ ExecutionState* S2EExecutionState::clone(bool cestatus)
     //一定是分化时才会到这里?
     bool currentce = false;
 	if (this->m_replaying && !this->m_preparingstate && (this->m_concreteAddressEvaluate == ((uint64_t) -1))) { //回放只是用来选择状态用的
-		currentce = this->m_forkrecord4repaly.front();
-		this->m_forkrecord4repaly.pop_front();
+		currentce = this->nextReplayDecision()->taken;
 	}
 
     S2EExecutionState *ret = new S2EExecutionState(*this);
     ret->addressSpace.state = ret;
-    ret->m_deviceState.setExecutionState(ret);
     ret->m_statefilename=std::string(this->m_statefilename);
 	ret->m_allowserialize = true;
 	ret->m_shouldbedeleted = false;
@@ -340,41 +410,13 @@ ExecutionState* S2EExecutionState::clone(bool cestatus)
 
     ret->m_replaying = this->m_replaying;
     ret->m_replay2normal = this->m_replay2normal;
+    //The copy shares the fork path and the replayed path.
+    //Forks on symbolic addresses are recorded by the address handler.
     if(!m_preparingstate){
-		if(this->m_replaying){//回放的状态始终在自己身上
-		ret->m_forkrecord=std::deque<bool>(this->m_forkrecord);
-		ret->m_forkrecord4repaly=std::deque<bool>(this->m_forkrecord4repaly);
-		//ret-> m_forkPoints=std::deque<uint64_t>(this->m_forkPoints);
-		ret->m_concreteAddress=std::deque<uint64_t>(this->m_concreteAddress);
-		ret->m_concreteAddress4repaly=std::deque<uint64_t>(this->m_concreteAddress4repaly);
-
-			this->m_forkrecord.push_back(cestatus);
-			ret->m_forkrecord.push_back(!cestatus);
-
-			this->m_forkPoints.push_back(getPc());
-			ret-> m_forkPoints=std::deque<uint64_t>(this->m_forkPoints);
-
-	  }else{
-		  if(this->m_concreteAddressEvaluate != ((uint64_t) -1)){
-				ret->m_forkrecord=std::deque<bool>(this->m_forkrecord);
-				ret->m_forkrecord4repaly=std::deque<bool>(this->m_forkrecord4repaly);
-				ret->m_concreteAddress=std::deque<uint64_t>(this->m_concreteAddress);
-				ret->m_concreteAddress4repaly=std::deque<uint64_t>(this->m_concreteAddress4repaly);
-				ret-> m_forkPoints=std::deque<uint64_t>(this->m_forkPoints);
-		  }else{
-				ret->m_forkrecord = std::deque<bool>(this->m_forkrecord);
-
-				this->m_forkrecord.push_back(cestatus);
-				this->m_forkrecord4repaly = std::deque<bool>(this->m_forkrecord);
-				this->m_forkPoints.push_back(getPc());
-				//this->m_concreteAddress.push_back(this->m_concreteAddressEvaluate);
-				ret->m_forkrecord.push_back(!cestatus);
-				ret->m_forkrecord4repaly=std::deque<bool>(ret->m_forkrecord);
-
-				ret-> m_forkPoints=std::deque<uint64_t>(this->m_forkPoints);
-				//ret->m_concreteAddress.push_back(this->m_concreteAddressEvaluate);
-		  }
-	  }
+		if(this->m_replaying || this->m_concreteAddressEvaluate == ((uint64_t) -1)){
+			this->recordForkDecision(cestatus);
+			ret->recordForkDecision(!cestatus);
+		}
     }
 
     ret->m_stateID = g_s2e->fetchAndIncrementStateId();
@@ -386,9 +428,8 @@ ExecutionState* S2EExecutionState::clone(bool cestatus)
     //
     if (this->m_replaying && !this->m_preparingstate  && (this->m_concreteAddressEvaluate == ((uint64_t) -1))) { //回放只是用来选择状态用的
 			S2EExecutionState* s2esecond = cestatus ? ret : this;
-			if (s2esecond->m_forkrecord4repaly.size() == 0) {
-				s2esecond->m_forkrecord4repaly = std::deque<bool>(
-						s2esecond->m_forkrecord);
+			if (s2esecond->isReplayComplete()) {
+				s2esecond->resetReplay();
 				s2esecond->m_allowserialize = false;
 				if (currentce) {
 					s2esecond->m_replaying = true;
@@ -398,9 +439,8 @@ ExecutionState* S2EExecutionState::clone(bool cestatus)
 				}
 			}
 			S2EExecutionState* s2efirst =  cestatus ? this : ret;
-			if (s2efirst->m_forkrecord4repaly.size() == 0) {
-				s2efirst->m_forkrecord4repaly = std::deque<bool>(
-						s2efirst->m_forkrecord);
+			if (s2efirst->isReplayComplete()) {
+				s2efirst->resetReplay();
 				s2efirst->m_allowserialize = false;
 				if (!currentce) {
 					s2efirst->m_replaying = true;
@@ -419,13 +459,21 @@ ExecutionState* S2EExecutionState::clone(bool cestatus)
 		}
    		}
 
-    // Clone the plugins
-    PluginStateMap::iterator it;
+    // Share the plugin states, they are copied on the first write
     ret->m_PluginState.clear();
-    for(it = m_PluginState.begin(); it != m_PluginState.end(); ++it) {
-        ret->m_PluginState.insert(std::make_pair((*it).first, (*it).second->clone()));
+    foreach2(it, m_PluginState.begin(), m_PluginState.end()) {
+        if (LazyPluginStateCopy) {
+            ret->m_PluginState.insert(*it);
+            ++s_pluginStateStats[(*it).first].shares;
+        } else {
+            ret->m_PluginState.insert(std::make_pair((*it).first,
+                    clonePluginState((*it).first, (*it).second->state, false)));
+        }
     }
 
+    // The plugins may have cached a writeable pointer to a state that is now shared
+    g_s2e->refreshPlugins();
+
     // This objects are not in TLB and won't cause any changes to it
     ret->m_cpuRegistersObject = ret->addressSpace.getWriteable(
                             m_cpuRegistersState, m_cpuRegistersObject);
@@ -437,16 +485,46 @@ ExecutionState* S2EExecutionState::clone(bool cestatus)
     m_cpuSystemObject = addressSpace.getWriteable(
                             m_cpuSystemState, m_cpuSystemObject);
 
-//    fprintf(stderr,"+retid=%d currentid=%d dirtyMaskObject.size=%d\n", ret->getID(),getID()  ,m_dirtyMaskObject->size);
-    ret->m_dirtyMaskObject = ret->addressSpace.getWriteable(
-            m_dirtyMask, m_dirtyMaskObject);
-
-    m_dirtyMaskObject = addressSpace.getWriteable(
-            m_dirtyMask, m_dirtyMaskObject);
- //    fprintf(stderr,"-retid=%d currentid=%d dirtyMaskObject.size=%d ret->m_dirtyMaskObject.size=%d \n", ret->getID(),getID()  ,m_dirtyMaskObject->size,ret->m_dirtyMaskObject->size);
+    //The dirty mask leaves stay shared, they are copied when saved
     return ret;
 }
 
+void S2EExecutionState::recordForkDecision(bool taken, uint64_t address)
+{
+    m_forkPath = new S2EForkDecision(m_forkPath, taken, getPc(), address);
+}
+
+void S2EExecutionState::setReplayPath(const ref<S2EForkDecision> &path)
+{
+    m_replayPath = new S2EForkReplay(path);
+    m_replayCursor = 0;
+}
+
+const S2EForkDecision *S2EExecutionState::nextReplayDecision()
+{
+    if (m_replayPath.isNull()) {
+        setReplayPath(m_forkPath);
+    }
+
+    assert(m_replayCursor < m_replayPath->decisions.size() &&
+           "No fork decision left to replay");
+    return m_replayPath->decisions[m_replayCursor++];
+}
+
+bool S2EExecutionState::isReplayComplete() const
+{
+    if (m_replayPath.isNull()) {
+        return m_forkPath.isNull();
+    }
+    return m_replayCursor >= m_replayPath->decisions.size();
+}
+
+void S2EExecutionState::resetReplay()
+{
+    m_replayPath = ref<S2EForkReplay>();
+    m_replayCursor = 0;
+}
+
 ref<Expr> S2EExecutionState::readCpuRegister(unsigned offset,
                                              Expr::Width width) const
 {
@@ -474,6 +552,7 @@ void S2EExecutionState::writeCpuRegister(unsigned offset,
 
     if(!m_runningConcrete || !m_cpuRegistersObject->isConcrete(offset, width)) {
         m_cpuRegistersObject->write(offset, value);
+        m_symbolicRegistersMaskValid = false;
 
     } else {
         /* XXX: should we check getSymbolicRegisterMask ? */
@@ -496,6 +575,7 @@ void S2EExecutionState::writeCpuRegisterSymbolic(unsigned offset,
     assert(offset + Expr::getMinBytesForWidth(width) <= CPU_CONC_LIMIT);
 
     m_cpuRegistersObject->write(offset, value);
+    m_symbolicRegistersMaskValid = false;
 }
 
 bool S2EExecutionState::readCpuRegisterConcrete(unsigned offset,
@@ -932,6 +1012,54 @@ TranslationBlock *S2EExecutionState::getTb() const
             readCpuState(CPU_OFFSET(s2e_current_tb), 8*sizeof(void*));
 }
 
+PluginState* S2EExecutionState::getPluginState(Plugin *plugin, PluginStateFactory factory,
+                                               bool writeable)
+{
+    PluginStateMap::iterator it = m_PluginState.find(plugin);
+    if (it == m_PluginState.end()) {
+        PluginState *ret = factory(plugin, this);
+        assert(ret);
+        m_PluginState[plugin] = new S2EPluginStateRef(ret);
+        return ret;
+    }
+
+    if (writeable && (*it).second->refCount > 1) {
+        (*it).second = clonePluginState(plugin, (*it).second->state,
+                                        PluginStateHeapStats);
+
+        //The plugin may still cache the shared copy
+        plugin->refresh();
+    }
+
+    return (*it).second->state;
+}
+
+ref<S2EPluginStateRef> S2EExecutionState::clonePluginState(
+        const Plugin *plugin, const PluginState *state, bool measureHeap)
+{
+    S2EPluginStateStats &pluginStats = s_pluginStateStats[plugin];
+
+    WallTimer timer;
+    int64_t heapUsage = measureHeap ? getHeapUsage() : 0;
+
+    PluginState *copy = state->clone();
+    assert(copy);
+
+    int64_t bytes = measureHeap ? getHeapUsage() - heapUsage : 0;
+    uint64_t time = timer.check();
+
+    ++pluginStats.clones;
+    pluginStats.cloneTime += time;
+    if (bytes > 0) {
+        pluginStats.cloneBytes += bytes;
+    }
+
+    ++stats::pluginStateClones;
+    stats::pluginStateCloneTime += time;
+
+    return new S2EPluginStateRef(copy);
+}
+
 uint64_t S2EExecutionState::getPid() const
 {
 #ifdef TARGET_ARM
@@ -944,6 +1072,20 @@ uint64_t S2EExecutionState::getPid() const
 }
 
 uint64_t S2EExecutionState::getSymbolicRegistersMask() const
+{
+    if (m_runningConcrete && m_symbolicRegistersMaskValid) {
+        return m_symbolicRegistersMask;
+    }
+
+    uint64_t mask = computeSymbolicRegistersMask();
+    if (m_runningConcrete) {
+        m_symbolicRegistersMask = mask;
+        m_symbolicRegistersMaskValid = true;
+    }
+    return mask;
+}
+
+uint64_t S2EExecutionState::computeSymbolicRegistersMask() const
 {
     const ObjectState* os = m_cpuRegistersObject;
     if(os->isAllConcrete())
@@ -1517,6 +1659,7 @@ void S2EExecutionState::readRegisterConcrete(
                 buf[i] = g_s2e->getExecutor()->toConstant(*this, wos->read8(offset+i),
                                     reason.c_str())->getZExtValue(8);
                 wos->write8(offset+i, buf[i]);
+                m_symbolicRegistersMaskValid = false;
             }
         }
     } else {
@@ -1544,6 +1687,7 @@ void S2EExecutionState::writeRegisterConcrete(CPUArchState *cpuState,
         ObjectState* wos = m_cpuRegistersObject;
         for(unsigned i = 0; i < size; ++i)
             wos->write8(offset+i, buf[i]);
+        m_symbolicRegistersMaskValid = false;
     } else {
         assert(m_cpuRegistersObject->isConcrete(offset, size*8));
         small_memcpy(((uint8_t*)cpuState)+offset, buf, size);
@@ -1879,7 +2023,7 @@ bool S2EExecutionState::merge(const ExecutionState &_b)
             return false;
         }
         if(ai->second != bi->second && !ai->first->isValueIgnored &&
-                    ai->first != m_cpuSystemState && ai->first != m_dirtyMask) {
+                    ai->first != m_cpuSystemState && !isDirtyMask(ai->first)) {
             const MemoryObject *mo = ai->first;
             if(DebugLogStateMerge)
                 s << "\t\tmutated: " << mo->id << " (" << mo->name << ")\n";
@@ -1972,15 +2116,18 @@ bool S2EExecutionState::merge(const ExecutionState &_b)
     // Merge dirty mask by clearing bits that differ. Clearning bits in
     // dirty mask can only affect performance but not correcntess.
     // NOTE: this requires flushing TLB
-    {
-        const ObjectState* os = addressSpace.findObject(m_dirtyMask);
-        ObjectState* wos = addressSpace.getWriteable(m_dirtyMask, os);
-        uint8_t* dirtyMaskA = wos->getConcreteStore();
-        const uint8_t* dirtyMaskB = b.addressSpace.findObject(m_dirtyMask)->getConcreteStore();
-
-        for(unsigned i = 0; i < m_dirtyMask->size; ++i) {
-            if(dirtyMaskA[i] != dirtyMaskB[i])
-                dirtyMaskA[i] = 0;
+    foreach(MemoryObject *mo, m_dirtyMaskLeaves) {
+        const ObjectState* os = addressSpace.findObject(mo);
+        const uint8_t* dirtyMaskA = os->getConcreteStore();
+        const uint8_t* dirtyMaskB = b.addressSpace.findObject(mo)->getConcreteStore();
+
+        if (dirtyMaskA == dirtyMaskB || !memcmp(dirtyMaskA, dirtyMaskB, mo->size))
+            continue;
+
+        uint8_t* wDirtyMaskA = addressSpace.getWriteable(mo, os)->getConcreteStore();
+        for(unsigned i = 0; i < mo->size; ++i) {
+            if(wDirtyMaskA[i] != dirtyMaskB[i])
+                wDirtyMaskA[i] = 0;
         }
     }
 
@@ -2000,6 +2147,9 @@ bool S2EExecutionState::merge(const ExecutionState &_b)
         memset (cpu->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
+    // Registers may have become symbolic
+    m_symbolicRegistersMaskValid = false;
+
     return true;
 }
 
@@ -2162,6 +2312,10 @@ void S2EExecutionState::updateTlbEntry(CPUArchState* env,
         if(op.first->isSharedConcrete) {
             entry->objectState = const_cast<klee::ObjectState*>(op.second);
             entry->addend = (hostAddr - virtAddr) | 1;
+        } else if (ReadOnlyTlbMappings && !addressSpace.isOwnedByUs(ros)) {
+            // Stores fall back to the slow path until the page is written
+            entry->objectState = ros;
+            entry->addend = (uintptr_t) op.second->getConcreteStore(true) - virtAddr;
         } else {
             // XXX: for now we always ensure that all pages in TLB are writable
             klee::ObjectState *wos = addressSpace.getWriteable(op.first, op.second);
@@ -2197,16 +2351,20 @@ void S2EExecutionState::updateTlbEntry(CPUArchState* env,
 
 uint8_t S2EExecutionState::readDirtyMask(uint64_t host_address)
 {
-    uint8_t val=0;
-    host_address -= m_dirtyMask->address;
-    m_dirtyMaskObject->readConcrete8(host_address, &val);
-    return val;
+    assert(host_address - m_dirtyMaskAddress < m_dirtyMaskSize);
+    return *(uint8_t*) host_address;
 }
 
 void S2EExecutionState::writeDirtyMask(uint64_t host_address, uint8_t val)
 {
-    host_address -= m_dirtyMask->address;
-    m_dirtyMaskObject->write8(host_address, val);
+    uint64_t offset = host_address - m_dirtyMaskAddress;
+    assert(offset < m_dirtyMaskSize);
+
+    uint8_t *p = (uint8_t*) host_address;
+    if (*p != val) {
+        *p = val;
+        m_dirtyMaskWritten[offset >> S2E_DIRTY_MASK_LEAF_BITS] = true;
+    }
 }
 
 void S2EExecutionState::addConstraint(klee::ref<klee::Expr> e)
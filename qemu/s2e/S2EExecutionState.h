@@ -87,8 +87,39 @@ class S2EDeviceState;
 class S2EExecutionState;
 struct S2ETranslationBlock;
 
+/**
+ * A plugin state shared by the states that forked since the plugin
+ * last asked for a writeable copy.
+ */
+struct S2EPluginStateRef
+{
+    unsigned refCount;
+    PluginState *state;
+
+    S2EPluginStateRef(PluginState *_state) : refCount(0), state(_state) {}
+    ~S2EPluginStateRef();
+};
+
+/** What forking costs each plugin */
+struct S2EPluginStateStats
+{
+    /* Forks that shared the state instead of copying it */
+    uint64_t shares;
+    uint64_t clones;
+
+    /* Time spent in clone(), in microseconds */
+    uint64_t cloneTime;
+
+    /* Heap allocated by clone() for copies made on writes,
+       only measured with -s2e-plugin-state-heap-stats */
+    uint64_t cloneBytes;
+
+    S2EPluginStateStats() : shares(0), clones(0), cloneTime(0), cloneBytes(0) {}
+};
+
 //typedef std::tr1::unordered_map<const Plugin*, PluginState*> PluginStateMap;
-typedef std::map<const Plugin*, PluginState*> PluginStateMap;
+typedef std::map<const Plugin*, klee::ref<S2EPluginStateRef> > PluginStateMap;
+typedef std::map<const Plugin*, S2EPluginStateStats> PluginStateStatsMap;
 typedef PluginState* (*PluginStateFactory)(Plugin *p, S2EExecutionState *s);
 
 typedef MemoryCachePool<klee::ObjectPair,
@@ -108,16 +139,49 @@ struct S2EPhysCacheEntry
     }
 };
 
+/**
+ * One fork decision taken by a state. Decisions form a tree shared by
+ * all the states: a state only holds its last decision, the path from
+ * the root is reached through the parents.
+ */
+struct S2EForkDecision
+{
+    unsigned refCount;
+    klee::ref<S2EForkDecision> parent;
+
+    /* Number of decisions on the path, including this one */
+    unsigned depth;
+
+    /* Side of the fork followed by the state */
+    bool taken;
+    uint64_t pc;
+
+    /* Value chosen for a symbolic address, -1 for a plain branch */
+    uint64_t address;
+
+    S2EForkDecision(const klee::ref<S2EForkDecision> &_parent,
+                    bool _taken, uint64_t _pc, uint64_t _address);
+    ~S2EForkDecision();
+};
+
+/**
+ * A fork path flattened for replay, shared by the states
+ * that are replaying it. Each state has its own cursor.
+ */
+struct S2EForkReplay
+{
+    unsigned refCount;
+    klee::ref<S2EForkDecision> leaf;
+    std::vector<const S2EForkDecision*> decisions;
+
+    S2EForkReplay(const klee::ref<S2EForkDecision> &path);
+};
+
 class S2EExecutionState : public klee::ExecutionState
 {
 public:
 	 std::deque<bool> m_forkdecision;
-	 std::deque<bool> m_forkrecord;
-	 std::deque<bool> m_forkrecord4repaly;
-	 std::deque<uint64_t> m_forkPoints;
-	 std::deque<uint64_t> m_concreteAddress;
-	 std::deque<uint64_t> m_concreteAddress4repaly;
-    //是否正在重播，当m_forkrecord4repaly变为空时，请将其设为false
+    //是否正在重播，当重播的决定用完时，请将其设为false
     bool m_preparingstate;
     bool m_replaying;
     bool m_isskip;//ga 标识是否跳过对当前状态的处理
@@ -128,6 +192,36 @@ public:
 
     typedef std::set<std::pair<uint64_t,uint64_t> > OSPageNeedToSwap;
     OSPageNeedToSwap m_OSPageNeedToSwap;
+
+private:
+    /* Last fork decision of the state, NULL before the first fork */
+    klee::ref<S2EForkDecision> m_forkPath;
+
+    /* Path being replayed and the number of its decisions consumed.
+       When NULL, the state replays its own path. */
+    klee::ref<S2EForkReplay> m_replayPath;
+    unsigned m_replayCursor;
+
+public:
+    /** Appends a decision to the fork path of the state, in constant time */
+    void recordForkDecision(bool taken, uint64_t address = (uint64_t) -1);
+
+    const klee::ref<S2EForkDecision> &getForkPath() const {
+        return m_forkPath;
+    }
+
+    /** Replays the given path from its first decision */
+    void setReplayPath(const klee::ref<S2EForkDecision> &path);
+
+    /** Returns the next decision to replay and advances the cursor */
+    const S2EForkDecision *nextReplayDecision();
+
+    /** True when all the decisions of the replayed path were consumed */
+    bool isReplayComplete() const;
+
+    /** The next replay will start over with the path of the state */
+    void resetReplay();
+
 protected:
     friend class S2EExecutor;
 
@@ -137,6 +231,10 @@ protected:
     int m_stateID;
 
     PluginStateMap m_PluginState;
+    static PluginStateStatsMap s_pluginStateStats;
+
+    static klee::ref<S2EPluginStateRef> clonePluginState(
+            const Plugin *plugin, const PluginState *state, bool measureHeap);
 
     bool m_symbexEnabled;
 
@@ -164,6 +262,12 @@ protected:
     */
     bool m_runningConcrete;
 
+    /** Cached result of getSymbolicRegistersMask(). Only used while
+        m_runningConcrete is set, because the register object then
+        changes only through the accessors of this class. */
+    mutable uint64_t m_symbolicRegistersMask;
+    mutable bool m_symbolicRegistersMaskValid;
+
     typedef std::set<std::pair<uint64_t,uint64_t> > ToRunSymbolically;
     ToRunSymbolically m_toRunSymbolically;
 
@@ -177,8 +281,18 @@ protected:
     klee::ObjectState *m_cpuRegistersObject;
     klee::ObjectState *m_cpuSystemObject;
 
-    static klee::MemoryObject* m_dirtyMask;
-    klee::ObjectState *m_dirtyMaskObject;
+    /* The dirty mask lives in QEMU, each state keeps a copy of it split
+       in leaves of S2E_DIRTY_MASK_LEAF_SIZE bytes */
+    static std::vector<klee::MemoryObject*> m_dirtyMaskLeaves;
+    static uint64_t m_dirtyMaskAddress;
+    static uint64_t m_dirtyMaskSize;
+
+    /* Leaves modified in QEMU since the active state was restored */
+    static std::vector<bool> m_dirtyMaskWritten;
+
+    static bool isDirtyMask(const klee::MemoryObject *mo) {
+        return mo->address - m_dirtyMaskAddress < m_dirtyMaskSize;
+    }
 
     S2EDeviceState m_deviceState;
 
@@ -221,6 +335,8 @@ protected:
 
     std::string getUniqueVarName(const std::string &name);
 
+    uint64_t computeSymbolicRegistersMask() const;
+
 public:
     enum AddressType {
         VirtualAddress, PhysicalAddress, HostAddress
@@ -242,15 +358,12 @@ public:
     uint64_t getTotalInstructionCount();
     /*************************************************/
 
-    PluginState* getPluginState(Plugin *plugin, PluginStateFactory factory) {
-        PluginStateMap::iterator it = m_PluginState.find(plugin);
-        if (it == m_PluginState.end()) {
-            PluginState *ret = factory(plugin, this);
-            assert(ret);
-            m_PluginState[plugin] = ret;
-            return ret;
-        }
-        return (*it).second;
+    /** Copies the plugin state first if it is shared and writeable is set */
+    PluginState* getPluginState(Plugin *plugin, PluginStateFactory factory,
+                                bool writeable = true);
+
+    static const PluginStateStatsMap &getPluginStateStats() {
+        return s_pluginStateStats;
     }
 
     /** Returns true if this is the active state */
@@ -272,6 +385,12 @@ public:
     /** Returns a mask of registers that contains symbolic values */
     uint64_t getSymbolicRegistersMask() const;
 
+    /** Must be called when the register object is modified behind
+        the back of the accessors below */
+    void invalidateSymbolicRegistersMask() {
+        m_symbolicRegistersMaskValid = false;
+    }
+
     /** Read CPU general purpose register */
     klee::ref<klee::Expr> readCpuRegister(unsigned offset,
                                           klee::Expr::Width width) const;
@@ -85,6 +85,7 @@ uint64_t helper_set_cc_op_eflags(void);
 #include <s2e/S2EDeviceState.h>
 #include <s2e/SelectRemovalPass.h>
 #include <s2e/S2EStatsTracker.h>
+#include <s2e/LoadBalancing.h>
 
 //XXX: Remove this from executor
 #include <s2e/Plugins/ModuleExecutionDetector.h>
@@ -112,10 +113,14 @@ uint64_t helper_set_cc_op_eflags(void);
 #include <klee/CoreStats.h>
 #include <klee/TimerStatIncrementer.h>
 #include <klee/Solver.h>
+#include <klee/util/Assignment.h>
+#include <klee/util/ExprUtil.h>
+#include <klee/Internal/Support/Timer.h>
 
 #include <llvm/Support/TimeValue.h>
 
 #include <vector>
+#include <algorithm>
 
 #include <sstream>
 
@@ -191,6 +196,17 @@ namespace {
             cl::desc("Fork on each memory access with symbolic address with parallel extention"),
             cl::init(false));
 
+    cl::opt<unsigned>
+    ParalForkAddressGranularity("paral-fork-address-granularity",
+            cl::desc("Fork at most once per aligned block of this many bytes (power of two) of a symbolic"
+                     " address (1 forks on every feasible value, 4096 once per page)"),
+            cl::init(1));
+
+    cl::opt<unsigned>
+    ParalForkMaxAddresses("paral-fork-max-addresses",
+            cl::desc("Maximum number of states forked for one symbolic address (0 for unlimited)"),
+            cl::init(0));
+
     cl::opt<bool>
     ConcretizeIoAddress("concretize-io-address",
             cl::desc("Concretize symbolic I/O addresses"),
@@ -229,6 +245,23 @@ namespace {
     cl::opt<unsigned>
     ClockSlowDownFastHelpers("clock-slow-down-fast-helpers",
                    cl::desc("Slow down factor when interpreting LLVM code and using fast helpers"),  cl::init(11));
+
+    cl::opt<unsigned>
+    LoadBalancingMinStates("load-balancing-min-states",
+                   cl::desc("Minimum number of states an instance must have before it forks to share them,"
+                            " unless an idle instance requested work"),
+                   cl::init(2));
+
+    cl::opt<unsigned>
+    DedupRamInterval("dedup-ram-interval",
+                   cl::desc("Share identical guest RAM pages between states every N state switches (0 disables)"),
+                   cl::init(0));
+
+    cl::opt<std::string>
+    TbCacheDir("tb-cache-dir",
+                   cl::desc("Directory where optimized LLVM code of translation blocks is kept"
+                            " across runs (empty disables the cache)"),
+                   cl::init(""));
 }
 
 //The logs may be flooded with messages when switching execution mode.
@@ -247,6 +280,11 @@ cl::opt<bool>
 VerboseStateDeletion("verbose-state-deletion",
                cl::desc("Print detailed information on state deletion"),  cl::init(false));
 
+cl::opt<bool>
+UseSlabAllocator("s2e-slab-allocator",
+               cl::desc("Allocate KLEE memory objects and object states from size-class slabs"),
+               cl::init(true));
+
 //Concolic mode is the default because it works better than symbex.
 cl::opt<bool>
 ConcolicMode("use-concolic-execution",
@@ -437,7 +475,10 @@ void S2EExecutor::handlerTraceMemoryAccess(Executor* executor,
     assert(dynamic_cast<S2EExecutor*>(executor));
 
     S2EExecutor* s2eExecutor = static_cast<S2EExecutor*>(executor);
-    if(!s2eExecutor->m_s2e->getCorePlugin()->onDataMemoryAccess.empty()) {
+    CorePlugin *core = s2eExecutor->m_s2e->getCorePlugin();
+    if(!core->onDataMemoryAccess.empty() ||
+       !core->onSymbolicDataMemoryAccess.empty() ||
+       core->hasConcreteDataMemoryAccessListeners()) {
         assert(dynamic_cast<S2EExecutionState*>(state));
         S2EExecutionState* s2eState = static_cast<S2EExecutionState*>(state);
 
@@ -449,7 +490,23 @@ void S2EExecutor::handlerTraceMemoryAccess(Executor* executor,
 
         ref<Expr> value = klee::ExtractExpr::create(args[2], 0, width);
 
-        s2eExecutor->m_s2e->getCorePlugin()->onDataMemoryAccess.emit(
+        if (isa<klee::ConstantExpr>(args[0]) && isa<klee::ConstantExpr>(args[1]) &&
+            isa<klee::ConstantExpr>(value)) {
+            if (core->hasConcreteDataMemoryAccessListeners()) {
+                core->notifyConcreteDataMemoryAccess(s2eState,
+                        cast<klee::ConstantExpr>(args[0])->getZExtValue(),
+                        cast<klee::ConstantExpr>(args[1])->getZExtValue(),
+                        cast<klee::ConstantExpr>(value)->getZExtValue(),
+                        Expr::getMinBytesForWidth(width),
+                        (isWrite ? MEMORY_ACCESS_WRITE : 0) |
+                        (isIO ? MEMORY_ACCESS_IO : 0));
+            }
+        } else {
+            core->onSymbolicDataMemoryAccess.emit(
+                    s2eState, args[0], args[1], value, isWrite, isIO);
+        }
+
+        core->onDataMemoryAccess.emit(
                 s2eState, args[0], args[1], value, isWrite, isIO);
     }
 }
@@ -529,6 +586,75 @@ void S2EExecutor::handlerTracePortAccess(Executor* executor,
     }
 }
 
+namespace {
+    //Returns an expression that is true iff address falls into the
+    //ParalForkAddressGranularity-aligned block containing value
+    klee::ref<klee::Expr> addressBlockCondition(klee::ref<klee::Expr> address,
+                                                uint64_t value)
+    {
+        Expr::Width width = address->getWidth();
+        uint64_t granularity = ParalForkAddressGranularity;
+
+        if (granularity <= 1) {
+            return EqExpr::create(klee::ConstantExpr::create(value, width), address);
+        }
+
+        uint64_t low = value & ~(granularity - 1);
+        return AndExpr::create(
+                UleExpr::create(klee::ConstantExpr::create(low, width), address),
+                UleExpr::create(address, klee::ConstantExpr::create(low + granularity - 1, width)));
+    }
+
+    //Enumerates the feasible values of address other than the one
+    //in currentValue, one solver query per value.
+    //The block of each value found is excluded by a constraint added
+    //to a copy of the path constraints, so that each query asks for a
+    //model of the constraints in which address lies outside of all the
+    //blocks found so far, and infeasible values are never tried.
+    void enumerateAddressValues(klee::Solver *solver,
+                                const klee::ConstraintManager &constraints,
+                                klee::ref<klee::Expr> address,
+                                uint64_t currentValue,
+                                std::vector<uint64_t> &values)
+    {
+        std::vector<const klee::Array*> objects;
+        klee::findSymbolicObjects(address, objects);
+
+        klee::ConstraintManager blocked(constraints);
+
+        //getInitialValues looks for a model where the query expression is false
+        klee::ref<klee::Expr> query = klee::ConstantExpr::alloc(0, Expr::Bool);
+
+        uint64_t value = currentValue;
+        while (!ParalForkMaxAddresses || values.size() < ParalForkMaxAddresses) {
+            klee::ref<klee::Expr> outside = blocked.simplifyExpr(
+                    Expr::createIsZero(addressBlockCondition(address, value)));
+
+            if (klee::ConstantExpr *ce = dyn_cast<klee::ConstantExpr>(outside)) {
+                //The constraints confine address to the current block
+                if (ce->isFalse()) {
+                    break;
+                }
+            } else {
+                blocked.addConstraint(outside);
+            }
+
+            std::vector< std::vector<unsigned char> > model;
+            if (!solver->getInitialValues(klee::Query(blocked, query), objects, model)) {
+                break;
+            }
+
+            klee::Assignment assignment(objects, model);
+            klee::ref<klee::ConstantExpr> next =
+                    dyn_cast<klee::ConstantExpr>(assignment.evaluate(address));
+            assert(!next.isNull() && "Model does not determine the address");
+
+            value = next->getZExtValue();
+            values.push_back(value);
+        }
+    }
+}
+
 void S2EExecutor::handleForkAndConcretize(Executor* executor,
                                      ExecutionState* state,
                                      klee::KInstruction* target,
@@ -580,47 +706,34 @@ void S2EExecutor::handleForkAndConcretize(Executor* executor,
     if (!state->forkDisabled) {
     	if(g_s2e_paral_fork_on_symbolic_address){
     		if(s2eState->m_replaying){
-    				bool currentce = s2eState->m_forkrecord4repaly.front();
-    				s2eState->m_forkrecord.push_back(currentce);
-					s2eState->m_forkrecord4repaly.pop_front();
-    			   uint64_t addressAsign= 	s2eState->m_concreteAddress4repaly.front();
-					s2eState->m_concreteAddress4repaly.pop_front();
-    			   concreteAddress = klee::ConstantExpr::create(addressAsign, address->getWidth());
+    				//Follow the address chosen by the replayed path
+    				const S2EForkDecision *decision = s2eState->nextReplayDecision();
+    				assert(decision->address != (uint64_t) -1 &&
+    				       "Replayed path diverged at a symbolic address");
+    				s2eState->recordForkDecision(decision->taken, decision->address);
+
+    			   concreteAddress = klee::ConstantExpr::create(decision->address, address->getWidth());
     			   condition = EqExpr::create(concreteAddress, address);
     			   state->addConstraint(condition);
 
-    			   s2eState->m_forkPoints.push_back(s2eState->getPc());
-    				if (s2eState->m_forkrecord4repaly.size() == 0) {
+    				if (s2eState->isReplayComplete()) {
     					s2eState->m_replaying = false;
     					s2eState->m_replay2normal = true;
-    					s2eState->m_forkrecord4repaly = std::deque<bool>(
-    							s2eState->m_forkrecord);
+    					s2eState->resetReplay();
 
     					s2eState->m_allowserialize = true;
 					}
-    				if (s2eState->m_concreteAddress4repaly.size() == 0) {
-    					s2eState->m_concreteAddress4repaly = std::deque<uint64_t>(
-    					    					    							s2eState->m_concreteAddress);
-    				}
     		}else{
-				std::pair<klee::ref<klee::Expr>, klee::ref<klee::Expr> > res = s2eExecutor->getSolver()->getRange(
-										klee::Query(state->constraints, address));
-				uint64_t start = cast < klee::ConstantExpr
-						> (res.first)->getZExtValue();
-				uint64_t end = cast < klee::ConstantExpr > (res.second)->getZExtValue();
 				uint64_t currentAddress =  cast< klee::ConstantExpr> (concreteAddress)->getZExtValue();
+				std::vector<uint64_t> nextAddresses;
+				enumerateAddressValues(s2eExecutor->getSolver(), state->constraints,
+				                       address, currentAddress, nextAddresses);
 				//fprintf(stderr, "start fork symbolic address...\n");
-				for(uint64_t next = start; next <= end ; next ++){
-					if(currentAddress == next) continue;
+				foreach2(it, nextAddresses.begin(), nextAddresses.end()){
+					uint64_t next = *it;
 				     klee::ref<klee::Expr>  nextconcreteAddress = klee::ConstantExpr::create(next, address->getWidth());
 					 klee::ref<klee::Expr> conditionnext = EqExpr::create(nextconcreteAddress, address);
 					 klee::ref<klee::Expr> conditionnextnot =  klee::NotExpr::create(conditionnext);
-					klee::Query query(state->constraints,conditionnext);
-				    bool truth;
-				    bool res = s2eExecutor->getSolver()->mustBeTrue(query, truth);
-				    if (!res || truth) {
-				       continue;
-				    }
 					state->m_concreteAddressEvaluate =  currentAddress;
 					StatePair sp = executor->fork(*state, conditionnextnot, true);
 					state->m_concreteAddressEvaluate = (uint64_t) -1;
@@ -635,23 +748,13 @@ void S2EExecutor::handleForkAndConcretize(Executor* executor,
 //					    std::cout << "Condition: "  <<  conditionnext->getstring();
 
 						//nexts2eState->addConstraint(conditionnext);
-						nexts2eState->m_forkrecord.push_back(false);
-						nexts2eState->m_forkrecord4repaly=std::deque<bool>(nexts2eState->m_forkrecord);
-						nexts2eState->m_forkPoints.push_back(nexts2eState->getPc());
-
-						 nexts2eState->m_concreteAddress.push_back(next);
-						 nexts2eState->m_concreteAddress4repaly=std::deque<uint64_t>(nexts2eState->m_concreteAddress);
+						nexts2eState->recordForkDecision(false, next);
 						 s2eExecutor->bindLocal(target, *nexts2eState, nextconcreteAddress);
 					}
 				}
 				//fprintf(stderr, "end fork symbolic address...\n");
-				s2eState->m_forkrecord.push_back(true);
-				s2eState->m_forkrecord4repaly=std::deque<bool>(s2eState->m_forkrecord);
-				s2eState->m_forkPoints.push_back(s2eState->getPc());
-
+				s2eState->recordForkDecision(true, currentAddress);
 				s2eState->addConstraint(condition);
-				s2eState->m_concreteAddress.push_back(currentAddress);
-				s2eState->m_concreteAddress4repaly=std::deque<uint64_t>(s2eState->m_concreteAddress);
     		}
     		s2eExecutor->bindLocal(target, *state, concreteAddress);
     	}else{
@@ -800,7 +903,8 @@ S2EExecutor::S2EExecutor(S2E* s2e, TCGLLVMContext *tcgLLVMContext,
         : Executor(opts, ie, tcgLLVMContext->getExecutionEngine()),
           m_s2e(s2e), m_tcgLLVMContext(tcgLLVMContext),
           m_executeAlwaysKlee(false), m_forkProcTerminateCurrentState(false),
-          m_inLoadBalancing(false), yieldedState(NULL)
+          m_inLoadBalancing(false), m_stateSwitchesSinceDedup(0),
+          m_tbCache(NULL), yieldedState(NULL)
 {
     delete externalDispatcher;
     externalDispatcher = new S2EExternalDispatcher(
@@ -1097,6 +1201,27 @@ S2EExecutor::S2EExecutor(S2E* s2e, TCGLLVMContext *tcgLLVMContext,
         }
     }
 
+    if (!ParalForkAddressGranularity ||
+        (ParalForkAddressGranularity & (ParalForkAddressGranularity - 1))) {
+        s2e->getWarningsStream()
+                << ParalForkAddressGranularity.ArgStr
+                << " must be a non-zero power of two\n";
+        exit(-1);
+    }
+
+    if (DedupRamInterval) {
+        ObjectState::enableDirtyTracking();
+    }
+
+    if (!TbCacheDir.empty() && !execute_llvm) {
+        char* filename = qemu_find_file(QEMU_FILE_TYPE_LIB, "op_helper.bc");
+        uint64_t buildId = TbBitcodeCache::computeBuildId(filename);
+        g_free(filename);
+
+        m_tbCache = new TbBitcodeCache(TbCacheDir, buildId,
+                                       m_tcgLLVMContext->getModule());
+    }
+
 }
 void S2EExecutor::setParalForkOnSymbolicAddress(bool paralForkOnSymbolicAddress) {
 	g_s2e_paral_fork_on_symbolic_address = paralForkOnSymbolicAddress;
@@ -1122,6 +1247,8 @@ S2EExecutor::~S2EExecutor()
 {
     if(statsTracker)
         statsTracker->done();
+
+    delete m_tbCache;
 }
 S2EExecutionState* S2EExecutor::createInitialState()
 {
@@ -1335,28 +1462,80 @@ void S2EExecutor::registerRam(S2EExecutionState *initialState,
 
 void S2EExecutor::registerDirtyMask(S2EExecutionState *initial_state, uint64_t host_address, uint64_t size)
 {
-    //Assume that dirty mask is small enough, so no need to split it in small pages
-    assert(!initial_state->m_dirtyMask);
-    initial_state->m_dirtyMask = g_s2e->getExecutor()->addExternalObject(
-            *initial_state, (void*) host_address, size, false,
-            /* isUserSpecified = */ true, true, false);
+    //Large guests have megabytes of dirty mask. Splitting it lets forked
+    //states share the leaves they did not write to.
+    assert(S2EExecutionState::m_dirtyMaskLeaves.empty());
+
+    S2EExecutionState::m_dirtyMaskAddress = host_address;
+    S2EExecutionState::m_dirtyMaskSize = size;
 
-    initial_state->m_dirtyMask->setName("dirtyMask");
+    for (uint64_t offset = 0; offset < size;
+                  offset += S2E_DIRTY_MASK_LEAF_SIZE) {
+        uint64_t leafSize = std::min<uint64_t>(S2E_DIRTY_MASK_LEAF_SIZE,
+                                               size - offset);
 
-    m_saveOnContextSwitch.push_back(initial_state->m_dirtyMask);
+        MemoryObject *mo = addExternalObject(
+                *initial_state, (void*) (host_address + offset), leafSize,
+                false, /* isUserSpecified = */ true, true, false);
+
+        std::stringstream ss;
+        ss << "dirtyMask_" << std::hex << offset;
+        mo->setName(ss.str());
 
-    const ObjectState *dirtyMaskObject = initial_state->addressSpace
-                                .findObject(initial_state->m_dirtyMask);
+        S2EExecutionState::m_dirtyMaskLeaves.push_back(mo);
+    }
 
-    initial_state->m_dirtyMaskObject = initial_state->addressSpace
-        .getWriteable(initial_state->m_dirtyMask, dirtyMaskObject);
+    //The stores of the initial state are empty
+    S2EExecutionState::m_dirtyMaskWritten.assign(
+            S2EExecutionState::m_dirtyMaskLeaves.size(), true);
 }
 
 
+namespace {
+    /* Granularity at which saved objects are compared on state switches */
+    const unsigned StateSwitchChunkSize = 256;
+
+    /* Granularity at which the register file is compared on mode switches */
+    const unsigned RegisterChunkSize = sizeof(target_ulong);
+
+    /* Returns the offset of the first chunk that differs, or size */
+    unsigned findFirstDirtyChunk(const uint8_t *a, const uint8_t *b,
+                                 unsigned size,
+                                 unsigned chunkSize = StateSwitchChunkSize)
+    {
+        for (unsigned offset = 0; offset < size; offset += chunkSize) {
+            unsigned len = std::min(chunkSize, size - offset);
+            if (memcmp(a + offset, b + offset, len)) {
+                return offset;
+            }
+        }
+        return size;
+    }
+
+    /* Copies the chunks of src that differ from dst, returns the number
+       of bytes copied */
+    unsigned copyDirtyChunks(uint8_t *dst, const uint8_t *src, unsigned size,
+                             unsigned chunkSize = StateSwitchChunkSize)
+    {
+        unsigned copied = 0;
+        for (unsigned offset = 0; offset < size; offset += chunkSize) {
+            unsigned len = std::min(chunkSize, size - offset);
+            if (memcmp(dst + offset, src + offset, len)) {
+                memcpy(dst + offset, src + offset, len);
+                copied += len;
+            }
+        }
+        return copied;
+    }
+}
+
 void S2EExecutor::switchToConcrete(S2EExecutionState *state)
 {
     assert(!state->m_runningConcrete);
 
+    TimerStatIncrementer t(stats::switchToConcreteTime);
+    ++stats::symbolicToConcreteSwitches;
+
     /* Concretize any symbolic registers */
     ObjectState* wos = state->m_cpuRegistersObject;
     assert(wos);
@@ -1385,9 +1564,14 @@ void S2EExecutor::switchToConcrete(S2EExecutionState *state)
     }
 
     //assert(os->isAllConcrete());
-    memcpy((void*) state->m_cpuRegistersState->address,
-           wos->getConcreteStore(true), wos->size);
+    //Registers that still hold the values they had when the state last
+    //left concrete mode need not be copied
+    const ObjectState *ros = wos;
+    copyDirtyChunks((uint8_t*) state->m_cpuRegistersState->address,
+                    ros->getConcreteStore(true), wos->size,
+                    RegisterChunkSize);
     static_cast<S2EExecutionState*>(state)->m_runningConcrete = true;
+    state->invalidateSymbolicRegistersMask();
 
     if (PrintModeSwitch) {
         m_s2e->getMessagesStream(state)
@@ -1400,15 +1584,28 @@ void S2EExecutor::switchToSymbolic(S2EExecutionState *state)
 {
     assert(state->m_runningConcrete);
 
+    TimerStatIncrementer t(stats::switchToSymbolicTime);
+    ++stats::concreteToSymbolicSwitches;
+
     //assert(os && os->isAllConcrete());
 
     // TODO: check that symbolic registers were not accessed
     // in shared location ! Ideas: use hw breakpoints, or instrument
     // translated code.
 
+    //The register store may still be shared with other states after a
+    //fork, only unshare it if concrete code modified a register
     ObjectState *wos = state->m_cpuRegistersObject;
-    memcpy(wos->getConcreteStore(true),
-           (void*) state->m_cpuRegistersState->address, wos->size);
+    const ObjectState *ros = wos;
+    const uint8_t *hostRegs = (const uint8_t*) state->m_cpuRegistersState->address;
+    unsigned firstDirty = findFirstDirtyChunk(ros->getConcreteStore(true),
+                                              hostRegs, wos->size,
+                                              RegisterChunkSize);
+    if (firstDirty != wos->size) {
+        copyDirtyChunks(wos->getConcreteStore(true) + firstDirty,
+                        hostRegs + firstDirty, wos->size - firstDirty,
+                        RegisterChunkSize);
+    }
     state->m_runningConcrete = false;
 
     if (PrintModeSwitch) {
@@ -1430,17 +1627,17 @@ bool S2EExecutor::copyInConcretes(klee::ExecutionState &state)
     return true;
 }
 
+namespace {
+    struct StatePriorityComparator {
+        bool operator()(const std::pair<double, ExecutionState*> &a,
+                        const std::pair<double, ExecutionState*> &b) const {
+            return a.first > b.first;
+        }
+    };
+}
+
 void S2EExecutor::doLoadBalancing()
 {
-    if (states.size() < 2) {
-        return;
-    }
-
-    //Don't bother copying stuff if it's obvious that it'll very likely fail
-    if (m_s2e->getCurrentProcessCount() == m_s2e->getMaxProcesses()) {
-        return;
-    }
-
     std::vector<ExecutionState*> allStates;
 
     foreach2(it, states.begin(), states.end()) {
@@ -1450,10 +1647,24 @@ void S2EExecutor::doLoadBalancing()
         }
     }
 
-    if (allStates.size() < 2) {
+    m_s2e->setCurrentStateCount(allStates.size());
+
+    //Only the busiest instance hands off work, and only when
+    //there is a free process slot.
+    if (!m_s2e->shouldDonateStates(LoadBalancingMinStates)) {
         return;
     }
 
+    //Order the states by how soon the searcher would run them and deal
+    //them out alternately, so that both instances get some of the
+    //states the searcher considers most promising.
+    std::vector<std::pair<double, ExecutionState*> > byPriority;
+    foreach(ExecutionState *es, allStates) {
+        byPriority.push_back(std::make_pair(searcher->getPriority(es), es));
+    }
+    std::stable_sort(byPriority.begin(), byPriority.end(),
+                     StatePriorityComparator());
+
     g_s2e->getDebugStream() << "LoadBalancing: starting\n";
 
     m_inLoadBalancing = true;
@@ -1471,20 +1682,19 @@ void S2EExecutor::doLoadBalancing()
         return;
     }
 
-    unsigned size = allStates.size();
-    unsigned n = size / 2;
-    unsigned lower = child ? 0 : n;
-    unsigned upper = child ? n : size;
-
     m_s2e->getCorePlugin()->onProcessFork.emit(false, child, parentId);
 
     g_s2e->getDebugStream() << "LoadBalancing: terminating states\n";
 
-    for (unsigned i=lower; i<upper; ++i) {
-        S2EExecutionState *s2estate = static_cast<S2EExecutionState*>(allStates[i]);
-        terminateStateAtFork(*s2estate);
+    for (unsigned i = 0; i < byPriority.size(); ++i) {
+        if (!keepsStateAfterFork(i, child)) {
+            S2EExecutionState *s2estate = static_cast<S2EExecutionState*>(byPriority[i].second);
+            terminateStateAtFork(*s2estate);
+        }
     }
 
+    m_s2e->setCurrentStateCount(statesKeptAfterFork(byPriority.size(), child));
+
     m_s2e->getCorePlugin()->onProcessForkComplete.emit(child);
 
     m_inLoadBalancing = false;
@@ -1515,6 +1725,47 @@ void S2EExecutor::initializeStateSwitchTimer()
     qemu_mod_timer(m_stateSwitchTimer, qemu_get_clock_ms(host_clock) + 100);
 }
 
+/** Copy the dirty mask leaves written in QEMU to the state */
+void S2EExecutor::saveDirtyMask(S2EExecutionState *state)
+{
+    std::vector<bool> &written = S2EExecutionState::m_dirtyMaskWritten;
+
+    for (unsigned i = 0; i < written.size(); ++i) {
+        if (!written[i])
+            continue;
+
+        MemoryObject *mo = S2EExecutionState::m_dirtyMaskLeaves[i];
+        const ObjectState *os = state->addressSpace.findObject(mo);
+        ObjectState *wos = state->addressSpace.getWriteable(mo, os);
+        memcpy(wos->getConcreteStore(), (uint8_t*) mo->address, mo->size);
+        written[i] = false;
+    }
+}
+
+/** Load the dirty mask of newState in QEMU, which holds that of oldState */
+uint64_t S2EExecutor::restoreDirtyMask(S2EExecutionState *oldState,
+                                       S2EExecutionState *newState)
+{
+    std::vector<bool> &written = S2EExecutionState::m_dirtyMaskWritten;
+    uint64_t copied = 0;
+
+    for (unsigned i = 0; i < written.size(); ++i) {
+        MemoryObject *mo = S2EExecutionState::m_dirtyMaskLeaves[i];
+        const uint8_t *newStore =
+                newState->addressSpace.findObject(mo)->getConcreteStore();
+
+        if (oldState && !written[i] && oldState->addressSpace
+                .findObject(mo)->getConcreteStore() == newStore) {
+            continue;
+        }
+
+        copied += copyDirtyChunks((uint8_t*) mo->address, newStore, mo->size);
+        written[i] = false;
+    }
+
+    return copied;
+}
+
 void S2EExecutor::doStateSwitch(S2EExecutionState* oldState,
                                 S2EExecutionState* newState)
 {
@@ -1523,6 +1774,8 @@ void S2EExecutor::doStateSwitch(S2EExecutionState* oldState,
     assert(!newState || !newState->m_active);
     assert(!newState || !newState->m_runningConcrete);
 
+    m_s2e->getCorePlugin()->flushConcreteDataMemoryAccesses();
+
     //Some state save/restore logic in QEMU flushes the cache.
     //This can have bad effects in case of saving/restoring states
     //that were in the middle of a memory operation. Therefore,
@@ -1558,22 +1811,45 @@ void S2EExecutor::doStateSwitch(S2EExecutionState* oldState,
             if(mo == cpuMo)
                 continue;
 
+            //Objects that were not modified since they were restored
+            //must not be made writeable, this would copy them if they
+            //are shared with other states.
             const ObjectState *oldOS = oldState->addressSpace.findObject(mo);
+            const uint8_t *savedStore = oldOS->getConcreteStore();
+            assert(savedStore);
+            unsigned firstDirty = findFirstDirtyChunk(savedStore,
+                                                      (uint8_t*) mo->address,
+                                                      mo->size);
+            if (firstDirty == mo->size)
+                continue;
+
             ObjectState *oldWOS = oldState->addressSpace.getWriteable(mo, oldOS);
             uint8_t *oldStore = oldWOS->getConcreteStore();
             assert(oldStore);
-            memcpy(oldStore, (uint8_t*) mo->address, mo->size);
+            copyDirtyChunks(oldStore + firstDirty,
+                            (uint8_t*) mo->address + firstDirty,
+                            mo->size - firstDirty);
         }
 
+        saveDirtyMask(oldState);
+
         //copyInConcretes(*oldState);
         oldState->getDeviceState()->saveDeviceState();
         //oldState->m_qemuIcount = qemu_icount;
         *oldState->m_timersState = timers_state;
 
         uint8_t *oldStore = oldState->m_cpuSystemObject->getConcreteStore();
-        memcpy(oldStore, (uint8_t*) cpuMo->address, cpuMo->size);
+        copyDirtyChunks(oldStore, (uint8_t*) cpuMo->address, cpuMo->size);
 
         oldState->m_active = false;
+    } else {
+        //The devices may have run since the state that left them was saved
+        S2EDeviceState::invalidateLoadedSnapshots();
+    }
+
+    if (DedupRamInterval && ++m_stateSwitchesSinceDedup >= DedupRamInterval) {
+        deduplicateRam();
+        m_stateSwitchesSinceDedup = 0;
     }
 
     uint64_t totalCopied = 0;
@@ -1587,7 +1863,7 @@ void S2EExecutor::doStateSwitch(S2EExecutionState* oldState,
         memcpy(&jmp_env, &env->jmp_env, sizeof(jmp_buf));
 
         const uint8_t *newStore = newState->m_cpuSystemObject->getConcreteStore();
-        memcpy((uint8_t*) cpuMo->address, newStore, cpuMo->size);
+        copyDirtyChunks((uint8_t*) cpuMo->address, newStore, cpuMo->size);
 
         memcpy(&env->jmp_env, &jmp_env, sizeof(jmp_buf));
 
@@ -1598,12 +1874,21 @@ void S2EExecutor::doStateSwitch(S2EExecutionState* oldState,
             const ObjectState *newOS = newState->addressSpace.findObject(mo);
             const uint8_t *newStore = newOS->getConcreteStore();
             assert(newStore);
-            memcpy((uint8_t*) mo->address, newStore, mo->size);
 
-            totalCopied += mo->size;
+            //The host copy already holds the contents of the old state,
+            //there is nothing to do if both states share the same store.
+            if (oldState && oldState->addressSpace.findObject(mo)
+                    ->getConcreteStore() == newStore) {
+                continue;
+            }
+
+            totalCopied += copyDirtyChunks((uint8_t*) mo->address, newStore,
+                                           mo->size);
             objectsCopied++;
         }
 
+        totalCopied += restoreDirtyMask(oldState, newState);
+
         newState->m_active = true;
 
         //Devices may need to write to memory, which can be done
@@ -1642,6 +1927,52 @@ void S2EExecutor::doStateSwitch(S2EExecutionState* oldState,
     //m_s2e->getCorePlugin()->onStateSwitch.emit(oldState, newState);
 }
 
+void S2EExecutor::deduplicateRam()
+{
+    //Only the objects written (or created) since the last pass can
+    //hold new contents
+    std::vector<ObjectState*> dirty;
+    ObjectState::takeDirtyObjects(dirty);
+
+    unsigned scanned = 0;
+    uint64_t before = ObjectState::getDeduplicatedBytes();
+
+    foreach(ObjectState *os, dirty) {
+        const MemoryObject *mo = os->getObject();
+        if (!mo->isUserSpecified || mo->isSharedConcrete ||
+            mo->size != S2E_RAM_OBJECT_SIZE) {
+            continue;
+        }
+
+        //TLB entries point directly into the concrete store of the objects
+        //they map, these objects must keep their private copy. They are
+        //retried in the next pass.
+        bool pinned = false;
+        foreach(ExecutionState *es, states) {
+            if (static_cast<S2EExecutionState*>(es)->m_tlbMap.count(os)) {
+                pinned = true;
+                break;
+            }
+        }
+
+        if (pinned) {
+            os->markDirty();
+            continue;
+        }
+
+        os->deduplicate();
+        ++scanned;
+    }
+
+    if (VerboseStateSwitching) {
+        m_s2e->getDebugStream() << "Deduplicated RAM: " << scanned
+                << " objects scanned, "
+                << (ObjectState::getDeduplicatedBytes() - before)
+                << " bytes saved, "
+                << ObjectState::getDeduplicatedBytes() << " total\n";
+    }
+}
+
 ExecutionState* S2EExecutor::selectNonSpeculativeState(S2EExecutionState *state)
 {
     ExecutionState *newState;
@@ -1673,6 +2004,7 @@ ExecutionState* S2EExecutor::selectNonSpeculativeState(S2EExecutionState *state)
 
     if (!newState) {
         m_s2e->getWarningsStream() << "All states were terminated" << '\n';
+        m_s2e->requestWork();
         g_s2e->getCorePlugin()->onAllStateKilled.emit();
         foreach(S2EExecutionState* s, m_deletedStates) {
             //Leave the current state in a zombie form to let QEMU exit gracefully.
@@ -1763,7 +2095,20 @@ void S2EExecutor::prepareFunctionExecution(S2EExecutionState *state,
     } else {
 
         unsigned cIndex = kmodule->constants.size();
-        kf = kmodule->updateModuleWithFunction(function);
+
+        //Functions loaded from the TB cache are already optimized
+        bool optimize = !m_tbCacheLoaded.erase(function);
+        WallTimer timer;
+        kf = kmodule->updateModuleWithFunction(function, optimize);
+
+        std::map<Function*, TbCacheMiss>::iterator miss =
+                m_tbCacheMisses.find(function);
+        if (miss != m_tbCacheMisses.end()) {
+            miss->second.cost += timer.check();
+            m_tbCache->store(miss->second.key, function,
+                             miss->second.relocations, miss->second.cost);
+            m_tbCacheMisses.erase(miss);
+        }
 
         for(unsigned i = 0; i < kf->numInstructions; ++i)
             bindInstructionConstants(kf->instructions[i]);
@@ -2079,6 +2424,9 @@ uintptr_t S2EExecutor::executeTranslationBlock(
 
     bool executeKlee = m_executeAlwaysKlee;
 
+    //Deliver the memory accesses of the previous block
+    m_s2e->getCorePlugin()->flushConcreteDataMemoryAccesses();
+
     /* Think how can we optimize if symbex is disabled */
     if(true/* state->m_symbexEnabled*/) {
         if(state->m_startSymbexAtPC != (uint64_t) -1) {
@@ -2102,15 +2450,32 @@ uintptr_t S2EExecutor::executeTranslationBlock(
             /* We can not execute TB natively if it reads any symbolic regs */
             uint64_t smask = state->getSymbolicRegistersMask();
             if(smask || (tb->helper_accesses_mem & 4)) {
-                if((smask & tb->reg_rmask) || (smask & tb->reg_wmask)
+                if(tb->s2e_smask_link_gen && tb->s2e_smask == smask &&
+                   (tb->s2e_smask_klee ||
+                    tb->s2e_smask_link_gen == g_s2e_tb_link_generation)) {
+                    /* Same mask and no new chaining since the last check */
+                    executeKlee = tb->s2e_smask_klee;
+                    ++stats::tbSymbolicMaskCacheHits;
+
+                } else if((smask & tb->reg_rmask) || (smask & tb->reg_wmask)
                          || (tb->helper_accesses_mem & 4)) {
                     /* TB reads symbolic variables */
                     executeKlee = true;
 
+                    tb->s2e_smask = smask;
+                    tb->s2e_smask_klee = 1;
+                    tb->s2e_smask_link_gen = g_s2e_tb_link_generation;
+
                 } else {
                     s2e_tb_reset_jump_smask(tb, 0, smask);
                     s2e_tb_reset_jump_smask(tb, 1, smask);
 
+                    /* Unchaining never adds links, the summary stays valid
+                       until the next tb_add_jump() */
+                    tb->s2e_smask = smask;
+                    tb->s2e_smask_klee = 0;
+                    tb->s2e_smask_link_gen = g_s2e_tb_link_generation;
+
                     /* XXX: check whether we really have to unlink the block */
                     /*
                     tb->jmp_first = (TranslationBlock *)((intptr_t)tb | 2);
@@ -2267,6 +2632,7 @@ void S2EExecutor::notifyFork(ExecutionState &originalState, ref<Expr> &condition
     newConditions[1] = klee::NotExpr::create(condition);
 
     try {
+        m_s2e->getCorePlugin()->flushConcreteDataMemoryAccesses();
         m_s2e->getCorePlugin()->onStateFork.emit(state, newStates, newConditions);
     } catch (CpuExitException e) {
         if (state->stack.size() != 1) {
@@ -2348,9 +2714,7 @@ S2EExecutor::StatePair S2EExecutor::fork(ExecutionState &current,
 			}
 			//record forkPoints
 			S2EExecutionState* s2eState = static_cast<S2EExecutionState*>(&current);
-			s2eState->m_forkrecord.push_back(ce->isTrue());
-			s2eState->m_forkrecord4repaly=std::deque<bool>(s2eState->m_forkrecord);
-			s2eState->m_forkPoints.push_back(s2eState->getPc());
+			s2eState->recordForkDecision(ce->isTrue());
 
 			if (VerboseFork) {
 				llvm::raw_ostream& out = m_s2e->getMessagesStream(s2ecurrent);
@@ -2412,6 +2776,8 @@ void S2EExecutor::notifyBranch(ExecutionState &state)
         memcpy(store, (uint8_t*) mo->address, mo->size);
     }
 
+    saveDirtyMask(s2eState);
+
     /* Save CPU state */
     const MemoryObject* cpuMo = s2eState->m_cpuSystemState;
     uint8_t *cpuStore = s2eState->m_cpuSystemObject->getConcreteStore();
@@ -2490,6 +2856,7 @@ void S2EExecutor::terminateStateEarly(klee::ExecutionState &state, const llvm::T
 void S2EExecutor::terminateState(ExecutionState &s)
 {
     S2EExecutionState& state = static_cast<S2EExecutionState&>(s);
+    m_s2e->getCorePlugin()->flushConcreteDataMemoryAccesses();
     m_s2e->getCorePlugin()->onStateKill.emit(&state);
 
     terminateStateAtFork(state);
@@ -2552,6 +2919,7 @@ void S2EExecutor::yieldState(ExecutionState &s)
 
 void S2EExecutor::terminateStateAtFork(S2EExecutionState &state)
 {
+    m_s2e->getCorePlugin()->flushConcreteDataMemoryAccesses();
     Executor::terminateState(state);
 }
 
@@ -2696,6 +3064,10 @@ bool S2EExecutor::resumeState(S2EExecutionState *state, bool onlyAddToPtree)
 void S2EExecutor::unrefS2ETb(S2ETranslationBlock* s2e_tb)
 {
     if(s2e_tb && 0 == --s2e_tb->refCount) {
+        if(s2e_tb->llvm_function) {
+            m_tbCacheMisses.erase(s2e_tb->llvm_function);
+            m_tbCacheLoaded.erase(s2e_tb->llvm_function);
+        }
         if(s2e_tb->llvm_function && !KeepLLVMFunctions) {
             S2EExternalDispatcher *s2eDispatcher = static_cast<S2EExternalDispatcher*>(externalDispatcher);
             s2eDispatcher->removeFunction(s2e_tb->llvm_function);
@@ -2707,6 +3079,130 @@ void S2EExecutor::unrefS2ETb(S2ETranslationBlock* s2e_tb)
     }
 }
 
+/**
+ * The TCG code of the TB covers the guest code, the cpu flags and the
+ * instrumentation added by plugins. Helpers are hashed by name. Host
+ * addresses that change between runs are hashed as relocations, but
+ * only where TCG puts them: in constants loaded into temporaries (e.g.,
+ * execution signals) and in exit_tb (the TB, tagged with the exit index).
+ * A TB whose other arguments fall in a relocated range is not cached,
+ * its code could not be told apart from a relocation.
+ */
+bool S2EExecutor::computeTbCacheKey(TCGContext *s, TranslationBlock *tb,
+                                    uint64_t *key,
+                                    TbBitcodeCache::Relocations &relocations)
+{
+    typedef TbBitcodeCache::Relocation Relocation;
+
+    relocations.clear();
+    relocations.push_back(Relocation((uint64_t) tb, 4));
+    relocations.push_back(Relocation((uint64_t) &tcg_llvm_runtime,
+                                     sizeof(tcg_llvm_runtime)));
+    foreach(void* sig, tb->s2e_tb->executionSignals) {
+        relocations.push_back(Relocation((uint64_t) sig, 1));
+    }
+
+    uint64_t h = hash64(tb->pc);
+    h = hash64(tb->cs_base, h);
+    h = hash64(tb->flags, h);
+
+    const TCGArg *args = gen_opparam_buf;
+    for (const uint16_t *opc = gen_opc_buf; opc < gen_opc_ptr; ++opc) {
+        TCGOpcode c = (TCGOpcode) *opc;
+        const TCGOpDef *def = &tcg_op_defs[c];
+        h = hash64(c, h);
+
+        unsigned count;
+        if (c == INDEX_op_call) {
+            /* variable number of arguments */
+            h = hash64(*args, h);
+            count = (*args >> 16) + (*args & 0xffff) + def->nb_cargs;
+            ++args;
+        } else if (c == INDEX_op_nopn) {
+            count = *args;
+        } else {
+            count = def->nb_oargs + def->nb_iargs + def->nb_cargs;
+        }
+
+        for (unsigned i = 0; i < count; ++i) {
+            uint64_t value = args[i];
+            bool isConstant = (c == INDEX_op_movi_i64 && i == 1) ||
+                              (c == INDEX_op_movi_i32 && i == 1) ||
+                              (c == INDEX_op_exit_tb && i == 0);
+
+            if (isConstant) {
+                const char *helper = tcg_helper_get_name(s, (void*) value);
+                if (helper) {
+                    h = hash64((uint64_t) -1, h);
+                    for (; *helper; ++helper) {
+                        h = hash64(*helper, h);
+                    }
+                    continue;
+                }
+            }
+
+            uint64_t offset;
+            int r = TbBitcodeCache::findRelocation(relocations, value, &offset);
+            if (r >= 0) {
+                if (!isConstant) {
+                    return false;
+                }
+                h = hash64(r, h);
+                value = offset;
+            }
+            h = hash64(value, h);
+        }
+        args += count;
+    }
+
+    *key = h;
+    return true;
+}
+
+void S2EExecutor::generateTbFunction(TCGContext *s, TranslationBlock *tb)
+{
+    if (!m_tbCache) {
+        tcg_llvm_gen_code(tcg_llvm_ctx, s, tb);
+        return;
+    }
+
+    WallTimer timer;
+    TbBitcodeCache::Relocations relocations;
+    uint64_t key;
+    if (!computeTbCacheKey(s, tb, &key, relocations)) {
+        tcg_llvm_gen_code(tcg_llvm_ctx, s, tb);
+        return;
+    }
+
+    std::stringstream name;
+    name << "tcg-llvm-tb-cached-" << std::hex << tb->pc;
+
+    uint64_t cost;
+    Function *function = m_tbCache->load(key, relocations, name.str(), &cost);
+    if (function) {
+        tb->tcg_llvm_context = tcg_llvm_ctx;
+        tb->llvm_function = function;
+        tb->llvm_tc_ptr = 0;
+        tb->llvm_tc_end = 0;
+        m_tbCacheLoaded.insert(function);
+
+        ++stats::tbCacheHits;
+        uint64_t elapsed = timer.check();
+        if (cost > elapsed) {
+            stats::tbCacheTimeSaved += cost - elapsed;
+        }
+        return;
+    }
+
+    ++stats::tbCacheMisses;
+    tcg_llvm_gen_code(tcg_llvm_ctx, s, tb);
+
+    TbCacheMiss &miss = m_tbCacheMisses[tb->llvm_function];
+    miss.key = key;
+    miss.relocations = relocations;
+    miss.cost = timer.check();
+}
+
 void S2EExecutor::queueStateForMerge(S2EExecutionState *state)
 {
     if(dynamic_cast<MergingSearcher*>(searcher) == NULL) {
@@ -2903,6 +3399,11 @@ void s2e_tb_alloc(S2E*, TranslationBlock *tb)
     tb->s2e_tb_next[1] = 0;
 }
 
+void s2e_gen_tb_function(S2E* s2e, TCGContext *s, TranslationBlock *tb)
+{
+    s2e->getExecutor()->generateTbFunction(s, tb);
+}
+
 void s2e_set_tb_function(S2E*, TranslationBlock *tb)
 {
     tb->s2e_tb->llvm_function = tb->llvm_function;
@@ -40,9 +40,11 @@
 #include <llvm/Support/raw_ostream.h>
 #include <cpu.h>
 #include <s2e/S2EStatsTracker.h>
+#include <s2e/TbBitcodeCache.h>
 class TCGLLVMContext;
 
 struct TranslationBlock;
+struct TCGContext;
 /* struct */ CPUArchState;
 
 namespace klee {
@@ -124,6 +126,28 @@ protected:
 
     struct QEMUTimer *m_stateSwitchTimer;
 
+    /** Number of state switches since guest RAM was last deduplicated */
+    unsigned m_stateSwitchesSinceDedup;
+
+    /** Persistent cache of optimized TB functions, NULL if disabled */
+    TbBitcodeCache *m_tbCache;
+
+    /** Generated TB functions to be saved in the cache once optimized */
+    struct TbCacheMiss {
+        uint64_t key;
+        TbBitcodeCache::Relocations relocations;
+        uint64_t cost;
+    };
+    std::map<llvm::Function*, TbCacheMiss> m_tbCacheMisses;
+
+    /** TB functions loaded from the cache, already optimized */
+    std::set<llvm::Function*> m_tbCacheLoaded;
+
+    /** Returns false if the TB cannot be cached */
+    bool computeTbCacheKey(struct TCGContext *s, TranslationBlock *tb,
+                           uint64_t *key,
+                           TbBitcodeCache::Relocations &relocations);
+
     /** Holds the yielded state, if any */
     S2EExecutionState* yieldedState;
 
@@ -231,6 +255,9 @@ public:
 
     void unrefS2ETb(S2ETranslationBlock* s2e_tb);
 
+    /** Generates the LLVM function of tb or loads it from the cache */
+    void generateTbFunction(struct TCGContext *s, TranslationBlock *tb);
+
     void queueStateForMerge(S2EExecutionState *state);
 
     void initializeStatistics();
@@ -329,6 +356,13 @@ protected:
     void doStateSwitch(S2EExecutionState* oldState,
                        S2EExecutionState* newState);
 
+    /** Share identical guest RAM pages between all states */
+    void deduplicateRam();
+
+    void saveDirtyMask(S2EExecutionState *state);
+    uint64_t restoreDirtyMask(S2EExecutionState *oldState,
+                              S2EExecutionState *newState);
+
     void doStateFork(S2EExecutionState *originalState,
                         const std::vector<S2EExecutionState*>& newStates,
                         const std::vector<klee::ref<klee::Expr> >& conditions);
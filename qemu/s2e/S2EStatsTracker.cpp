@@ -38,8 +38,12 @@
 #include <s2e/S2E.h>
 #include <s2e/S2EExecutor.h>
 #include <s2e/S2EExecutionState.h>
+#include <s2e/Slab.h>
+#include <s2e/s2e_qemu.h>
 
 #include <klee/CoreStats.h>
+#include <klee/Expr.h>
+#include <klee/Memory.h>
 #include <klee/SolverStats.h>
 #include <klee/Internal/System/Time.h>
 
@@ -76,6 +80,22 @@ namespace stats {
     Statistic concreteModeTime("ConcreteModeTime", "ConcModeTime");
     Statistic symbolicModeTime("SymbolicModeTime", "SymbModeTime");
 
+    Statistic concreteToSymbolicSwitches("ConcreteToSymbolicSwitches", "C2SSwitches");
+    Statistic symbolicToConcreteSwitches("SymbolicToConcreteSwitches", "S2CSwitches");
+    Statistic switchToConcreteTime("SwitchToConcreteTime", "S2CTime");
+    Statistic switchToSymbolicTime("SwitchToSymbolicTime", "C2STime");
+    Statistic tbSymbolicMaskCacheHits("TbSymbolicMaskCacheHits", "TbSmaskHits");
+
+    Statistic deviceStateSwitches("DeviceStateSwitches", "DevSwitches");
+    Statistic deviceStateBytesCopied("DeviceStateBytesCopied", "DevBytes");
+
+    Statistic tbCacheHits("TbCacheHits", "TbCHits");
+    Statistic tbCacheMisses("TbCacheMisses", "TbCMisses");
+    Statistic tbCacheTimeSaved("TbCacheTimeSaved", "TbCSaved");
+
+    Statistic pluginStateClones("PluginStateClones", "PlgClones");
+    Statistic pluginStateCloneTime("PluginStateCloneTime", "PlgCloneTime");
+
     Statistic totalStatesNum("totalStatesNum", "NumStates");
 } // namespace stats
 } // namespace klee
@@ -169,6 +189,32 @@ void S2EStatsTracker::writeStatsHeader() {
              << "'ResolveTime',"
              << "'MemoryUsage',"
              << "'NumStates',"
+             << "'SharedCacheHits',"
+             << "'SharedCacheMisses',"
+             << "'SharedCacheEvictions',"
+             << "'SharedCacheDroppedInserts',"
+             << "'DeduplicatedBytes',"
+             << "'InternedExprs',"
+             << "'InternHits',"
+             << "'ConcreteToSymbolicSwitches',"
+             << "'SymbolicToConcreteSwitches',"
+             << "'SwitchToConcreteTime',"
+             << "'SwitchToSymbolicTime',"
+             << "'TbSymbolicMaskCacheHits',"
+             << "'DeviceStateBytesCopied',"
+             << "'DeviceStateBytesPerSwitch',"
+             << "'TbCacheHits',"
+             << "'TbCacheMisses',"
+             << "'TbCacheHitRate',"
+             << "'TbCacheTimeSaved',"
+             << "'PluginStateClones',"
+             << "'PluginStateCloneTime',";
+
+  for (unsigned i = SlabObjectAllocator::MIN_PO2; i <= SlabObjectAllocator::MAX_PO2; ++i) {
+    *statsFile << "'SlabBlocks" << (1 << i) << "',";
+  }
+
+  *statsFile << "'SlabPages',"
              << ")\n";
   statsFile->flush();
 }
@@ -201,6 +247,35 @@ void S2EStatsTracker::writeStatsLine() {
              << "," << stats::resolveTime / 1000000.
              << "," << getProcessMemoryUsage() //sys::Process::GetTotalMemoryUsage()
             << "," << stats::totalStatesNum
+             << "," << stats::sharedCacheHits
+             << "," << stats::sharedCacheMisses
+             << "," << stats::sharedCacheEvictions
+             << "," << stats::sharedCacheDroppedInserts
+             << "," << ObjectState::getDeduplicatedBytes()
+             << "," << Expr::getInternedCount()
+             << "," << Expr::getInternHits()
+             << "," << stats::concreteToSymbolicSwitches
+             << "," << stats::symbolicToConcreteSwitches
+             << "," << stats::switchToConcreteTime / 1000000.
+             << "," << stats::switchToSymbolicTime / 1000000.
+             << "," << stats::tbSymbolicMaskCacheHits
+             << "," << stats::deviceStateBytesCopied
+             << "," << (stats::deviceStateSwitches ?
+                        stats::deviceStateBytesCopied / stats::deviceStateSwitches : 0)
+             << "," << stats::tbCacheHits
+             << "," << stats::tbCacheMisses
+             << "," << (stats::tbCacheHits + stats::tbCacheMisses ?
+                        (double) stats::tbCacheHits / (stats::tbCacheHits + stats::tbCacheMisses) : 0.)
+             << "," << stats::tbCacheTimeSaved / 1000000.
+             << "," << stats::pluginStateClones
+             << "," << stats::pluginStateCloneTime / 1000000.;
+
+  const SlabObjectAllocator *allocator = g_s2e->getObjectAllocator();
+  for (unsigned i = SlabObjectAllocator::MIN_PO2; i <= SlabObjectAllocator::MAX_PO2; ++i) {
+    *statsFile << "," << (allocator ? allocator->getSlab().getAllocatedBlocksCount(i) : 0);
+  }
+
+  *statsFile << "," << (allocator ? allocator->getSlab().getPageAllocator()->getAllocatedPagesCount() : 0)
              << ")\n";
   statsFile->flush();
 }
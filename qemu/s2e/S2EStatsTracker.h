@@ -51,6 +51,22 @@ namespace stats {
 
     extern klee::Statistic concreteModeTime;
     extern klee::Statistic symbolicModeTime;
+
+    extern klee::Statistic concreteToSymbolicSwitches;
+    extern klee::Statistic symbolicToConcreteSwitches;
+    extern klee::Statistic switchToConcreteTime;
+    extern klee::Statistic switchToSymbolicTime;
+    extern klee::Statistic tbSymbolicMaskCacheHits;
+
+    extern klee::Statistic deviceStateSwitches;
+    extern klee::Statistic deviceStateBytesCopied;
+
+    extern klee::Statistic tbCacheHits;
+    extern klee::Statistic tbCacheMisses;
+    extern klee::Statistic tbCacheTimeSaved;
+
+    extern klee::Statistic pluginStateClones;
+    extern klee::Statistic pluginStateCloneTime;
 } // namespace stats
 } // namespace klee
 
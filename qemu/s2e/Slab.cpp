@@ -56,9 +56,33 @@
 namespace s2e
 {
 
-PageAllocator::PageAllocator()
+static uintptr_t regionStart(uintptr_t region)
+{
+    return region;
+}
+
+static uintptr_t regionStart(const std::pair<const uintptr_t, uintptr_t> &region)
+{
+    return region.first;
+}
+
+//Returns the start of the region containing addr, 0 if there is none
+template <typename T>
+static uintptr_t findRegion(const T &regions, uintptr_t addr)
 {
+    typename T::const_iterator it = regions.upper_bound(addr);
+    if (it == regions.begin()) {
+        return 0;
+    }
 
+    --it;
+    uintptr_t region = regionStart(*it);
+    return addr < region + REGION_SIZE ? region : 0;
+}
+
+PageAllocator::PageAllocator()
+{
+    m_allocatedPagesCount = 0;
 }
 
 PageAllocator::~PageAllocator()
@@ -80,10 +104,13 @@ uintptr_t PageAllocator::osAlloc()
 {
 #ifdef _WIN32
     return(uintptr_t) VirtualAlloc(NULL, getRegionSize(), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
-#elif defined(__APPLE__)
-    return (uintptr_t) mmap(NULL, getRegionSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
 #else
-    return (uintptr_t) mmap(NULL, getRegionSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#if defined(__APPLE__)
+    void *region = mmap(NULL, getRegionSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+#else
+    void *region = mmap(NULL, getRegionSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#endif
+    return region == MAP_FAILED ? 0 : (uintptr_t) region;
 #endif
 }
 
@@ -111,6 +138,7 @@ uintptr_t PageAllocator::allocPage()
 #endif
 
         m_regions[region] = ((uint64_t)-1) & ~1LL;
+        m_allocatedPagesCount++;
         return region;
     }
 
@@ -132,27 +160,34 @@ uintptr_t PageAllocator::allocPage()
     }
 
     uintptr_t ret = reg + index * getPageSize();
+#ifdef DEBUG_ALLOC
     memset((void*)ret, 0xAA, getPageSize());
+#endif
+    m_allocatedPagesCount++;
     return ret;
 }
 
 void PageAllocator::freePage(uintptr_t page)
 {
+#ifdef DEBUG_ALLOC
     memset((void*)page, 0xBB, getPageSize());
+#endif
+    m_allocatedPagesCount--;
 
-    RegionMap::iterator it = m_regions.find(page);
+    RegionMap::iterator it = m_regions.find(findRegion(m_regions, page));
     if (it == m_regions.end()) {
 #ifdef DEBUG_ALLOC
         std::cout << "busy size " << std::dec << m_busyRegions.size() << std::endl;
         std::cout << "freeing " << std::hex << page << std::dec << std::endl;
 #endif
 
-        RegionSet::iterator itr = m_busyRegions.find(page);
+        RegionSet::iterator itr = m_busyRegions.find(findRegion(m_busyRegions, page));
         assert(itr != m_busyRegions.end());
-        uint64_t index = (page - (*itr)) / getPageSize();
+        uintptr_t region = *itr;
+        uint64_t index = (page - region) / getPageSize();
 
-        m_busyRegions.erase(*itr);
-        m_regions[*itr] = (1LL << index);
+        m_busyRegions.erase(itr);
+        m_regions[region] = (1LL << index);
         return;
     }
 
@@ -167,36 +202,15 @@ void PageAllocator::freePage(uintptr_t page)
 #endif
 
         osFree((*it).first);
-        m_regions.erase((*it).first);
+        m_regions.erase(it);
     }
 
     return;
 }
 
-//XXX: this needs to be seriously optimized
 bool PageAllocator::belongsToUs(uintptr_t addr) const
 {
-    RegionMap::const_iterator it;
-    RegionSet::const_iterator sit;
-    bool inreg = false;
-
-    for(it = m_regions.begin(); it != m_regions.end(); ++it) {
-        uintptr_t a = (*it).first;
-        if (addr >= a && addr < a + REGION_SIZE) {
-            inreg = true;
-            break;
-        }
-    }
-
-    for(sit = m_busyRegions.begin(); sit != m_busyRegions.end(); ++sit) {
-        uintptr_t a = (*sit);
-        if (addr >= a && addr < a + REGION_SIZE) {
-            inreg = true;
-            break;
-        }
-    }
-
-    return inreg;
+    return findRegion(m_regions, addr) || findRegion(m_busyRegions, addr);
 }
 
 
@@ -211,6 +225,7 @@ BlockAllocator::BlockAllocator(PageAllocator *pa, unsigned blockSizePo2, uint8_t
     m_freePagesCount = 0;
     m_busyPagesCount = 0;
     m_freeBlocksCount = 0;
+    m_emptyPagesCount = 0;
 
     m_allocatedBlocksCount = 0;
 
@@ -240,6 +255,7 @@ uintptr_t BlockAllocator::expand()
 
     m_freePagesCount++;
     m_freeBlocksCount += m_blocksPerPage;
+    m_emptyPagesCount++;
     return newPage;
 }
 
@@ -257,6 +273,7 @@ void BlockAllocator::shrink()
     m_pa->freePage((uintptr_t)page);
     m_freePagesCount--;
     m_freeBlocksCount -= m_blocksPerPage;
+    m_emptyPagesCount--;
 }
 
 uintptr_t BlockAllocator::alloc()
@@ -291,6 +308,7 @@ uintptr_t BlockAllocator::alloc()
     if (page->freeCount == m_blocksPerPage - 1) {
         list_remove_entry(&page->link);
         list_insert_head(&m_freeList, &page->link);
+        m_emptyPagesCount--;
     }
 
     if (!page->freeCount) {
@@ -303,7 +321,9 @@ uintptr_t BlockAllocator::alloc()
     m_allocatedBlocksCount++;
 
     uintptr_t ret = ((uintptr_t)page) + sizeof(BlockAllocatorHdr) + fb * m_blockSize;
+#ifdef DEBUG_ALLOC
     memset((void*)ret, 0xEB, m_blockSize);
+#endif
     return ret;
 }
 
@@ -316,7 +336,9 @@ void BlockAllocator::free(uintptr_t b)
     assert(hdr->signature == (BLOCK_HDR_SIGNATURE | m_magic));
 
 
+#ifdef DEBUG_ALLOC
     memset((void*)b, 0xDB, m_blockSize);
+#endif
 
     unsigned index = ((b & (m_pageSize-1)) - sizeof(BlockAllocatorHdr)) / m_blockSize;
 
@@ -334,6 +356,11 @@ void BlockAllocator::free(uintptr_t b)
     if (hdr->freeCount == m_blocksPerPage) {
       list_remove_entry(&hdr->link);
       list_insert_head(&m_totallyFreeList, &hdr->link);
+
+      //Killing a state frees many pages at once, do not keep them all
+      if (++m_emptyPagesCount > MAX_EMPTY_PAGES) {
+          shrink();
+      }
     }
 
 
@@ -348,7 +375,7 @@ SlabAllocator::SlabAllocator(unsigned minPo2, unsigned maxPo2)
 
     m_pa = new PageAllocator();
 
-    m_bas = new BlockAllocator*[m_maxPo2 - m_minPo2];
+    m_bas = new BlockAllocator*[m_maxPo2 - m_minPo2 + 1];
 
     for (unsigned i=0; i<=(m_maxPo2 - m_minPo2); ++i) {
         m_bas[i] = new BlockAllocator(m_pa, i + m_minPo2, i + m_minPo2);
@@ -357,6 +384,9 @@ SlabAllocator::SlabAllocator(unsigned minPo2, unsigned maxPo2)
 
 SlabAllocator::~SlabAllocator()
 {
+    for (unsigned i=0; i<=(m_maxPo2 - m_minPo2); ++i) {
+        delete m_bas[i];
+    }
     delete [] m_bas;
     delete m_pa;
 }
@@ -382,7 +412,7 @@ BlockAllocator *SlabAllocator::getSlab(uintptr_t addr) const
 
 unsigned SlabAllocator::log(size_t size) const
 {
-    if (size  >= 4 && size <= 8) {
+    if (size  >= 1 && size <= 8) {
         return 3;
     }else if (size  >= 9 && size <= 16) {
         return 4;
@@ -424,6 +454,13 @@ bool SlabAllocator::free(uintptr_t addr)
     return true;
 }
 
+void SlabAllocator::free(uintptr_t addr, size_t size)
+{
+    unsigned i = log(size);
+    assert(i && i >= m_minPo2 && i <= m_maxPo2);
+    m_bas[i - m_minPo2]->free(addr);
+}
+
 bool SlabAllocator::isValid(uintptr_t addr) const
 {
     return getSlab(addr) != NULL;
@@ -441,81 +478,14 @@ void SlabAllocator::printStats(std::ostream &os) const
     os << "Total size:" << totalSize << std::endl;
 }
 
-static SlabAllocator *s_slab = NULL;
-
-
-void slab_print_stats(std::ostream &os)
-{
-    if (!s_slab) {
-        return;
-    }
-
-    s_slab->printStats(os);
-}
-
 }
 
-extern "C" {
-void slab_init()
-{
-    if (s2e::s_slab) {
-        return;
-    }
-
-    s2e::s_slab = new s2e::SlabAllocator(3, 8);
-}
-}
-
-static bool s_inalloc = false;
-
-void* operator new (size_t size)
-{
-    if (!s2e::s_slab || s_inalloc) {
-        void *p = malloc(size);
-        if (!p) {
-            throw new std::bad_alloc();
-        }
-        return p;
-    }
-
-    s_inalloc = true;
-    uintptr_t pr = s2e::s_slab->alloc(size);
-    if (pr) {
-        s_inalloc = false;
-        return (void*)pr;
-    }
-
-    void *p = malloc(size);
-    if (!p) {
-        throw new std::bad_alloc();
-    }
-
-    s_inalloc = false;
-
-    return p;
-}
-
-void operator delete (void *p)
-{
-    if (!s2e::s_slab) {
-        free(p);
-        return;
-    }
-
-    s_inalloc = true;
-
-    if (!s2e::s_slab->free((uintptr_t)p)) {
-        assert(!s2e::s_slab->getPageAllocator()->belongsToUs((uintptr_t)p));
-        free(p);
-    }
-
-    s_inalloc = false;
-}
-
-
-
 
 #ifdef TESTSUITE_ALLOC
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
 using namespace s2e;
 
 void testPageAllocator()
@@ -579,9 +549,81 @@ void testBlockAllocator(unsigned blockSizePo2)
 
 }
 
-void testRandom(unsigned blockSizePo2)
+//Replays the allocations of a run forking and killing states: each fork
+//copies the RAM objects, masks and object states the child writes to,
+//killing a state frees them all at once.
+void benchmarkForkKill(SlabAllocator *slab, unsigned iterations)
 {
+    static const unsigned MAX_STATES = 256;
+    static const unsigned OBJECTS_PER_FORK = 512;
+    static const size_t sizes[] = {128, 128, 128, 96, 24};
+
+    typedef std::vector<std::pair<uintptr_t, size_t> > Objects;
+    std::vector<Objects> states;
+    uint64_t forks = 0, kills = 0;
+
+    srand(0);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    for (unsigned i=0; i<iterations; ++i) {
+        bool fork = states.size() < 2 ||
+                    (states.size() < MAX_STATES && (rand() % 3) != 0);
+
+        if (fork) {
+            Objects child;
+            for (unsigned j=0; j<OBJECTS_PER_FORK; ++j) {
+                size_t size = sizes[rand() % (sizeof(sizes)/sizeof(sizes[0]))];
+                uintptr_t p = slab ? slab->alloc(size) : (uintptr_t) malloc(size);
+                assert(p);
+                memset((void*)p, j, size);
+                child.push_back(std::make_pair(p, size));
+            }
+            states.push_back(child);
+            ++forks;
+        } else {
+            unsigned victim = rand() % states.size();
+            Objects &objects = states[victim];
+            for (unsigned j=0; j<objects.size(); ++j) {
+                if (slab) {
+                    slab->free(objects[j].first, objects[j].second);
+                } else {
+                    free((void*)objects[j].first);
+                }
+            }
+            states[victim].swap(states.back());
+            states.pop_back();
+            ++kills;
+        }
+    }
+
+    gettimeofday(&end, NULL);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
 
+    double usec = (end.tv_sec - start.tv_sec) * 1000000.0 +
+                  (end.tv_usec - start.tv_usec);
+
+    std::cout << (slab ? "slab" : "malloc") << ": " << std::dec
+              << forks << " forks, " << kills << " kills, "
+              << usec / (forks + kills) << " us per fork/kill, "
+              << "max RSS " << usage.ru_maxrss << " KB" << std::endl;
+
+    if (slab) {
+        slab->printStats(std::cout);
+    }
+
+    for (unsigned i=0; i<states.size(); ++i) {
+        for (unsigned j=0; j<states[i].size(); ++j) {
+            if (slab) {
+                slab->free(states[i][j].first, states[i][j].second);
+            } else {
+                free((void*)states[i][j].first);
+            }
+        }
+    }
 }
 
 void testMalloc(unsigned blockSizePo2)
@@ -590,19 +632,17 @@ void testMalloc(unsigned blockSizePo2)
         ;
 }
 
-void test()
-{
-    uint8_t *v1 = new uint8_t;
-    uint64_t *v2 = new uint64_t;
-
-    std::cout << "Allocated v1=" << std::hex << (uintptr_t)v1 << std::dec << std::endl;
-    std::cout << "Allocated v2=" << std::hex << (uintptr_t)v2 << std::dec << std::endl;
-}
-
+//Run the slab and malloc benchmarks in separate processes to compare RSS
 int main(int argc, char **argv)
 {
+    unsigned iterations = 100000;
 
-    test();
+    if (argc > 1 && !strcmp(argv[1], "malloc")) {
+        benchmarkForkKill(NULL, iterations);
+    } else {
+        SlabAllocator slab(3, 8);
+        benchmarkForkKill(&slab, iterations);
+    }
 
 #if 0
     //testPageAllocator();
@@ -42,10 +42,13 @@
 #include <assert.h>
 #include <memory.h>
 
+#include <iosfwd>
 #include <map>
 #include <vector>
 #include <set>
 
+#include <klee/util/ObjectAllocator.h>
+
 #include "machine.h"
 
 namespace s2e
@@ -120,18 +123,14 @@ static inline list_t* list_remove_tail(list_t* list_head)
 class PageAllocator
 {
 private:
-    struct RegCmp {
-        bool operator() (uintptr_t r1, uintptr_t r2) const {
-            return r1 + REGION_SIZE <= r2;
-        }
-    };
-
-    //region offset to bitmap
-    typedef std::map<uintptr_t, uintptr_t, RegCmp> RegionMap;
-    typedef std::set<uintptr_t, RegCmp> RegionSet;
+    //region start to bitmap of free pages
+    typedef std::map<uintptr_t, uintptr_t> RegionMap;
+    typedef std::set<uintptr_t> RegionSet;
     RegionMap m_regions;
     RegionSet m_busyRegions;
 
+    uint64_t m_allocatedPagesCount;
+
 private:
     inline uintptr_t getRegionSize() const {
         return REGION_SIZE;
@@ -152,6 +151,10 @@ public:
     }
 
     bool belongsToUs(uintptr_t addr) const;
+
+    uint64_t getAllocatedPagesCount() const {
+        return m_allocatedPagesCount;
+    }
 };
 
 
@@ -220,12 +223,19 @@ struct BlockAllocatorHdr
         freeCount++;
     }
 
-}__attribute__((packed));
+};
+
+//The fields are naturally aligned, the header needs no packing.
+//Packing it would make the list links unaligned for the list functions.
+typedef char BlockAllocatorHdrSizeCheck[sizeof(BlockAllocatorHdr) == 128 ? 1 : -1];
 
 
 class BlockAllocator
 {
 private:
+    //Empty pages kept for the next allocations, the others go back to the OS
+    static const unsigned MAX_EMPTY_PAGES = 16;
+
     list_t m_totallyFreeList;
     list_t m_freeList;
     list_t m_busyList;
@@ -238,6 +248,7 @@ private:
     uint64_t m_freePagesCount;
     uint64_t m_busyPagesCount;
     uint64_t m_freeBlocksCount;
+    uint64_t m_emptyPagesCount;
 
     uint64_t m_allocatedBlocksCount;
     uint8_t m_magic;
@@ -276,8 +287,15 @@ public:
     SlabAllocator(unsigned minPo2, unsigned maxPo2);
     ~SlabAllocator();
 
+    bool handles(size_t s) const {
+        unsigned i = log(s);
+        return i && i >= m_minPo2 && i <= m_maxPo2;
+    }
+
     uintptr_t alloc(size_t s);
     bool free(uintptr_t addr);
+    //Faster than free(addr) when the size of the allocation is known
+    void free(uintptr_t addr, size_t s);
     bool isValid(uintptr_t addr) const;
 
     void printStats(std::ostream &os) const;
@@ -285,6 +303,49 @@ public:
     const PageAllocator *getPageAllocator() const {
         return m_pa;
     }
+
+    unsigned getMinPo2() const { return m_minPo2; }
+    unsigned getMaxPo2() const { return m_maxPo2; }
+
+    uint64_t getAllocatedBlocksCount(unsigned po2) const {
+        assert(po2 >= m_minPo2 && po2 <= m_maxPo2);
+        return m_bas[po2 - m_minPo2]->getAllocatedBlocksCount();
+    }
+};
+
+/**
+ * Serves the memory objects, object states, concrete stores and masks
+ * of KLEE from size-class slabs. S2E RAM objects are 128 bytes and are
+ * copied and freed on every fork and state kill, slabs keep them packed
+ * instead of scattering them over the heap.
+ */
+class SlabObjectAllocator : public klee::ObjectAllocator
+{
+private:
+    SlabAllocator m_slab;
+
+public:
+    //Blocks of 8 to 256 bytes
+    static const unsigned MIN_PO2 = 3;
+    static const unsigned MAX_PO2 = 8;
+
+    SlabObjectAllocator() : m_slab(MIN_PO2, MAX_PO2) {}
+
+    bool handles(size_t size) const {
+        return m_slab.handles(size);
+    }
+
+    void *allocate(size_t size) {
+        return (void*) m_slab.alloc(size);
+    }
+
+    void deallocate(void *p, size_t size) {
+        m_slab.free((uintptr_t) p, size);
+    }
+
+    const SlabAllocator &getSlab() const {
+        return m_slab;
+    }
 };
 
 }
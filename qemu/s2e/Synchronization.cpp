@@ -46,6 +46,15 @@
 #include <iostream>
 #include <stdlib.h>
 #include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+#ifdef CONFIG_LINUX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <time.h>
 #endif
 
 #ifdef CONFIG_DARWIN
@@ -235,4 +244,38 @@ void AtomicFunctions::write(uint64_t *address, uint64_t value)
 
 #endif
 
+void S2EProcessEvent::signal()
+{
+    __sync_fetch_and_add(&m_sequence, 1);
+
+#ifdef CONFIG_LINUX
+    //Not a private futex, the waiters are other processes
+    syscall(SYS_futex, (void*) &m_sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+void S2EProcessEvent::wait(uint32_t sequence, unsigned timeoutMs)
+{
+#ifdef CONFIG_LINUX
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000;
+
+    //Returns right away if the sequence changed already.
+    //Interruptions are fine, the caller checks its condition again.
+    syscall(SYS_futex, (void*) &m_sequence, FUTEX_WAIT, sequence,
+            timeoutMs ? &timeout : NULL, NULL, 0);
+#else
+    //No futexes here, poll the sequence
+    for (unsigned i = 0; (!timeoutMs || i < timeoutMs) &&
+                         getSequence() == sequence; ++i) {
+#ifdef CONFIG_WIN32
+        Sleep(1);
+#else
+        usleep(1000);
+#endif
+    }
+#endif
+}
+
 }
@@ -106,6 +106,34 @@ public:
 
 };
 
+/**
+ *  Lets a process sleep until another process signals it.
+ *  The event must live in memory shared by the processes,
+ *  e.g., in an S2ESynchronizedObject.
+ *
+ *  Waiters read the sequence before checking their wakeup condition
+ *  and pass it to wait(), so that a signal sent in between is not lost.
+ */
+class S2EProcessEvent {
+private:
+    volatile uint32_t m_sequence;
+
+public:
+    S2EProcessEvent() : m_sequence(0) {}
+
+    uint32_t getSequence() const {
+        __sync_synchronize();
+        return m_sequence;
+    }
+
+    //Returns once the event is signaled after getSequence() returned
+    //sequence, or after timeoutMs milliseconds unless timeoutMs is 0
+    void wait(uint32_t sequence, unsigned timeoutMs = 0);
+
+    //Wakes up all the waiters
+    void signal();
+};
+
 class AtomicFunctions {
 public:
     static uint64_t read(uint64_t *address);
@@ -0,0 +1,367 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+
+#include "TbBitcodeCache.h"
+
+#include <s2e/S2E.h>
+
+#include <llvm/Module.h>
+#include <llvm/Function.h>
+#include <llvm/GlobalVariable.h>
+#include <llvm/Constants.h>
+#include <llvm/Instructions.h>
+#include <llvm/Metadata.h>
+#include <llvm/ADT/OwningPtr.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/system_error.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace llvm;
+
+namespace s2e {
+
+/* Names used inside the cache entries */
+static const char *EntryFunctionName = "s2e.tb";
+static const char *RelocationPrefix = "s2e.tb.reloc.";
+static const char *CostMetadataName = "s2e.tb.cost";
+
+TbBitcodeCache::TbBitcodeCache(const std::string &directory, uint64_t buildId,
+                               Module *module):
+        m_module(module)
+{
+    std::stringstream ss;
+    ss << directory << "/" << std::hex << buildId;
+    m_directory = ss.str();
+
+    if ((mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST) ||
+        (mkdir(m_directory.c_str(), 0755) < 0 && errno != EEXIST)) {
+        g_s2e->getWarningsStream() << "TbBitcodeCache: could not create "
+                                   << m_directory << '\n';
+    }
+}
+
+int TbBitcodeCache::findRelocation(const Relocations &relocations,
+                                   uint64_t value, uint64_t *offset)
+{
+    for (unsigned i = 0; i < relocations.size(); ++i) {
+        uint64_t o = value - relocations[i].address;
+        if (o < relocations[i].size) {
+            *offset = o;
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint64_t TbBitcodeCache::computeBuildId(const std::string &helperBitcode)
+{
+    uint64_t id = 14695981039346656037ULL;
+
+    OwningPtr<MemoryBuffer> buffer;
+    if (!MemoryBuffer::getFile(helperBitcode, buffer)) {
+        const unsigned char *p = (const unsigned char*) buffer->getBufferStart();
+        const unsigned char *end = (const unsigned char*) buffer->getBufferEnd();
+        for (; p < end; ++p) {
+            id = (id ^ *p) * 1099511628211ULL;
+        }
+    }
+
+    /* Code generation may change without the helpers changing */
+    struct stat st;
+    if (stat("/proc/self/exe", &st) == 0) {
+        id = (id ^ (uint64_t) st.st_size) * 1099511628211ULL;
+        id = (id ^ (uint64_t) st.st_mtime) * 1099511628211ULL;
+    }
+
+    return id;
+}
+
+std::string TbBitcodeCache::getPath(uint64_t key) const
+{
+    std::stringstream ss;
+    ss << m_directory << "/" << std::hex << key << ".bc";
+    return ss.str();
+}
+
+Constant *TbBitcodeCache::relocate(Constant *c, const Relocations &relocations,
+                                   std::vector<GlobalVariable*> &symbols,
+                                   Module *module) const
+{
+    if (ConstantInt *ci = dyn_cast<ConstantInt>(c)) {
+        if (ci->getBitWidth() != 64) {
+            return c;
+        }
+
+        uint64_t offset;
+        int i = findRelocation(relocations, ci->getZExtValue(), &offset);
+        if (i < 0) {
+            return c;
+        }
+
+        if (!symbols[i]) {
+            std::stringstream ss;
+            ss << RelocationPrefix << i;
+            symbols[i] = new GlobalVariable(*module,
+                    Type::getInt8Ty(module->getContext()), false,
+                    GlobalValue::ExternalLinkage, NULL, ss.str());
+        }
+
+        return ConstantExpr::getAdd(
+                ConstantExpr::getPtrToInt(symbols[i], ci->getType()),
+                ConstantInt::get(ci->getType(), offset));
+    }
+
+    if (ConstantExpr *ce = dyn_cast<ConstantExpr>(c)) {
+        SmallVector<Constant*, 4> operands;
+        bool changed = false;
+        for (unsigned i = 0; i < ce->getNumOperands(); ++i) {
+            Constant *op = ce->getOperand(i);
+            operands.push_back(relocate(op, relocations, symbols, module));
+            changed |= operands.back() != op;
+        }
+        return changed ? ce->getWithOperands(operands) : c;
+    }
+
+    return c;
+}
+
+bool TbBitcodeCache::store(uint64_t key, Function *function,
+                           const Relocations &relocations, uint64_t cost)
+{
+    LLVMContext &context = function->getContext();
+    OwningPtr<Module> module(new Module("s2e.tb.cache", context));
+    ValueToValueMapTy vmap;
+
+    /* Declare the globals used by the function. Local globals
+       cannot be matched by name in another run. */
+    for (Function::iterator bb = function->begin(); bb != function->end(); ++bb) {
+        for (BasicBlock::iterator it = bb->begin(); it != bb->end(); ++it) {
+            for (unsigned i = 0; i < it->getNumOperands(); ++i) {
+                SmallVector<Value*, 4> worklist(1, it->getOperand(i));
+                while (!worklist.empty()) {
+                    Value *v = worklist.pop_back_val();
+                    if (ConstantExpr *ce = dyn_cast<ConstantExpr>(v)) {
+                        worklist.append(ce->op_begin(), ce->op_end());
+                        continue;
+                    }
+
+                    GlobalValue *gv = dyn_cast<GlobalValue>(v);
+                    if (!gv || vmap.count(gv)) {
+                        continue;
+                    }
+
+                    if (!gv->hasName()) {
+                        return false;
+                    }
+
+                    if (Function *f = dyn_cast<Function>(gv)) {
+                        vmap[f] = Function::Create(f->getFunctionType(),
+                                GlobalValue::ExternalLinkage, f->getName(), module.get());
+                    } else if (GlobalVariable *var = dyn_cast<GlobalVariable>(gv)) {
+                        if (var->hasLocalLinkage() && !var->isDeclaration()) {
+                            return false;
+                        }
+                        vmap[var] = new GlobalVariable(*module,
+                                var->getType()->getElementType(), var->isConstant(),
+                                GlobalValue::ExternalLinkage, NULL, var->getName());
+                    } else {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    Function *copy = Function::Create(function->getFunctionType(),
+            GlobalValue::ExternalLinkage, EntryFunctionName, module.get());
+
+    Function::arg_iterator dest = copy->arg_begin();
+    for (Function::arg_iterator arg = function->arg_begin();
+         arg != function->arg_end(); ++arg, ++dest) {
+        vmap[arg] = dest;
+    }
+
+    SmallVector<ReturnInst*, 8> returns;
+    CloneFunctionInto(copy, function, vmap, true, returns);
+
+    /* Replace host addresses with relocations */
+    std::vector<GlobalVariable*> symbols(relocations.size(), NULL);
+    for (Function::iterator bb = copy->begin(); bb != copy->end(); ++bb) {
+        for (BasicBlock::iterator it = bb->begin(); it != bb->end(); ++it) {
+            //Case values must remain plain integers
+            if (isa<SwitchInst>(it)) {
+                continue;
+            }
+
+            for (unsigned i = 0; i < it->getNumOperands(); ++i) {
+                Constant *c = dyn_cast<Constant>(it->getOperand(i));
+                if (c && !isa<GlobalValue>(c)) {
+                    Constant *r = relocate(c, relocations, symbols, module.get());
+                    if (r != c) {
+                        it->setOperand(i, r);
+                    }
+                }
+            }
+        }
+    }
+
+    Value *costValue = ConstantInt::get(Type::getInt64Ty(context), cost);
+    module->getOrInsertNamedMetadata(CostMetadataName)->addOperand(
+            MDNode::get(context, ArrayRef<Value*>(costValue)));
+
+    /* Several instances may share the directory, write
+       the entry aside and move it into place */
+    std::string path = getPath(key);
+    std::stringstream tmpPath;
+    tmpPath << path << "." << getpid();
+
+    std::string error;
+    {
+        raw_fd_ostream os(tmpPath.str().c_str(), error, raw_fd_ostream::F_Binary);
+        if (!error.empty()) {
+            g_s2e->getWarningsStream() << "TbBitcodeCache: " << error << '\n';
+            return false;
+        }
+        WriteBitcodeToFile(module.get(), os);
+    }
+
+    if (rename(tmpPath.str().c_str(), path.c_str()) < 0) {
+        unlink(tmpPath.str().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+Function *TbBitcodeCache::load(uint64_t key, const Relocations &relocations,
+                               const std::string &name, uint64_t *cost)
+{
+    OwningPtr<MemoryBuffer> buffer;
+    if (MemoryBuffer::getFile(getPath(key), buffer)) {
+        return NULL;
+    }
+
+    std::string error;
+    OwningPtr<Module> cached(ParseBitcodeFile(buffer.get(), m_module->getContext(), &error));
+    if (!cached) {
+        g_s2e->getWarningsStream() << "TbBitcodeCache: " << getPath(key)
+                                   << ": " << error << '\n';
+        return NULL;
+    }
+
+    Function *entry = cached->getFunction(EntryFunctionName);
+    if (!entry || entry->isDeclaration()) {
+        return NULL;
+    }
+
+    /* Map the declarations to the current run */
+    ValueToValueMapTy vmap;
+    size_t prefixLength = strlen(RelocationPrefix);
+
+    for (Module::global_iterator it = cached->global_begin();
+         it != cached->global_end(); ++it) {
+        std::string globalName = it->getName();
+
+        if (globalName.compare(0, prefixLength, RelocationPrefix) == 0) {
+            unsigned index = atoi(globalName.c_str() + prefixLength);
+            if (index >= relocations.size()) {
+                return NULL;
+            }
+
+            vmap[it] = ConstantExpr::getIntToPtr(
+                    ConstantInt::get(Type::getInt64Ty(m_module->getContext()),
+                                     relocations[index].address),
+                    it->getType());
+            continue;
+        }
+
+        GlobalValue *local = m_module->getNamedValue(globalName);
+        if (!local || local->getType() != it->getType()) {
+            return NULL;
+        }
+        vmap[it] = local;
+    }
+
+    for (Module::iterator it = cached->begin(); it != cached->end(); ++it) {
+        if (&*it == entry) {
+            continue;
+        }
+
+        GlobalValue *local = m_module->getNamedValue(it->getName());
+        if (!local || local->getType() != it->getType()) {
+            return NULL;
+        }
+        vmap[it] = local;
+    }
+
+    Function *function = Function::Create(entry->getFunctionType(),
+            GlobalValue::PrivateLinkage, name, m_module);
+
+    Function::arg_iterator dest = function->arg_begin();
+    for (Function::arg_iterator arg = entry->arg_begin();
+         arg != entry->arg_end(); ++arg, ++dest) {
+        vmap[arg] = dest;
+    }
+
+    SmallVector<ReturnInst*, 8> returns;
+    CloneFunctionInto(function, entry, vmap, true, returns);
+
+    *cost = 0;
+    NamedMDNode *costMd = cached->getNamedMetadata(CostMetadataName);
+    if (costMd && costMd->getNumOperands() > 0) {
+        MDNode *node = costMd->getOperand(0);
+        if (node->getNumOperands() > 0) {
+            if (ConstantInt *ci = dyn_cast_or_null<ConstantInt>(node->getOperand(0))) {
+                *cost = ci->getZExtValue();
+            }
+        }
+    }
+
+    return function;
+}
+
+}
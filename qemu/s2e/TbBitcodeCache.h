@@ -0,0 +1,117 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+
+#ifndef S2E_TB_BITCODE_CACHE_H
+#define S2E_TB_BITCODE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace llvm {
+    class Constant;
+    class Function;
+    class GlobalVariable;
+    class Module;
+}
+
+namespace s2e {
+
+/**
+ * Persistent cache of optimized translation block functions, shared by
+ * all the runs (and instances) that use the same cache directory.
+ *
+ * Each entry is a bitcode file holding one function. Host addresses that
+ * change from run to run (the translation block, its execution signals,
+ * the TCG/LLVM runtime block) are stored as relocations and patched in
+ * when the entry is loaded. Other globals are resolved by name in the
+ * current module.
+ *
+ * Entries live in a subdirectory named after the build (the helper
+ * bitcode and the S2E binary), since entries inline helper code.
+ */
+class TbBitcodeCache
+{
+public:
+    /* Run-specific host range. Values in [address, address + size)
+       are relocated. */
+    struct Relocation {
+        uint64_t address;
+        uint64_t size;
+
+        Relocation(uint64_t _address, uint64_t _size):
+            address(_address), size(_size) {}
+    };
+
+    typedef std::vector<Relocation> Relocations;
+
+    /** Returns the index of the relocation that covers value, or -1 */
+    static int findRelocation(const Relocations &relocations,
+                              uint64_t value, uint64_t *offset);
+
+    /** Identifies the helper bitcode and the binary that use the cache */
+    static uint64_t computeBuildId(const std::string &helperBitcode);
+
+private:
+    std::string m_directory;
+    llvm::Module *m_module;
+
+    std::string getPath(uint64_t key) const;
+
+    llvm::Constant *relocate(llvm::Constant *c, const Relocations &relocations,
+                             std::vector<llvm::GlobalVariable*> &symbols,
+                             llvm::Module *module) const;
+
+public:
+    TbBitcodeCache(const std::string &directory, uint64_t buildId,
+                   llvm::Module *module);
+
+    /**
+     * Returns a new function in the module built from the entry,
+     * or NULL if there is no usable entry. The cost is the time in
+     * microseconds that it took to produce the cached function.
+     */
+    llvm::Function *load(uint64_t key, const Relocations &relocations,
+                         const std::string &name, uint64_t *cost);
+
+    /** Saves an optimized function, overwriting any previous entry */
+    bool store(uint64_t key, llvm::Function *function,
+               const Relocations &relocations, uint64_t cost);
+};
+
+}
+
+#endif
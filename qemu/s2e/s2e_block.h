@@ -55,6 +55,9 @@ int s2e_bdrv_write(struct BlockDriverState *bs, int64_t sector_num,
                    const uint8_t *buf, int nb_sectors);
 
 
+/* Copies the sectors of the range that were written in the current
+   state into buf and returns how many there were. The other sectors
+   of buf are left untouched. */
 extern int (*__hook_bdrv_read)(
                   struct BlockDriverState *bs, int64_t sector_num,
                   uint8_t *buf, int nb_sectors);
@@ -60,6 +60,12 @@
 
 #define S2E_MEMCACHE_SUPERPAGE_BITS 20
 
+/** The dirty mask (one byte per guest page) is split in leaves of this many
+    bytes. Forked states share the leaves, a leaf is copied when a state
+    that wrote to it is saved. */
+#define S2E_DIRTY_MASK_LEAF_BITS 10
+#define S2E_DIRTY_MASK_LEAF_SIZE (1 << S2E_DIRTY_MASK_LEAF_BITS)
+
 /** Enables simple memory debugging support */
 //#define S2E_DEBUG_MEMORY
 //#define S2E_DEBUG_TLBCACHE
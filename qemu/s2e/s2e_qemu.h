@@ -56,6 +56,7 @@ struct S2ETranslationBlock;
 
 struct TranslationBlock;
 struct TCGLLVMContext;
+struct TCGContext;
 struct S2ETLBEntry;
 struct QDict;
 
@@ -260,6 +261,11 @@ void s2e_tb_alloc(struct S2E* s2e, struct TranslationBlock *tb);
 /** Free S2E parts of the translation block. Called from tb_flush() and tb_free() */
 void s2e_tb_free(struct S2E* s2e, struct TranslationBlock *tb);
 
+/** Generates the LLVM function of the TB from the TCG code in s,
+    or loads it from the translation block cache */
+void s2e_gen_tb_function(struct S2E* s2e, struct TCGContext *s,
+                         struct TranslationBlock *tb);
+
 /** Called after LLVM code generation
     in order to update tb->s2e_tb->llvm_function */
 void s2e_set_tb_function(struct S2E* s2e, struct TranslationBlock *tb);
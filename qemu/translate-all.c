@@ -115,6 +115,9 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
 #ifdef CONFIG_S2E
     tcg_calc_regmask(s, &tb->reg_rmask, &tb->reg_wmask,
                      &tb->helper_accesses_mem);
+    tb->s2e_smask = 0;
+    tb->s2e_smask_link_gen = 0;
+    tb->s2e_smask_klee = 0;
 #endif
 
 #if defined(CONFIG_LLVM)
@@ -236,7 +239,7 @@ int cpu_gen_llvm(CPUArchState *env, TranslationBlock *tb)
 
     tcg_func_start(s);
     gen_intermediate_code_pc(env, tb);
-    tcg_llvm_gen_code(tcg_llvm_ctx, s, tb);
+    s2e_gen_tb_function(g_s2e, s, tb);
     s2e_set_tb_function(g_s2e, tb);
 
     if(qemu_loglevel_mask(CPU_LOG_LLVM_ASM) && tb->llvm_tc_ptr) {
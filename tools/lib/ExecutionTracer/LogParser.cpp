@@ -35,8 +35,12 @@
 
 #include <iostream>
 #include <cassert>
+#include <string.h>
+#include <sys/stat.h>
 #include "LogParser.h"
 
+#include <s2e/Plugins/ExecutionTracers/TraceCompression.h>
+
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -45,6 +49,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 
 
@@ -89,6 +94,8 @@ LogParser::LogParser():LogEvents()
 {
     m_cachedProcessor = NULL;
     m_cachedState = NULL;
+    m_cachedBlock = NULL;
+    m_writeIndex = false;
 }
 
 LogParser::~LogParser()
@@ -96,16 +103,7 @@ LogParser::~LogParser()
 
     LogFiles::iterator it;
     for(it=m_files.begin(); it != m_files.end(); ++it) {
-        LogFile &file = *it;
-        #ifdef _WIN32
-        UnmapViewOfFile(file.m_File);
-        CloseHandle(file.m_hMapping);
-        CloseHandle(file.m_hFile);
-        #else
-        if (file.m_File) {
-            munmap(file.m_File, file.m_size);
-        }
-        #endif
+        unmapFile(*it);
     }
 }
 
@@ -123,9 +121,37 @@ bool LogParser::parse(const std::vector<std::string> fileNames)
 
 
 bool LogParser::parse(const std::string &fileName)
+{
+    return parse(fileName, true, 0);
+}
+
+bool LogParser::parseState(const std::string &fileName, uint32_t stateId)
+{
+    return parse(fileName, false, stateId);
+}
+
+bool LogParser::parse(const std::string &fileName, bool allStates, uint32_t stateId)
 {
     LogFile element;
 
+    if (!mapFile(fileName, element)) {
+        return false;
+    }
+
+    bool ret;
+    if (element.m_size >= sizeof(ExecutionTraceFileHeader) &&
+        !memcmp(element.m_File, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC))) {
+        ret = parseBlocks(element, allStates, stateId);
+    } else {
+        ret = parseItems(fileName, element, allStates, stateId);
+    }
+
+    m_files.push_back(element);
+    return ret;
+}
+
+bool LogParser::mapFile(const std::string &fileName, LogFile &element)
+{
 #ifdef _WIN32
     element.m_hFile = CreateFile(fileName.c_str(), GENERIC_READ,
                               FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
@@ -179,50 +205,307 @@ bool LogParser::parse(const std::string &fileName)
 
 #endif
 
+    return true;
+}
 
-    uint64_t currentOffset = 0;
-    unsigned currentItem = m_ItemAddresses.size();
+void LogParser::unmapFile(LogFile &element)
+{
+    #ifdef _WIN32
+    UnmapViewOfFile(element.m_File);
+    CloseHandle(element.m_hMapping);
+    CloseHandle(element.m_hFile);
+    #else
+    if (element.m_File) {
+        munmap(element.m_File, element.m_size);
+    }
+    #endif
+}
+
+bool LogParser::parseItems(const std::string &fileName, LogFile &element,
+                           bool allStates, uint32_t stateId)
+{
+    LogIndex index;
+    bool complete = getIndex(fileName, element, index);
 
-    uint8_t *buffer = (uint8_t*)element.m_File;
+    unsigned currentItem = m_ItemAddresses.size();
+    uint8_t *base = (uint8_t*)element.m_File;
 
-    while(currentOffset < element.m_size) {
+    for (LogIndex::const_iterator it = index.begin(); it != index.end(); ++it) {
+        if (!allStates && (*it).stateId != stateId) {
+            continue;
+        }
 
+        uint8_t *buffer = base + (*it).offset;
         s2e::plugins::ExecutionTraceItemHeader *hdr =
                 (s2e::plugins::ExecutionTraceItemHeader *)(buffer);
 
-        if (currentOffset + sizeof(s2e::plugins::ExecutionTraceItemHeader) > element.m_size) {
+        processItem(currentItem, *hdr, buffer + sizeof(*hdr));
+
+        ItemLocation location;
+        location.address = buffer;
+        location.offset = NOT_IN_BLOCK;
+        m_ItemAddresses.push_back(location);
+        ++currentItem;
+    }
+
+    return complete;
+}
+
+//Walks the item headers, stops at the first incomplete item
+bool LogParser::buildIndex(const LogFile &element, LogIndex &index)
+{
+    uint64_t currentOffset = 0;
+    const uint8_t *base = (const uint8_t*)element.m_File;
+
+    while(currentOffset < element.m_size) {
+        const s2e::plugins::ExecutionTraceItemHeader *hdr =
+                (const s2e::plugins::ExecutionTraceItemHeader *)(base + currentOffset);
+
+        if (currentOffset + sizeof(*hdr) > element.m_size) {
             std::cerr << "LogParser: Could not read header " << std::endl;
             return false;
         }
 
-        buffer += sizeof(*hdr);
-
-        if (hdr->size > 0) {
-            if (currentOffset + hdr->size > element.m_size) {
-                std::cerr << "LogParser: Could not read payload " << std::endl;
-                return false;
-            }
+        if (currentOffset + sizeof(*hdr) + hdr->size > element.m_size) {
+            std::cerr << "LogParser: Could not read payload " << std::endl;
+            return false;
         }
 
 #ifdef DEBUG_PB
-        std::cout << fileName <<  " item=" << currentItem << " buffer="   << (void*)buffer <<
-                     " ts=" << hdr->timeStamp <<  " offset=" << currentOffset << std::endl;
+        std::cout << "item=" << index.size() << " ts=" << hdr->timeStamp <<
+                     " offset=" << currentOffset << std::endl;
 #endif
-        processItem(currentItem, *hdr, buffer);
-        buffer+=hdr->size;
 
-        m_ItemAddresses.push_back(currentOffset + (uint8_t*)element.m_File);
+        LogIndexEntry entry;
+        entry.offset = currentOffset;
+        entry.stateId = hdr->stateId;
+        entry.type = hdr->type;
+        index.push_back(entry);
 
-        currentOffset += sizeof(s2e::plugins::ExecutionTraceItemHeader)  + hdr->size;
+        currentOffset += sizeof(*hdr) + hdr->size;
+    }
 
-        ++currentItem;
+    return true;
+}
+
+namespace {
+    struct LogIndexHeader {
+        char magic[8];
+        uint64_t traceSize;
+        uint64_t traceTime;
+        uint64_t itemCount;
+    }__attribute__((packed));
+
+    const char LogIndexMagic[8] = "S2EIDX1";
+
+    uint64_t getModificationTime(const std::string &fileName)
+    {
+        struct stat st;
+        if (stat(fileName.c_str(), &st) < 0) {
+            return 0;
+        }
+        return st.st_mtime;
+    }
+}
+
+bool LogParser::loadIndex(const std::string &fileName, const LogFile &element, LogIndex &index)
+{
+    std::string indexName = fileName + ".idx";
+    FILE *fp = fopen(indexName.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    LogIndexHeader hdr;
+    bool ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+              !memcmp(hdr.magic, LogIndexMagic, sizeof(LogIndexMagic)) &&
+              hdr.traceSize == element.m_size &&
+              hdr.traceTime == getModificationTime(fileName);
+
+    if (ok) {
+        index.resize(hdr.itemCount);
+        if (hdr.itemCount) {
+            ok = fread(&index[0], sizeof(index[0]), hdr.itemCount, fp) == hdr.itemCount;
+        }
+    }
+
+    fclose(fp);
+
+    if (!ok) {
+        std::cerr << "LogParser: Ignoring stale index " << indexName << std::endl;
+        index.clear();
+    }
+    return ok;
+}
+
+//The index is only a cache, failing to write it is not an error
+void LogParser::saveIndex(const std::string &fileName, const LogFile &element, const LogIndex &index)
+{
+    std::string indexName = fileName + ".idx";
+
+    //Readers must never see a partial index
+    std::string tmpName = indexName + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "LogParser: Could not write index " << indexName << std::endl;
+        return;
+    }
+
+    LogIndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LogIndexMagic, sizeof(LogIndexMagic));
+    hdr.traceSize = element.m_size;
+    hdr.traceTime = getModificationTime(fileName);
+    hdr.itemCount = index.size();
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    if (ok && !index.empty()) {
+        ok = fwrite(&index[0], sizeof(index[0]), index.size(), fp) == index.size();
+    }
+
+    ok = fclose(fp) == 0 && ok;
+
+    if (!ok || rename(tmpName.c_str(), indexName.c_str()) < 0) {
+        std::cerr << "LogParser: Could not write index " << indexName << std::endl;
+        unlink(tmpName.c_str());
+    }
+}
+
+//Returns false if the trace is incomplete, the index then covers
+//the complete items only and is not cached.
+bool LogParser::getIndex(const std::string &fileName, const LogFile &element, LogIndex &index)
+{
+    if (loadIndex(fileName, element, index)) {
+        return true;
+    }
+
+    if (!buildIndex(element, index)) {
+        return false;
+    }
+
+    if (m_writeIndex) {
+        saveIndex(fileName, element, index);
+    }
+    return true;
+}
+
+bool LogParser::getBlockOffsets(const LogFile &element, bool allStates, uint32_t stateId,
+                                std::vector<uint64_t> &offsets)
+{
+    const uint8_t *base = (const uint8_t*)element.m_File;
+
+    //Use the index if the trace was closed properly
+    if (element.m_size >= sizeof(ExecutionTraceFileHeader) + sizeof(ExecutionTraceFileFooter)) {
+        const ExecutionTraceFileFooter *footer = (const ExecutionTraceFileFooter*)
+                (base + element.m_size - sizeof(ExecutionTraceFileFooter));
+
+        if (footer->magic == TRACE_INDEX_MAGIC &&
+            footer->indexOffset + (uint64_t) footer->blockCount * sizeof(ExecutionTraceIndexEntry) +
+            sizeof(ExecutionTraceFileFooter) == element.m_size) {
+
+            const ExecutionTraceIndexEntry *index = (const ExecutionTraceIndexEntry*)
+                    (base + footer->indexOffset);
+
+            for (unsigned i = 0; i < footer->blockCount; ++i) {
+                if (allStates || index[i].stateId == stateId) {
+                    offsets.push_back(index[i].offset);
+                }
+            }
+            return true;
+        }
+    }
+
+    //Otherwise walk the block headers, skipping the payloads
+    uint64_t currentOffset = sizeof(ExecutionTraceFileHeader);
+    while (currentOffset < element.m_size) {
+        const ExecutionTraceBlockHeader *hdr = (const ExecutionTraceBlockHeader*)
+                (base + currentOffset);
+
+        if (currentOffset + sizeof(*hdr) > element.m_size ||
+            hdr->magic != TRACE_BLOCK_MAGIC ||
+            currentOffset + sizeof(*hdr) + hdr->compressedSize > element.m_size) {
+            std::cerr << "LogParser: Could not read block " << std::endl;
+            return false;
+        }
+
+        if (allStates || hdr->stateId == stateId) {
+            offsets.push_back(currentOffset);
+        }
+
+        currentOffset += sizeof(*hdr) + hdr->compressedSize;
+    }
+
+    return true;
+}
+
+//Decompresses and decodes the items of a block. Items never span blocks.
+bool LogParser::decodeBlock(const ExecutionTraceBlockHeader *hdr,
+                            std::vector<uint8_t> &raw, std::vector<uint8_t> &items)
+{
+    const uint8_t *data = (const uint8_t*)(hdr + 1);
+    if (hdr->compressedSize != hdr->rawSize) {
+        raw.resize(hdr->rawSize);
+        if (!traceDecompress(data, hdr->compressedSize, &raw[0], hdr->rawSize)) {
+            std::cerr << "LogParser: Could not decompress block " << std::endl;
+            return false;
+        }
+        data = &raw[0];
+    }
+
+    items.clear();
+    if (!traceDecodeBlock(*hdr, data, items)) {
+        std::cerr << "LogParser: Could not decode block " << std::endl;
+        return false;
     }
 
-    m_files.push_back(element);
-    //fclose(file);
     return true;
 }
 
+//Blocks are processed one at a time, only their location is kept
+bool LogParser::parseBlocks(LogFile &element, bool allStates, uint32_t stateId)
+{
+    std::vector<uint64_t> offsets;
+    bool complete = getBlockOffsets(element, allStates, stateId, offsets);
+
+    uint8_t *base = (uint8_t*)element.m_File;
+    unsigned currentItem = m_ItemAddresses.size();
+    std::vector<uint8_t> raw, items;
+
+    for (unsigned i = 0; i < offsets.size(); ++i) {
+        const ExecutionTraceBlockHeader *hdr = (const ExecutionTraceBlockHeader*)
+                (base + offsets[i]);
+
+        if (offsets[i] + sizeof(*hdr) > element.m_size ||
+            hdr->magic != TRACE_BLOCK_MAGIC ||
+            offsets[i] + sizeof(*hdr) + hdr->compressedSize > element.m_size) {
+            std::cerr << "LogParser: Could not read block " << std::endl;
+            return false;
+        }
+
+        if (!decodeBlock(hdr, raw, items)) {
+            return false;
+        }
+
+        uint32_t offset = 0;
+        for (unsigned j = 0; j < hdr->itemCount; ++j) {
+            s2e::plugins::ExecutionTraceItemHeader *item =
+                    (s2e::plugins::ExecutionTraceItemHeader *)(&items[offset]);
+
+            processItem(currentItem, *item, &items[offset] + sizeof(*item));
+
+            ItemLocation location;
+            location.address = base + offsets[i];
+            location.offset = offset;
+            m_ItemAddresses.push_back(location);
+
+            offset += sizeof(*item) + item->size;
+            ++currentItem;
+        }
+    }
+
+    return complete;
+}
+
 bool LogParser::getItem(unsigned index, s2e::plugins::ExecutionTraceItemHeader &hdr, void **data)
 {
     if (index >= m_ItemAddresses.size() ) {
@@ -230,7 +513,23 @@ bool LogParser::getItem(unsigned index, s2e::plugins::ExecutionTraceItemHeader &
         return false;
     }
 
-    uint8_t *buffer = m_ItemAddresses[index];
+    const ItemLocation &location = m_ItemAddresses[index];
+    uint8_t *buffer = location.address;
+
+    if (location.offset != NOT_IN_BLOCK) {
+        //Items of a path are mostly read block after block
+        if (m_cachedBlock != location.address) {
+            std::vector<uint8_t> raw;
+            m_cachedBlock = NULL;
+            if (!decodeBlock((const ExecutionTraceBlockHeader*)location.address,
+                             raw, m_cachedBlockItems)) {
+                return false;
+            }
+            m_cachedBlock = location.address;
+        }
+        buffer = &m_cachedBlockItems[location.offset];
+    }
+
     hdr = *(s2e::plugins::ExecutionTraceItemHeader*)buffer;
 
     *data = NULL;
@@ -241,6 +540,162 @@ bool LogParser::getItem(unsigned index, s2e::plugins::ExecutionTraceItemHeader &
     return true;
 }
 
+namespace {
+    struct ParallelParseTask {
+        const uint8_t *base;
+        const LogIndex *index;
+        const std::vector<uint64_t> *blocks;
+        const std::vector<unsigned> *blockFirstItem;
+        unsigned thread;
+        unsigned threads;
+        ParallelItemProcessor *processor;
+        bool ok;
+    };
+}
+
+void *LogParser::parallelParseThread(void *opaque)
+{
+    ParallelParseTask *task = static_cast<ParallelParseTask*>(opaque);
+    const uint8_t *base = task->base;
+
+    if (task->index) {
+        const LogIndex &index = *task->index;
+        for (unsigned i = 0; i < index.size(); ++i) {
+            if (index[i].stateId % task->threads != task->thread) {
+                continue;
+            }
+
+            uint8_t *buffer = (uint8_t*)base + index[i].offset;
+            s2e::plugins::ExecutionTraceItemHeader *hdr =
+                    (s2e::plugins::ExecutionTraceItemHeader *)(buffer);
+            task->processor->onItem(i, *hdr, buffer + sizeof(*hdr));
+        }
+        return NULL;
+    }
+
+    std::vector<uint8_t> raw, items;
+    const std::vector<uint64_t> &blocks = *task->blocks;
+
+    for (unsigned i = 0; i < blocks.size(); ++i) {
+        const ExecutionTraceBlockHeader *hdr = (const ExecutionTraceBlockHeader*)
+                (base + blocks[i]);
+
+        if (hdr->stateId % task->threads != task->thread) {
+            continue;
+        }
+
+        if (!decodeBlock(hdr, raw, items)) {
+            task->ok = false;
+            return NULL;
+        }
+
+        uint8_t *buffer = &items[0];
+        unsigned currentItem = (*task->blockFirstItem)[i];
+        for (unsigned j = 0; j < hdr->itemCount; ++j) {
+            s2e::plugins::ExecutionTraceItemHeader *item =
+                    (s2e::plugins::ExecutionTraceItemHeader *)(buffer);
+            task->processor->onItem(currentItem++, *item, buffer + sizeof(*item));
+            buffer += sizeof(*item) + item->size;
+        }
+    }
+
+    return NULL;
+}
+
+bool LogParser::parallelParse(const std::string &fileName, ParallelItemProcessor &processor,
+                              unsigned threads)
+{
+    LogFile element;
+
+    if (!mapFile(fileName, element)) {
+        return false;
+    }
+
+#ifdef _WIN32
+    threads = 1;
+#endif
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    bool complete;
+    LogIndex index;
+    std::vector<uint64_t> blocks;
+    std::vector<unsigned> blockFirstItem;
+
+    bool blockStructured = element.m_size >= sizeof(ExecutionTraceFileHeader) &&
+            !memcmp(element.m_File, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC));
+
+    if (blockStructured) {
+        complete = getBlockOffsets(element, true, 0, blocks);
+
+        //Number the items as a sequential parse would
+        unsigned itemCount = 0;
+        for (unsigned i = 0; i < blocks.size(); ++i) {
+            const ExecutionTraceBlockHeader *hdr = (const ExecutionTraceBlockHeader*)
+                    ((const uint8_t*)element.m_File + blocks[i]);
+            if (blocks[i] + sizeof(*hdr) > element.m_size || hdr->magic != TRACE_BLOCK_MAGIC ||
+                blocks[i] + sizeof(*hdr) + hdr->compressedSize > element.m_size) {
+                std::cerr << "LogParser: Could not read block " << std::endl;
+                blocks.resize(i);
+                complete = false;
+                break;
+            }
+            blockFirstItem.push_back(itemCount);
+            itemCount += hdr->itemCount;
+        }
+    } else {
+        complete = getIndex(fileName, element, index);
+    }
+
+    std::vector<ParallelParseTask> tasks(threads);
+    for (unsigned i = 0; i < threads; ++i) {
+        ParallelParseTask &task = tasks[i];
+        task.base = (const uint8_t*)element.m_File;
+        task.index = blockStructured ? NULL : &index;
+        task.blocks = &blocks;
+        task.blockFirstItem = &blockFirstItem;
+        task.thread = i;
+        task.threads = threads;
+        task.processor = i == 0 ? &processor : processor.clone();
+        task.ok = true;
+    }
+
+#ifdef _WIN32
+    parallelParseThread(&tasks[0]);
+#else
+    std::vector<pthread_t> workers(threads);
+    for (unsigned i = 1; i < threads; ++i) {
+        if (pthread_create(&workers[i], NULL, parallelParseThread, &tasks[i])) {
+            std::cerr << "LogParser: Could not create parsing thread" << std::endl;
+            exit(-1);
+        }
+    }
+
+    //The calling thread handles the first partition
+    parallelParseThread(&tasks[0]);
+
+    for (unsigned i = 1; i < threads; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+#endif
+
+    for (unsigned i = 0; i < threads; ++i) {
+        if (!tasks[i].ok) {
+            std::cerr << "LogParser: Could not decode block " << std::endl;
+            complete = false;
+        }
+
+        if (i > 0) {
+            processor.merge(tasks[i].processor);
+            delete tasks[i].processor;
+        }
+    }
+
+    unmapFile(element);
+    return complete;
+}
+
 ItemProcessorState* LogParser::getState(void *processor, ItemProcessorStateFactory f)
 {
     if (processor == m_cachedProcessor) {
@@ -69,6 +69,36 @@ typedef std::set<uint32_t> PathSet;
 
 typedef ItemProcessorState* (*ItemProcessorStateFactory)();
 
+/**
+ *  Trace processors that can run on several threads at once.
+ *  LogParser::parallelParse gives each thread its own clone. A clone sees
+ *  all the items of the states assigned to its thread, in trace order,
+ *  and is merged back into the original processor at the end.
+ *  Item payloads are only valid during the onItem call.
+ */
+class ParallelItemProcessor
+{
+public:
+    virtual ~ParallelItemProcessor() {};
+    virtual ParallelItemProcessor *clone() const = 0;
+    virtual void onItem(unsigned traceIndex,
+                        const s2e::plugins::ExecutionTraceItemHeader &hdr,
+                        void *data) = 0;
+    virtual void merge(const ParallelItemProcessor *other) = 0;
+};
+
+/**
+ *  Entry of the side index cached next to version 1 traces
+ *  (in <trace>.idx), one per item.
+ */
+struct LogIndexEntry {
+    uint64_t offset;
+    uint32_t stateId;
+    uint8_t type;
+}__attribute__((packed));
+
+typedef std::vector<LogIndexEntry> LogIndex;
+
 class LogEvents
 {
 public:
@@ -118,13 +148,48 @@ private:
 
     typedef std::vector<LogFile> LogFiles;
 
+    static const uint32_t NOT_IN_BLOCK = (uint32_t) -1;
+
+    //Items of version 1 traces are read in place. Those of version 2
+    //traces are found by decoding their block again.
+    struct ItemLocation {
+        //The item, or the header of its block in the mapped file
+        uint8_t *address;
+        //Offset of the item in the decoded block
+        uint32_t offset;
+    };
+
     LogFiles m_files;
-    std::vector<uint8_t*> m_ItemAddresses;
+    std::vector<ItemLocation> m_ItemAddresses;
+
+    //Last block decoded by getItem()
+    const uint8_t *m_cachedBlock;
+    std::vector<uint8_t> m_cachedBlockItems;
 
     ItemProcessors m_ItemProcessors;
     void *m_cachedProcessor;
     ItemProcessorState* m_cachedState;
 
+    bool m_writeIndex;
+
+    bool mapFile(const std::string &fileName, LogFile &element);
+    void unmapFile(LogFile &element);
+    bool parse(const std::string &fileName, bool allStates, uint32_t stateId);
+    bool parseItems(const std::string &fileName, LogFile &element,
+                    bool allStates, uint32_t stateId);
+    bool parseBlocks(LogFile &element, bool allStates, uint32_t stateId);
+    static bool decodeBlock(const s2e::plugins::ExecutionTraceBlockHeader *hdr,
+                            std::vector<uint8_t> &raw, std::vector<uint8_t> &items);
+    bool getBlockOffsets(const LogFile &element, bool allStates, uint32_t stateId,
+                         std::vector<uint64_t> &offsets);
+
+    bool buildIndex(const LogFile &element, LogIndex &index);
+    bool loadIndex(const std::string &fileName, const LogFile &element, LogIndex &index);
+    void saveIndex(const std::string &fileName, const LogFile &element, const LogIndex &index);
+    bool getIndex(const std::string &fileName, const LogFile &element, LogIndex &index);
+
+    static void *parallelParseThread(void *opaque);
+
 protected:
 
 
@@ -132,8 +197,37 @@ public:
     LogParser();
     virtual ~LogParser();
 
+    /**
+     * Write the side index of version 1 traces next to them (in
+     * <trace>.idx) so that later runs do not walk the items again.
+     * Off by default, parsing does not write to the trace directory.
+     */
+    void setWriteIndex(bool write) {
+        m_writeIndex = write;
+    }
+
     bool parse(const std::vector<std::string> fileNames);
     bool parse(const std::string &file);
+
+    /**
+     * Only processes the items of the given state. On version 2 traces
+     * with an index, the blocks of the other states are not read.
+     */
+    bool parseState(const std::string &file, uint32_t stateId);
+
+    /**
+     * Runs clones of the processor over the trace on the given number of
+     * threads. States are partitioned across threads, so that each state's
+     * items are processed in order by a single clone. Item indices are the
+     * same as parse() would produce for this file alone. Does not emit
+     * onEachItem and does not keep the items for getItem().
+     */
+    bool parallelParse(const std::string &file, ParallelItemProcessor &processor,
+                       unsigned threads);
+    /**
+     * The payload of an item of a version 2 trace is only valid until
+     * the next call.
+     */
     bool getItem(unsigned index, s2e::plugins::ExecutionTraceItemHeader &hdr, void **data);
 
     virtual ItemProcessorState* getState(void *processor, ItemProcessorStateFactory f);
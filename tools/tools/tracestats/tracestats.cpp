@@ -0,0 +1,167 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in the S2E-AUTHORS file.
+ */
+
+
+#include "llvm/Support/CommandLine.h"
+
+#include <lib/ExecutionTracer/LogParser.h>
+
+#include <s2e/Plugins/ExecutionTracers/TraceEntries.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+
+using namespace llvm;
+using namespace s2etools;
+
+namespace {
+
+cl::list<std::string>
+    TraceFiles("trace", llvm::cl::value_desc("Input trace"), llvm::cl::Prefix,
+               llvm::cl::desc("Specify an execution trace file"));
+
+cl::opt<std::string>
+    LogDir("outputdir", cl::desc("Store the statistics into the given folder"), cl::init("."));
+
+cl::opt<int>
+    StateId("state", cl::desc("Only count the items of the given state (-1 for all)"), cl::init(-1));
+
+cl::opt<unsigned>
+    Threads("threads", cl::desc("Number of threads parsing each trace"), cl::init(1));
+
+cl::opt<bool>
+    WriteIndex("write-index", cl::desc("Cache the item index of version 1 traces next to them"), cl::init(false));
+
+}
+
+namespace s2etools
+{
+
+/**
+ *  Counts the items and payload bytes of each type, per state.
+ */
+class TraceStats: public ParallelItemProcessor
+{
+public:
+    struct Counts {
+        uint64_t items;
+        uint64_t bytes;
+
+        Counts() : items(0), bytes(0) {}
+    };
+
+    typedef std::map<uint8_t, Counts> TypeCounts;
+    typedef std::map<uint32_t, TypeCounts> StateCounts;
+
+private:
+    StateCounts m_counts;
+
+public:
+    virtual ParallelItemProcessor *clone() const {
+        return new TraceStats();
+    }
+
+    virtual void onItem(unsigned traceIndex,
+                        const s2e::plugins::ExecutionTraceItemHeader &hdr,
+                        void *data) {
+        Counts &c = m_counts[hdr.stateId][hdr.type];
+        ++c.items;
+        c.bytes += hdr.size;
+    }
+
+    virtual void merge(const ParallelItemProcessor *other) {
+        const StateCounts &counts = static_cast<const TraceStats*>(other)->m_counts;
+        StateCounts::const_iterator sit;
+        for (sit = counts.begin(); sit != counts.end(); ++sit) {
+            TypeCounts::const_iterator tit;
+            for (tit = (*sit).second.begin(); tit != (*sit).second.end(); ++tit) {
+                Counts &c = m_counts[(*sit).first][(*tit).first];
+                c.items += (*tit).second.items;
+                c.bytes += (*tit).second.bytes;
+            }
+        }
+    }
+
+    void output(std::ostream &os) const {
+        os << "#State Type Items Bytes" << std::endl;
+
+        StateCounts::const_iterator sit;
+        for (sit = m_counts.begin(); sit != m_counts.end(); ++sit) {
+            TypeCounts::const_iterator tit;
+            for (tit = (*sit).second.begin(); tit != (*sit).second.end(); ++tit) {
+                os << std::dec << (*sit).first << " " << (unsigned) (*tit).first << " "
+                   << (*tit).second.items << " " << (*tit).second.bytes << std::endl;
+            }
+        }
+    }
+};
+
+}
+
+int main(int argc, char **argv)
+{
+    cl::ParseCommandLineOptions(argc, (char**) argv, " tracestats");
+
+    LogParser parser;
+    parser.setWriteIndex(WriteIndex);
+
+    TraceStats stats;
+
+    if (StateId >= 0) {
+        //Version 2 traces only decode the blocks of that state
+        parser.onEachItem.connect(
+                sigc::mem_fun(stats, &TraceStats::onItem));
+    }
+
+    for (unsigned i = 0; i < TraceFiles.size(); ++i) {
+        bool complete;
+        if (StateId >= 0) {
+            complete = parser.parseState(TraceFiles[i], StateId);
+        } else {
+            complete = parser.parallelParse(TraceFiles[i], stats, Threads);
+        }
+
+        if (!complete) {
+            std::cerr << TraceFiles[i] << " is incomplete" << std::endl;
+        }
+    }
+
+    std::string outFileStr = LogDir + "/tracestats.txt";
+    std::ofstream outFile(outFileStr.c_str());
+    stats.output(outFile);
+
+    return 0;
+}
@@ -0,0 +1,244 @@
+//===-- LogParserTest.cpp -------------------------------------------------===//
+//
+//                     S2E Selective Symbolic Execution Framework
+//
+//===----------------------------------------------------------------------===//
+
+#include "gtest/gtest.h"
+
+#include <lib/ExecutionTracer/LogParser.h>
+#include <s2e/Plugins/ExecutionTracers/TraceCompression.h>
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace s2etools;
+using namespace s2e::plugins;
+
+namespace {
+
+struct Item {
+  unsigned index;
+  uint64_t timeStamp;
+  uint32_t stateId;
+  uint8_t type;
+  std::vector<uint8_t> payload;
+
+  bool operator<(const Item &other) const { return index < other.index; }
+
+  bool operator==(const Item &other) const {
+    return index == other.index && timeStamp == other.timeStamp &&
+           stateId == other.stateId && type == other.type &&
+           payload == other.payload;
+  }
+};
+
+typedef std::vector<Item> Items;
+
+class ItemRecorder : public ParallelItemProcessor {
+public:
+  Items items;
+
+  ParallelItemProcessor *clone() const { return new ItemRecorder(); }
+
+  void onItem(unsigned traceIndex, const ExecutionTraceItemHeader &hdr,
+              void *data) {
+    Item item;
+    item.index = traceIndex;
+    item.timeStamp = hdr.timeStamp;
+    item.stateId = hdr.stateId;
+    item.type = hdr.type;
+    const uint8_t *bytes = (const uint8_t*) data;
+    item.payload.assign(bytes, bytes + hdr.size);
+    items.push_back(item);
+  }
+
+  void merge(const ParallelItemProcessor *other) {
+    const Items &o = static_cast<const ItemRecorder*>(other)->items;
+    items.insert(items.end(), o.begin(), o.end());
+  }
+};
+
+/// Items of three states, the states take turns every few items.
+Items generateItems() {
+  Items items;
+  for (unsigned i = 0; i < 300; ++i) {
+    Item item;
+    item.index = i;
+    item.timeStamp = 1000 + i * 7;
+    item.stateId = (i / 5) % 3;
+    item.type = i % 2 ? TRACE_TB_START : TRACE_FORK;
+    item.payload.resize(8 + i % 13);
+    for (unsigned j = 0; j < item.payload.size(); ++j)
+      item.payload[j] = (uint8_t) (i * 31 + j);
+    items.push_back(item);
+  }
+  return items;
+}
+
+void writeItem(FILE *fp, const Item &item) {
+  ExecutionTraceItemHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.timeStamp = item.timeStamp;
+  hdr.size = item.payload.size();
+  hdr.type = item.type;
+  hdr.stateId = item.stateId;
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  fwrite(&item.payload[0], item.payload.size(), 1, fp);
+}
+
+void writeBlock(FILE *fp, uint32_t stateId, const TraceBlockEncoder &encoder,
+                bool compress) {
+  const std::vector<uint8_t> &data = encoder.getData();
+
+  ExecutionTraceBlockHeader hdr;
+  hdr.magic = TRACE_BLOCK_MAGIC;
+  hdr.stateId = stateId;
+  hdr.pid = 0;
+  hdr.timeStamp = encoder.getTimeStamp();
+  hdr.itemCount = encoder.getItemCount();
+  hdr.rawSize = data.size();
+
+  std::vector<uint8_t> compressed(traceCompressBound(data.size()));
+  hdr.compressedSize = hdr.rawSize;
+  if (compress) {
+    unsigned size = traceCompress(&data[0], data.size(), &compressed[0]);
+    if (size && size < hdr.rawSize)
+      hdr.compressedSize = size;
+  }
+
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  if (hdr.compressedSize != hdr.rawSize)
+    fwrite(&compressed[0], hdr.compressedSize, 1, fp);
+  else
+    fwrite(&data[0], data.size(), 1, fp);
+}
+
+std::string tempName(const char *suffix) {
+  char name[] = "/tmp/LogParserTest.XXXXXX";
+  int fd = mkstemp(name);
+  close(fd);
+  unlink(name);
+  return std::string(name) + suffix;
+}
+
+std::string writeV1Trace(const Items &items) {
+  std::string name = tempName(".v1");
+  FILE *fp = fopen(name.c_str(), "wb");
+  for (unsigned i = 0; i < items.size(); ++i)
+    writeItem(fp, items[i]);
+  fclose(fp);
+  return name;
+}
+
+/// Every run of items of a state becomes a block, every other block
+/// is compressed.
+std::string writeV2Trace(const Items &items) {
+  std::string name = tempName(".v2");
+  FILE *fp = fopen(name.c_str(), "wb");
+
+  ExecutionTraceFileHeader fhdr;
+  memset(&fhdr, 0, sizeof(fhdr));
+  memcpy(fhdr.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC));
+  fhdr.version = TRACE_FILE_VERSION;
+  fwrite(&fhdr, sizeof(fhdr), 1, fp);
+
+  TraceBlockEncoder encoder;
+  unsigned blocks = 0;
+  for (unsigned i = 0; i < items.size(); ++i) {
+    const Item &item = items[i];
+    encoder.append(item.timeStamp, item.type, &item.payload[0],
+                   item.payload.size());
+    if (i + 1 == items.size() || items[i + 1].stateId != item.stateId) {
+      writeBlock(fp, item.stateId, encoder, blocks++ % 2);
+      encoder.reset();
+    }
+  }
+
+  fclose(fp);
+  return name;
+}
+
+Items parseSerially(const std::string &name) {
+  LogParser parser;
+  ItemRecorder recorder;
+  parser.onEachItem.connect(sigc::mem_fun(recorder, &ItemRecorder::onItem));
+  EXPECT_TRUE(parser.parse(name));
+  return recorder.items;
+}
+
+Items parseInParallel(const std::string &name, unsigned threads) {
+  LogParser parser;
+  ItemRecorder recorder;
+  EXPECT_TRUE(parser.parallelParse(name, recorder, threads));
+  std::sort(recorder.items.begin(), recorder.items.end());
+  return recorder.items;
+}
+
+void checkTrace(const std::string &name, const Items &expected) {
+  Items serial = parseSerially(name);
+  EXPECT_TRUE(serial == expected);
+
+  for (unsigned threads = 1; threads <= 4; ++threads)
+    EXPECT_TRUE(parseInParallel(name, threads) == serial);
+
+  // A single state keeps the order of its items, numbered from zero.
+  LogParser parser;
+  ItemRecorder recorder;
+  parser.onEachItem.connect(sigc::mem_fun(recorder, &ItemRecorder::onItem));
+  EXPECT_TRUE(parser.parseState(name, 1));
+
+  Items state;
+  for (unsigned i = 0; i < expected.size(); ++i) {
+    if (expected[i].stateId == 1) {
+      state.push_back(expected[i]);
+      state.back().index = state.size() - 1;
+    }
+  }
+  EXPECT_TRUE(recorder.items == state);
+
+  // getItem() returns the same items after parsing.
+  ExecutionTraceItemHeader hdr;
+  void *data;
+  for (unsigned i = 0; i < state.size(); ++i) {
+    ASSERT_TRUE(parser.getItem(i, hdr, &data));
+    EXPECT_EQ(state[i].timeStamp, hdr.timeStamp);
+    EXPECT_EQ(0, memcmp(data, &state[i].payload[0], hdr.size));
+  }
+}
+
+TEST(LogParserTest, Version1) {
+  Items items = generateItems();
+  std::string name = writeV1Trace(items);
+
+  checkTrace(name, items);
+
+  // The index is only written on request.
+  std::string indexName = name + ".idx";
+  EXPECT_NE(0, access(indexName.c_str(), F_OK));
+
+  LogParser parser;
+  parser.setWriteIndex(true);
+  EXPECT_TRUE(parser.parse(name));
+  EXPECT_EQ(0, access(indexName.c_str(), F_OK));
+
+  // Parsing with the cached index gives the same items.
+  checkTrace(name, items);
+
+  unlink(indexName.c_str());
+  unlink(name.c_str());
+}
+
+TEST(LogParserTest, Version2) {
+  Items items = generateItems();
+  std::string name = writeV2Trace(items);
+
+  checkTrace(name, items);
+
+  unlink(name.c_str());
+}
+
+}
@@ -0,0 +1,92 @@
+//===-- LoadBalancingTest.cpp ---------------------------------------------===//
+//
+//                     S2E Selective Symbolic Execution Framework
+//
+//===----------------------------------------------------------------------===//
+
+#include "gtest/gtest.h"
+
+#include <s2e/LoadBalancing.h>
+
+using namespace s2e;
+
+namespace {
+
+const unsigned Free = (unsigned)-1;
+const unsigned MinStates = 8;
+
+TEST(LoadBalancingTest, SingleProcess) {
+  unsigned counts[4] = { 0, 0, 0, 0 };
+  unsigned ids[4] = { 0, Free, Free, Free };
+
+  // Below the threshold and nobody asked for work
+  counts[0] = MinStates - 1;
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 4, 1, 0, false, MinStates));
+
+  counts[0] = MinStates;
+  EXPECT_TRUE(shouldDonateStates(counts, ids, 4, 1, 0, false, MinStates));
+
+  // A request lowers the threshold down to two states
+  counts[0] = 2;
+  EXPECT_TRUE(shouldDonateStates(counts, ids, 4, 1, 0, true, MinStates));
+  counts[0] = 1;
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 4, 1, 0, true, MinStates));
+  counts[0] = 0;
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 4, 1, 0, true, MinStates));
+
+  // No free slot left
+  counts[0] = 100;
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 1, 1, 0, true, MinStates));
+}
+
+TEST(LoadBalancingTest, UnevenQueues) {
+  unsigned counts[4] = { 3, 20, 5, 40 };
+  unsigned ids[4] = { 0, 1, 2, Free };
+
+  // Slot 3 is free, its stale count must be ignored. Only slot 1 donates.
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 4, 3, 0, true, MinStates));
+  EXPECT_TRUE(shouldDonateStates(counts, ids, 4, 3, 1, true, MinStates));
+  EXPECT_TRUE(shouldDonateStates(counts, ids, 4, 3, 1, false, MinStates));
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 4, 3, 2, true, MinStates));
+
+  // Once slot 3 is live it is the busiest one
+  ids[3] = 3;
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 4, 3, 1, true, MinStates));
+  EXPECT_TRUE(shouldDonateStates(counts, ids, 4, 3, 3, true, MinStates));
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 4, 4, 3, true, MinStates));
+}
+
+TEST(LoadBalancingTest, TiesGoToLowestSlot) {
+  unsigned counts[3] = { 10, 10, 10 };
+  unsigned ids[3] = { Free, 1, 2 };
+
+  EXPECT_TRUE(shouldDonateStates(counts, ids, 3, 2, 1, true, MinStates));
+  EXPECT_FALSE(shouldDonateStates(counts, ids, 3, 2, 2, true, MinStates));
+}
+
+TEST(LoadBalancingTest, SplitIsDisjointAndComplete) {
+  for (unsigned count = 0; count < 10; ++count) {
+    unsigned parent = 0, child = 0;
+    for (unsigned rank = 0; rank < count; ++rank) {
+      bool p = keepsStateAfterFork(rank, false);
+      bool c = keepsStateAfterFork(rank, true);
+      EXPECT_NE(p, c);
+      parent += p;
+      child += c;
+    }
+
+    EXPECT_EQ(parent, statesKeptAfterFork(count, false));
+    EXPECT_EQ(child, statesKeptAfterFork(count, true));
+    EXPECT_EQ(count, parent + child);
+    EXPECT_LE(child, parent);
+    EXPECT_LE(parent - child, 1u);
+  }
+
+  // The most promising state stays in the parent, the next one moves
+  EXPECT_TRUE(keepsStateAfterFork(0, false));
+  EXPECT_TRUE(keepsStateAfterFork(1, true));
+  EXPECT_EQ(1u, statesKeptAfterFork(1, false));
+  EXPECT_EQ(0u, statesKeptAfterFork(1, true));
+}
+
+}